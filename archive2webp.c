@@ -4,77 +4,34 @@
     a binary search between quality settings 1 and 99 to find the best match.
 */
 
+#include <float.h>
 #include <getopt.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
-#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#include <float.h>
-#include <limits.h>
 
-#include "../libwebp/src/webp/encode.h"
-#include "../libwebp/src/webp/encode.h"
-
-#include "src/edit.h"
-#include "src/iqa/include/iqa.h"
-#include "src/smallfry.h"
+#include "src/daemon.h"
+#include "src/libarchive2webp.h"
+#include "src/search.h"
 #include "src/util.h"
 
 #ifdef _WIN32
 #include <io.h>
 #include <fcntl.h>
+#else
+#include <unistd.h>
 #endif
 
 const char *COMMENT = "Compressed by archive2webp";
 
-// Comparison method
-enum METHOD {
-    UNKNOWN,
-    SSIM,
-    MS_SSIM,
-    SMALLFRY,
-    MPE
-};
-
-const char methodName[5][9] = {
-    "",
-    "ssim",
-    "ms-ssim",
-    "smallfry",
-    "mpe"
-};
-
-int method = SSIM;
-
-// Number of binary search steps
-int attempts = 8;
-
-// Target quality (SSIM) value
-enum QUALITY_PRESET {
-    LOW,
-    MEDIUM,
-    HIGH,
-    VERYHIGH
-};
-
-float target = 0;
-int preset = MEDIUM;
-
-// Min/max image quality
-int qMin = 1;
-int qMax = 99;
-
-// Defish the image?
-float defishStrength = 0.0;
-float defishZoom = 1.0;
-
-// Input format
-enum filetype inputFiletype = FILETYPE_AUTO;
-
 // Quiet mode (less output)
 int quiet = 0;
 
+// Most sizes --widths can make of one image
+#define MAX_WIDTHS 16
+
 static enum QUALITY_PRESET parseQuality(const char *s) {
     if (!strcmp("low", s))
         return LOW;
@@ -111,73 +68,49 @@ static enum filetype parseInputFiletype(const char *s) {
     return FILETYPE_UNKNOWN;
 }
 
-static void setTargetFromPreset() {
-    switch (method) {
-        case SSIM:
-            switch (preset) {
-                case LOW:
-                    target = (float)0.995;
-                    break;
-                case MEDIUM:
-                    target = (float)0.999;
-                    break;
-                case HIGH:
-                    target = (float)0.9995;
-                    break;
-                case VERYHIGH:
-                    target = (float)0.9999;
-                    break;
-            }
-            break;
-        case MS_SSIM:
-            switch (preset) {
-                case LOW:
-                    target = (float)0.85;
-                    break;
-                case MEDIUM:
-                    target = (float)0.94;
-                    break;
-                case HIGH:
-                    target = (float)0.96;
-                    break;
-                case VERYHIGH:
-                    target = (float)0.98;
-                    break;
-            }
-            break;
-        case SMALLFRY:
-            switch (preset) {
-                case LOW:
-                    target = (float)100.75;
-                    break;
-                case MEDIUM:
-                    target = (float)102.25;
-                    break;
-                case HIGH:
-                    target = (float)103.8;
-                    break;
-                case VERYHIGH:
-                    target = (float)105.5;
-                    break;
-            }
-            break;
-        case MPE:
-            switch (preset) {
-                case LOW:
-                    target = (float)1.5;
-                    break;
-                case MEDIUM:
-                    target = (float)1.0;
-                    break;
-                case HIGH:
-                    target = (float)0.8;
-                    break;
-                case VERYHIGH:
-                    target = (float)0.6;
-                    break;
-            }
-            break;
-    }
+static int parseSubsampling(const char *s) {
+    if (!strcmp("default", s))
+        return SUBSAMPLE_DEFAULT;
+    else if (!strcmp("disable", s))
+        return SUBSAMPLE_444;
+
+    error("unknown sampling method: %s", s);
+    return SUBSAMPLE_DEFAULT;
+}
+
+// Parse a comma separated list of widths. Returns how many, or 0 if invalid.
+static int parseWidths(const char *s, int *widths) {
+    int count = 0;
+    char *end;
+
+    do {
+        if (count == MAX_WIDTHS)
+            return 0;
+
+        long width = strtol(s, &end, 10);
+        if (end == s || width < 1 || width > 65535)
+            return 0;
+
+        widths[count++] = width;
+        s = end + 1;
+    } while (*end == ',');
+
+    return *end ? 0 : count;
+}
+
+// Path of the output at one width, the width inserted before the extension
+static void widthPath(const char *path, int width, char *out, size_t size) {
+    const char *dot = strrchr(path, '.');
+    const char *slash = strrchr(path, '/');
+    const char *backslash = strrchr(path, '\\');
+
+    if (backslash > slash)
+        slash = backslash;
+
+    if (dot == NULL || (slash != NULL && dot < slash))
+        dot = path + strlen(path);
+
+    snprintf(out, size, "%.*s-%i%s", (int) (dot - path), path, width, dot);
 }
 
 // Open a file for writing
@@ -193,6 +126,28 @@ FILE *openOutput(char *name) {
     }
 }
 
+// Write an image to a file, or stdout for "-". Returns 1 on success.
+static int writeOutput(char *path, const unsigned char *data, size_t size) {
+    FILE *file = openOutput(path);
+    if (file == NULL) {
+        error("could not open output file: %s", path);
+        return 0;
+    }
+
+    if (fwrite(data, size, 1, file) != 1) {
+        fclose(file);
+        error("could not write to output file: %s", path);
+        return 0;
+    }
+
+    if (fclose(file)) {
+        error("could not close the output file: %s", path);
+        return 0;
+    }
+
+    return 1;
+}
+
 // Logs an informational message, taking quiet mode into account
 void info(const char *format, ...) {
     va_list argptr;
@@ -204,8 +159,15 @@ void info(const char *format, ...) {
     }
 }
 
+// Passes progress messages from the conversion on to info()
+static void logMessage(void *opaque, const char *message) {
+    (void) opaque;
+    info("%s", message);
+}
+
 void usage(void) {
-    printf("usage: %s [options] input.jpg output.webp\n\n", progname);
+    printf("usage: %s [options] input.jpg output.webp\n", progname);
+    printf("       %s --serve socket [-W workers] [-k queue] [-o timeout] [-C cache]\n\n", progname);
     printf("options:\n\n");
     printf("  -V, --version                output program version\n");
     printf("  -h, --help                   output program help\n");
@@ -220,31 +182,112 @@ void usage(void) {
     printf("  -r, --ppm                    parse input as PPM\n");
     printf("  -T, --input-filetype [arg]   set input file type to one of 'auto', 'jpeg', 'ppm' [auto]\n");
     printf("  -Q, --quiet                  only print out errors\n");
+    printf("  -C, --cache [arg]            reuse and record search results in the given cache file\n");
+    printf("  -g, --min-saving [arg]       stop once the search cannot save this many bytes, or percent with %%, more [0]\n");
+    printf("  -D, --deadline-ms [arg]      stop the search in time to finish within this many milliseconds [0]\n");
+    printf("  -b, --target-size [arg]      find the highest quality that fits in this many bytes, skipping the metric\n");
+    printf("  -e, --sample [arg]           estimate wide search steps from this percentage of the image [0]\n");
+    printf("  -u, --surrogate              decide search steps before the last on PSNR, calibrated to the method per image\n");
+    printf("  -j, --jpeg [arg]             also write an optimized JPEG to this file, searched at the same time\n");
+    printf("  -J, --jpeg-target [arg]      set target quality of the JPEG [preset's JPEG target]\n");
+    printf("  -a, --accurate               favor accuracy over speed in the JPEG search\n");
+    printf("  -p, --no-progressive         disable progressive JPEG encoding\n");
+    printf("  -S, --subsample [arg]        set JPEG subsampling method to one of 'default', 'disable' [default]\n");
+    printf("  -w, --widths [arg]           make each of these comma separated widths from one decode, writing e.g. output-800.webp\n");
+    printf("  -s, --serve [arg]            serve conversions on this Unix socket, taking no input or output\n");
+    printf("  -c, --connect [arg]          have the service on this Unix socket do the conversion, with its cache\n");
+    printf("  -W, --workers [arg]          set the number of worker processes of the service [one per CPU]\n");
+    printf("  -k, --queue [arg]            set the socket backlog of requests waiting for a worker [64]\n");
+    printf("  -o, --request-timeout [arg]  replace a worker whose request takes more than this many seconds [0]\n");
 }
 
-int main (int argc, char **argv) {
-    const char *optstring = "Vht:q:n:x:l:m:d:z:r:T:Q";
-    static const struct option opts[] = {
-        { "version", no_argument, 0, 'V' },
-        { "help", no_argument, 0, 'h' },
-        { "target", required_argument, 0, 't' },
-        { "quality", required_argument, 0, 'q' },
-        { "min", required_argument, 0, 'n' },
-        { "max", required_argument, 0, 'x' },
-        { "loops", required_argument, 0, 'l' },
-        { "method", required_argument, 0, 'm' },
-        { "defish", required_argument, 0, 'd' },
-        { "zoom", required_argument, 0, 'z' },
-        { "ppm", no_argument, 0, 'r' },
-        { "input-filetype", required_argument, 0, 'T' },
-        { "quiet", no_argument, 0, 'Q' },
-        { 0, 0, 0, 0 }
-    };
+// Everything asked for on the command line
+struct command {
+    struct archive2webpOptions options;
+    char *jpegPath;
+    int widths[MAX_WIDTHS];
+    int widthCount;
+    // Only print out errors
+    int quiet;
+    // Socket to serve requests on, or to send this one to
+    const char *servePath;
+    const char *connectPath;
+    struct daemonSettings daemon;
+};
+
+// Options of the command line
+static const char *OPTSTRING = "Vht:q:n:x:l:m:d:z:r:T:QC:g:D:b:e:uj:J:apS:w:s:c:W:k:o:";
+static const struct option OPTIONS[] = {
+    { "version", no_argument, 0, 'V' },
+    { "help", no_argument, 0, 'h' },
+    { "target", required_argument, 0, 't' },
+    { "quality", required_argument, 0, 'q' },
+    { "min", required_argument, 0, 'n' },
+    { "max", required_argument, 0, 'x' },
+    { "loops", required_argument, 0, 'l' },
+    { "method", required_argument, 0, 'm' },
+    { "defish", required_argument, 0, 'd' },
+    { "zoom", required_argument, 0, 'z' },
+    { "ppm", no_argument, 0, 'r' },
+    { "input-filetype", required_argument, 0, 'T' },
+    { "quiet", no_argument, 0, 'Q' },
+    { "cache", required_argument, 0, 'C' },
+    { "min-saving", required_argument, 0, 'g' },
+    { "deadline-ms", required_argument, 0, 'D' },
+    { "target-size", required_argument, 0, 'b' },
+    { "sample", required_argument, 0, 'e' },
+    { "surrogate", no_argument, 0, 'u' },
+    { "jpeg", required_argument, 0, 'j' },
+    { "jpeg-target", required_argument, 0, 'J' },
+    { "accurate", no_argument, 0, 'a' },
+    { "no-progressive", no_argument, 0, 'p' },
+    { "subsample", required_argument, 0, 'S' },
+    { "widths", required_argument, 0, 'w' },
+    { "serve", required_argument, 0, 's' },
+    { "connect", required_argument, 0, 'c' },
+    { "workers", required_argument, 0, 'W' },
+    { "queue", required_argument, 0, 'k' },
+    { "request-timeout", required_argument, 0, 'o' },
+    { 0, 0, 0, 0 }
+};
+
+// Options a request to the daemon may carry. The rest, such as the
+// cache, belong to the service and come from its own command line.
+#define REQUEST_OPTIONS "tqnxlmdzrTQgDbeujJapSw"
+
+// Start parsing arguments afresh, as for each request to the daemon
+static void resetArguments(void) {
+#if defined(__GLIBC__)
+    optind = 0;
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+    optreset = 1;
+    optind = 1;
+#else
+    optind = 1;
+#endif
+}
+
+// Parse the options into command, only those of REQUEST_OPTIONS if this
+// is a request to the daemon. Returns -1 to go on, or the exit status.
+static int parseArguments(int argc, char **argv, struct command *command, int request) {
     int opt, longind = 0;
+    long value;
 
-    progname = "archive2webp";
+    memset(command, 0, sizeof(*command));
+    archive2webpOptionsInit(&command->options);
+    command->options.log = logMessage;
+    command->daemon.queueLength = 64;
+
+    while ((opt = getopt_long(argc, argv, OPTSTRING, OPTIONS, &longind)) != -1) {
+        // getopt() has already complained about an unknown option
+        if (request && opt == '?')
+            return 1;
+
+        if (request && !strchr(REQUEST_OPTIONS, opt)) {
+            error("option not allowed in a request: -%c", opt);
+            return 1;
+        }
 
-    while ((opt = getopt_long(argc, argv, optstring, opts, &longind)) != -1) {
         switch (opt) {
         case 'V':
             version();
@@ -253,315 +296,440 @@ int main (int argc, char **argv) {
             usage();
             return 0;
         case 't':
-            target = atof(optarg);
+            if (!parseFloat(optarg, 0, FLT_MAX, &command->options.target)) {
+                error("invalid target quality: %s", optarg);
+                return 1;
+            }
             break;
         case 'q':
-            preset = parseQuality(optarg);
+            command->options.preset = parseQuality(optarg);
             break;
         case 'n':
-            qMin = atoi(optarg);
+            if (!parseLong(optarg, QUALITY_MIN, QUALITY_MAX, &value)) {
+                error("invalid minimum image quality: %s", optarg);
+                return 1;
+            }
+            command->options.qMin = value;
             break;
         case 'x':
-            qMax = atoi(optarg);
+            if (!parseLong(optarg, QUALITY_MIN, QUALITY_MAX, &value)) {
+                error("invalid maximum image quality: %s", optarg);
+                return 1;
+            }
+            command->options.qMax = value;
             break;
         case 'l':
-            attempts = atoi(optarg);
+            if (!parseLong(optarg, 1, QUALITY_MAX - QUALITY_MIN + 1, &value)) {
+                error("invalid number of runs: %s", optarg);
+                return 1;
+            }
+            command->options.attempts = value;
             break;
         case 'm':
-            method = parseMethod(optarg);
+            command->options.method = parseMethod(optarg);
             break;
         case 'd':
-            defishStrength = atof(optarg);
+            if (!parseFloat(optarg, 0, 100, &command->options.defishStrength)) {
+                error("invalid defish strength: %s", optarg);
+                return 1;
+            }
             break;
         case 'z':
-            defishZoom = atof(optarg);
+            if (!parseFloat(optarg, 0.01, 100, &command->options.defishZoom)) {
+                error("invalid defish zoom: %s", optarg);
+                return 1;
+            }
             break;
         case 'r':
-            inputFiletype = FILETYPE_PPM;
+            command->options.inputFiletype = FILETYPE_PPM;
             break;
         case 'T':
-            if (inputFiletype != FILETYPE_AUTO) {
+            if (command->options.inputFiletype != FILETYPE_AUTO) {
                 error("multiple file types specified for the input file");
                 return 1;
             }
-            inputFiletype = parseInputFiletype(optarg);
+            command->options.inputFiletype = parseInputFiletype(optarg);
             break;
         case 'Q':
-            quiet = 1;
+            command->quiet = 1;
+            break;
+        case 'C':
+            command->options.cachePath = optarg;
+            break;
+        case 'g':
+            if (!parseMinSaving(optarg, &command->options.minSaving, &command->options.minSavingPercent)) {
+                error("invalid minimum saving: %s", optarg);
+                return 1;
+            }
+            break;
+        case 'D':
+            if (!parseLong(optarg, 0, LONG_MAX, &command->options.deadlineMs)) {
+                error("invalid deadline: %s", optarg);
+                return 1;
+            }
+            break;
+        case 'b':
+            if (!parseLong(optarg, 0, LONG_MAX, &value)) {
+                error("invalid target size: %s", optarg);
+                return 1;
+            }
+            command->options.targetSize = value;
+            break;
+        case 'e':
+            if (!parseFloat(optarg, 0, 100, &command->options.samplePercent)) {
+                error("invalid sample percentage: %s", optarg);
+                return 1;
+            }
+            break;
+        case 'u':
+            command->options.useSurrogate = 1;
+            break;
+        case 'j':
+            command->jpegPath = optarg;
+            command->options.jpeg = 1;
+            break;
+        case 'J':
+            if (!parseFloat(optarg, 0, FLT_MAX, &command->options.jpegTarget)) {
+                error("invalid JPEG target quality: %s", optarg);
+                return 1;
+            }
+            break;
+        case 'a':
+            command->options.jpegAccurate = 1;
+            break;
+        case 'p':
+            command->options.jpegProgressive = 0;
+            break;
+        case 'S':
+            command->options.jpegSubsample = parseSubsampling(optarg);
+            break;
+        case 'w':
+            command->widthCount = parseWidths(optarg, command->widths);
+            if (!command->widthCount) {
+                error("invalid widths, expected up to %i comma separated numbers: %s", MAX_WIDTHS, optarg);
+                return 1;
+            }
+            break;
+        case 's':
+            command->servePath = optarg;
+            break;
+        case 'c':
+            command->connectPath = optarg;
+            break;
+        case 'W':
+            if (!parseLong(optarg, 0, 1024, &value)) {
+                error("invalid number of workers: %s", optarg);
+                return 1;
+            }
+            command->daemon.workers = value;
+            break;
+        case 'k':
+            if (!parseLong(optarg, 1, 65535, &value)) {
+                error("invalid queue length: %s", optarg);
+                return 1;
+            }
+            command->daemon.queueLength = value;
+            break;
+        case 'o':
+            if (!parseLong(optarg, 0, INT_MAX, &value)) {
+                error("invalid request timeout: %s", optarg);
+                return 1;
+            }
+            command->daemon.requestTimeout = value;
             break;
         };
     }
 
-    if (argc - optind != 2) {
-        usage();
-        return 255;
-    }
-
-    if (method == UNKNOWN) {
+    if (command->options.method == UNKNOWN) {
         error("invalid method!");
         usage();
         return 255;
     }
 
-    if (qMin > qMax) {
+    if (command->options.qMin > command->options.qMax) {
         error("maximum image quality must not be smaller than minimum image quality!");
         return 1;
     }
 
-    // No target passed, use preset!
-    if (!target) {
-        setTargetFromPreset();
-    }
-
-    WebPConfig config;
-    // if (!WebPConfigPreset(&config, WEBP_PRESET_DEFAULT, 50)) {
-    if (!WebPConfigPreset(&config, WEBP_PRESET_PHOTO, 50)) {
-        error("could not initialize WebP configuration");
-        return 1;
-    }
-    WebPPicture pic;
-    if (!WebPPictureInit(&pic)) {
-        error("could not initialize WebP picture");
-        return 1;
-    }
-    WebPMemoryWriter wrt;
-    WebPMemoryWriterInit(&wrt);
-    pic.writer = WebPMemoryWrite;
-    pic.custom_ptr = (void*)&wrt;
-
-    unsigned char *buf;
-    long bufSize = 0;
-    unsigned char *original;
-    long originalSize = 0;
-    unsigned char *originalGray = NULL;
-    long originalGraySize = 0;
-    unsigned char *compressedGray;
-    long compressedGraySize = 0;
-    unsigned char *tmpImage;
-    uint8_t *decodedImage = NULL;
-    int width, height;
-    FILE *file;
-    char *inputPath = argv[optind];
-    char *outputPath = argv[optind + 1];
-
-    /* Read the input into a buffer. */
-    bufSize = readFile(inputPath, (void **) &buf);
-    if (!bufSize) {
-
-        WebPMemoryWriterClear(&wrt);
-
-        return 1;
-    }
+    return -1;
+}
 
-    /* Detect input file type. */
-    if (inputFiletype == FILETYPE_AUTO)
-        inputFiletype = detectFiletypeFromBuffer(buf, bufSize);
+// Convert the input as the command asks, into one result per width.
+// Returns the number of results, or 0 with a message in results[0].error.
+static int convertInput(const struct command *command, const unsigned char *input, size_t inputSize, struct archive2webpResult *results) {
+    if (command->widthCount)
+        return archive2webpConvertWidths(&command->options, input, inputSize, command->widths, command->widthCount, results) ? command->widthCount : 0;
 
-    /* Read original image and decode. */
-    originalSize = decodeFileFromBuffer(buf, bufSize, &original, inputFiletype, &width, &height, JCS_RGB);
+    return archive2webpConvert(&command->options, input, inputSize, &results[0]);
+}
 
-    free(buf);
+/*
+    The reply to a request to the daemon is a line for each progress
+    message, "log <message>", and then for each width a line with the
+    stats of the result followed by the WebP and the JPEG, if any. A
+    failure is a line "error <message>" instead.
+*/
+#define RESULT_RECORD "result width=%i height=%i size=%zu quality=%i metric=%f encodes=%i " \
+                      "jpegSize=%zu jpegQuality=%i jpegMetric=%f jpegEncodes=%i elapsedMs=%lf"
 
-    if (!originalSize) {
-        error("invalid input file: %s", inputPath);
+// Passes progress messages from a conversion in the daemon to the client
+static void sendLog(void *opaque, const char *message) {
+    daemonWriteLine(*(int *) opaque, "log %.*s", (int) strcspn(message, "\n"), message);
+}
 
-        WebPMemoryWriterClear(&wrt);
+// Sends the stats and images of a result to the client. Returns 1 on
+// success.
+static int sendResult(int fd, const struct archive2webpResult *result) {
+    return daemonWriteLine(fd, RESULT_RECORD, result->width, result->height,
+               result->webp.size, result->webp.quality, result->webp.metric, result->webp.encodes,
+               result->jpeg.size, result->jpeg.quality, result->jpeg.metric, result->jpeg.encodes,
+               result->elapsedMs) &&
+           daemonWriteData(fd, result->webp.data, result->webp.size) &&
+           daemonWriteData(fd, result->jpeg.data, result->jpeg.size);
+}
 
-        return 1;
+// Answers a request to the daemon, converting as the command line would
+// with the cache of the service's command line, given as opaque
+static void handleRequest(void *opaque, int argc, char **argv, const unsigned char *input, size_t inputSize, int fd) {
+    const struct command *service = opaque;
+    struct archive2webpResult results[MAX_WIDTHS];
+    struct command command;
+
+    resetArguments();
+    if (parseArguments(argc, argv, &command, 1) != -1 || optind != argc) {
+        daemonWriteLine(fd, "error invalid arguments");
+        return;
     }
 
-    if (defishStrength) {
-        info("Defishing...\n");
-        tmpImage = malloc(width * height * 3);
-        defish(original, tmpImage, width, height, 3, defishStrength, defishZoom);
-        free(original);
-        original = tmpImage;
+    command.options.cachePath = service->options.cachePath;
+    // A quiet client would drop the progress messages anyway
+    command.options.log = command.quiet ? NULL : sendLog;
+    command.options.logOpaque = &fd;
+
+    int count = convertInput(&command, input, inputSize, results);
+    if (!count) {
+        daemonWriteLine(fd, "error %s", results[0].error);
+        return;
     }
 
-    // WebP image dimensions
-    pic.width = width;
-    pic.height = height;
+    // Once a write fails the client is gone, so the rest are only freed
+    int i = 0;
+    while (i < count && sendResult(fd, &results[i]))
+        archive2webpResultFree(&results[i++]);
 
-    int rgb_stride = width * 3;
-    int err = WebPPictureImportRGB(&pic, original, rgb_stride);
-    if (!err) {
-        error("could not import RGB image to WebP");
+    for (; i < count; i++)
+        archive2webpResultFree(&results[i]);
+}
 
-        WebPMemoryWriterClear(&wrt);
-        free(original);
+// Read an image of the size given in its stats from the daemon
+static int receiveOutput(int fd, struct archive2webpOutput *output) {
+    if (output->size > DAEMON_MAX_INPUT * 4UL)
+        return 0;
 
-        return 1;
-    }
+    output->data = malloc(output->size ? output->size : 1);
 
-    // Convert RGB input into Y
-    originalGraySize = grayscale(original, &originalGray, width, height);
-    free(original);
-    if (!originalGraySize) {
-        error("could not create the original grayscale image");
+    return output->data != NULL && daemonReadData(fd, output->data, output->size);
+}
 
-        WebPMemoryWriterClear(&wrt);
-        WebPPictureFree(&pic);
-        return 1;
-    }
+// Collect the options among the first argc arguments that a request may
+// carry into args, each as "-x" or "-x value" in flags whatever form it
+// was given in. Returns the number of arguments, the first the program
+// name, or 0 if there are too many.
+static int requestArguments(int argc, char **argv, char **args, char (*flags)[3], int size) {
+    int opt, count = 1;
 
-    // Do a binary search to find the optimal encoding quality for the
-    // given target SSIM value.
-    float newDiff;
-    float bestDiff = FLT_MAX;
-    int bestQuality = INT_MIN;
-    int quality;
-    int min = qMin, max = qMax;
-    for (int attempt = attempts - 1; attempt >= 0; --attempt) {
-        quality = (min + max) / 2;
+    args[0] = argv[0];
 
-        // We were already at this quality level? If yes then let's make this the final run
-        if (quality == bestQuality)
-            attempt = 0;
+    // The options were checked by the first pass
+    resetArguments();
+    opterr = 0;
+    while ((opt = getopt_long(argc, argv, OPTSTRING, OPTIONS, NULL)) != -1) {
+        if (!strchr(REQUEST_OPTIONS, opt))
+            continue;
 
-        // Terminate early once bisection interval is a singleton.
-        if (min == max)
-            attempt = 0;
+        if (count + 2 > size)
+            return 0;
 
-        WebPMemoryWriterClear(&wrt);
+        flags[count][0] = '-';
+        flags[count][1] = opt;
+        flags[count][2] = '\0';
+        args[count] = flags[count];
+        count++;
+        if (optarg != NULL)
+            args[count++] = optarg;
+    }
 
-        // Recompress to a new quality level
-        config.quality = (float)quality;
-        int ok = WebPEncode(&config, &pic);
-        if (!ok) {
-            error("could not encode image to WebP");
+    return count;
+}
 
-            WebPMemoryWriterClear(&wrt);
-            WebPPictureFree(&pic); // must be called independently of the 'ok' result
-            free(originalGray);
+// Has the daemon convert the input, filling in results as convertInput()
+// would. The options among the first argc arguments are passed on.
+static int requestConversion(const struct command *command, int argc, char **argv, const unsigned char *input, size_t inputSize, struct archive2webpResult *results) {
+    const int count = command->widthCount ? command->widthCount : 1;
+    char reason[sizeof(results[0].error)] = "";
+    // Each argument takes at least two bytes of a request
+    char *args[DAEMON_MAX_ARGUMENTS / 2];
+    char flags[DAEMON_MAX_ARGUMENTS / 2][3];
+    char line[1024];
+    int received = 0;
+
+    memset(results, 0, sizeof(*results) * count);
+
+    int argCount = requestArguments(argc, argv, args, flags, DAEMON_MAX_ARGUMENTS / 2);
+    if (!argCount) {
+        snprintf(results[0].error, sizeof(results[0].error), "too many arguments for the daemon");
+        return 0;
+    }
 
-            return 1;
+    int fd = daemonRequest(command->connectPath, argCount, args, input, inputSize, reason, sizeof(reason));
+    if (fd < 0) {
+        snprintf(results[0].error, sizeof(results[0].error), "%s", reason);
+        return 0;
+    }
 
+    while (received < count && !reason[0] && daemonReadLine(fd, line, sizeof(line))) {
+        struct archive2webpResult *result = &results[received];
+
+        if (!strncmp(line, "log ", 4)) {
+            info("%s\n", line + 4);
+        } else if (!strncmp(line, "error ", 6)) {
+            snprintf(reason, sizeof(reason), "%.*s", (int) sizeof(reason) - 1, line + 6);
+        } else if (sscanf(line, RESULT_RECORD, &result->width, &result->height,
+                       &result->webp.size, &result->webp.quality, &result->webp.metric, &result->webp.encodes,
+                       &result->jpeg.size, &result->jpeg.quality, &result->jpeg.metric, &result->jpeg.encodes,
+                       &result->elapsedMs) == 11 &&
+                   receiveOutput(fd, &result->webp) && receiveOutput(fd, &result->jpeg)) {
+            received++;
+        } else {
+            snprintf(reason, sizeof(reason), "invalid reply from the daemon");
         }
+    }
 
-        // Decode the just encoded buffer
-        decodedImage = WebPDecodeRGB(wrt.mem, wrt.size, &width, &height);
-        if (decodedImage == NULL) {
-            error("unable to decode buffer that was just encoded!");
+    close(fd);
 
-            WebPMemoryWriterClear(&wrt);
-            WebPPictureFree(&pic);
-            free(originalGray);
+    if (received < count) {
+        // The daemon hangs up without a word when the worker dies
+        if (!reason[0])
+            snprintf(reason, sizeof(reason), "the daemon dropped the request, which may have crashed or timed out");
 
-            return 1;
-        }
+        for (int i = 0; i <= received && i < count; i++)
+            archive2webpResultFree(&results[i]);
 
-        // Convert RGB input into Y
-        compressedGraySize = grayscale(decodedImage, &compressedGray, width, height);
+        snprintf(results[0].error, sizeof(results[0].error), "%s", reason);
+        return 0;
+    }
 
-        // Free the decoded RGB image
-        WebPFree(decodedImage);
+    return count;
+}
 
-        if (!compressedGraySize) {
-            error("could not create decoded grayscale image");
+int main (int argc, char **argv) {
+    struct command command;
 
-            WebPMemoryWriterClear(&wrt);
-            WebPPictureFree(&pic);
-            free(originalGray);
+    progname = "archive2webp";
 
-            return 1;
-        }
+    int status = parseArguments(argc, argv, &command, 0);
+    if (status != -1)
+        return status;
+
+    quiet = command.quiet;
 
-        // Measure quality difference
-        float metric;
-        switch (method) {
-            case MS_SSIM:
-                metric = iqa_ms_ssim(originalGray, compressedGray, width, height, width, 0);
-                break;
-            case SMALLFRY:
-                metric = smallfry_metric(originalGray, compressedGray, width, height);
-                break;
-            case MPE:
-                metric = meanPixelError(originalGray, compressedGray, width, height, 1);
-                break;
-            case SSIM: default:
-                metric = iqa_ssim(originalGray, compressedGray, width, height, width, 0, 0);
-                break;
+    if (command.servePath != NULL) {
+        if (argc != optind) {
+            usage();
+            return 255;
         }
 
-        // We no longer need compressedGray
-        free(compressedGray);
+        // Set up once, so every worker starts out ready
+        archive2webpInit();
 
-        newDiff = fabs(target - metric);
-        if (newDiff < bestDiff) {
-            bestDiff = newDiff;
-            bestQuality = quality;
-        }
+        command.daemon.socketPath = command.servePath;
+        info("Serving requests on %s\n", command.servePath);
 
-        if (attempt) {
-            info("%s at q=%u (%02u - %u): %f (target: %f diff: %f) size: %u\n", methodName[method], quality, min, max, metric, target, newDiff, wrt.size);
-        } else {
-            info("Final optimized %s at q=%u: %f (target: %f diff: %f) size: %u\n", methodName[method], quality, metric, target, newDiff, wrt.size);
-        }
+        return daemonServe(&command.daemon, handleRequest, &command) ? 0 : 1;
+    }
 
-        if (metric < target) {
-
-            switch (method) {
-                case SSIM: case MS_SSIM: case SMALLFRY:
-                    // Too distorted, increase quality
-                    min = MIN(quality + 1, max);
-                    break;
-                case MPE:
-                    // Higher than required, decrease quality
-                    max = MAX(quality - 1, min);
-                    break;
-            }
+    if (argc - optind != 2) {
+        usage();
+        return 255;
+    }
 
-        } else {
+    if (command.connectPath != NULL && command.options.cachePath != NULL) {
+        error("the cache of the service is given to --serve");
+        return 1;
+    }
 
-            switch (method) {
-                case SSIM: case MS_SSIM: case SMALLFRY:
-                    // Higher than required, decrease quality
-                    max = MAX(quality - 1, min);
-                    break;
-                case MPE:
-                    // Too distorted, increase quality
-                    min = MIN(quality + 1, max);
-                    break;
-            }
-        }
+    const int widthCount = command.widthCount;
+    const int *widths = command.widths;
+    char *jpegPath = command.jpegPath;
+    struct archive2webpResult results[MAX_WIDTHS];
+    unsigned char *buf;
+    long bufSize = 0;
+    char *inputPath = argv[optind];
+    char *outputPath = argv[optind + 1];
+    char webpPath[1024];
+    char jpegWidthPath[1024];
+    int ok;
 
+    if (widthCount && (!strcmp("-", outputPath) || (jpegPath != NULL && !strcmp("-", jpegPath)))) {
+        error("several widths cannot be written to stdout");
+        return 1;
     }
 
-    WebPPictureFree(&pic);
-    free(originalGray);
+    /* Read the input into a buffer. */
+    bufSize = readFile(inputPath, (void **) &buf);
+    if (!bufSize)
+        return 1;
 
-    // Calculate and show savings, if any
-    int percent = wrt.size * 100 / bufSize;
-    unsigned long saved = (bufSize > wrt.size) ? bufSize - wrt.size : 0;
-    info("New size is %i%% of original (saved %lu kb)\n", percent, saved / 1024);
+    if (command.connectPath != NULL) {
+        // Options come before the input and output once parsed
+        ok = requestConversion(&command, optind, argv, buf, bufSize, results);
+    } else {
+        // Pick the pixel kernels for this CPU before anything is measured
+        archive2webpInit();
 
-    // Open output file for writing
-    file = openOutput(outputPath);
-    if (file == NULL) {
-        error("could not open output file: %s", outputPath);
+        ok = convertInput(&command, buf, bufSize, results);
+    }
 
-        WebPMemoryWriterClear(&wrt);
+    free(buf);
 
+    if (!ok) {
+        error("%s: %s", results[0].error, inputPath);
         return 1;
     }
 
-    /* Write image data. */
-    int wSize = fwrite(wrt.mem, wrt.size, 1, file);
+    for (int i = 0; i < (widthCount ? widthCount : 1); i++) {
+        struct archive2webpResult *result = &results[i];
+        char *webpOut = outputPath;
+        char *jpegOut = jpegPath;
 
-    WebPMemoryWriterClear(&wrt);
+        // Each width is written next to the given output, named by width
+        if (widthCount) {
+            widthPath(outputPath, widths[i], webpPath, sizeof(webpPath));
+            webpOut = webpPath;
+            info("Width %i made at %ix%i\n", widths[i], result->width, result->height);
 
-    if (wSize != 1) {
-        fclose(file);
-        error("could not write to output file: %s", outputPath);
+            if (jpegPath != NULL) {
+                widthPath(jpegPath, widths[i], jpegWidthPath, sizeof(jpegWidthPath));
+                jpegOut = jpegWidthPath;
+            }
+        }
 
-        return 1;
-    }
+        // Calculate and show savings, if any
+        int percent = result->webp.size * 100 / bufSize;
+        unsigned long saved = (bufSize > result->webp.size) ? bufSize - result->webp.size : 0;
+        info("New size is %i%% of original (saved %lu kb)\n", percent, saved / 1024);
 
-    err = fclose(file);
-    if (err) {
-        error("could not close the output file: %s", outputPath);
-        return 1;
+        if (jpegPath != NULL) {
+            percent = result->jpeg.size * 100 / bufSize;
+            saved = (bufSize > result->jpeg.size) ? bufSize - result->jpeg.size : 0;
+            info("New JPEG size is %i%% of original (saved %lu kb)\n", percent, saved / 1024);
+        }
+
+        ok = ok && writeOutput(webpOut, result->webp.data, result->webp.size) &&
+             (jpegOut == NULL || writeOutput(jpegOut, result->jpeg.data, result->jpeg.size));
+
+        archive2webpResultFree(result);
     }
 
-    return 0;
+    return ok ? 0 : 1;
 }
@@ -5,17 +5,20 @@
     that huffman tables are optimized if they weren't already.
 */
 
+#include <float.h>
 #include <getopt.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#include <float.h>
 
+#include "src/cache.h"
+#include "src/cpu.h"
+#include "src/search.h"
 #include "src/edit.h"
-#include "src/iqa/include/iqa.h"
-#include "src/smallfry.h"
+#include "src/jpegcodec.h"
 #include "src/util.h"
 
 #ifdef _WIN32
@@ -26,36 +29,12 @@
 const char *COMMENT = "Compressed by jpeg-recompress";
 const int minDelta = 10;
 
-// Comparison method
-enum METHOD {
-    UNKNOWN,
-    SSIM,
-    MS_SSIM,
-    SMALLFRY,
-    MPE
-};
-
-const char methodName[5][9] = {
-    "",
-    "ssim",
-    "ms-ssim",
-    "smallfry",
-    "mpe"
-};
-
 int method = SSIM;
 
 // Number of binary search steps
 int attempts = 8;
 
 // Target quality (SSIM) value
-enum QUALITY_PRESET {
-    LOW,
-    MEDIUM,
-    HIGH,
-    VERYHIGH
-};
-
 float target = 0;
 int preset = MEDIUM;
 
@@ -88,6 +67,22 @@ int subsample = SUBSAMPLE_DEFAULT;
 // Quiet mode (less output)
 int quiet = 0;
 
+// File used to cache search results between runs
+char *cachePath = NULL;
+
+// Stop searching once the remaining qualities cannot save this much
+unsigned long minSaving = 0;
+float minSavingPercent = 0;
+
+// Output size in bytes to fit instead of a target quality, or 0
+unsigned long targetSize = 0;
+
+// Percentage of the image to estimate wide search steps from, or 0
+float samplePercent = 0;
+
+// Whether to decide search steps on PSNR mapped to the chosen metric
+int useSurrogate = 0;
+
 static enum QUALITY_PRESET parseQuality(const char *s) {
     if (!strcmp("low", s))
         return LOW;
@@ -111,6 +106,8 @@ static enum METHOD parseMethod(const char *s) {
         return SMALLFRY;
     else if (!strcmp("mpe", s))
         return MPE;
+    else if (!strcmp("ssim-dct", s))
+        return SSIM_DCT;
     return UNKNOWN;
 }
 
@@ -124,75 +121,6 @@ static enum filetype parseInputFiletype(const char *s) {
     return FILETYPE_UNKNOWN;
 }
 
-static void setTargetFromPreset() {
-    switch (method) {
-        case SSIM:
-            switch (preset) {
-                case LOW:
-                    target = (float)0.999;
-                    break;
-                case MEDIUM:
-                    target = (float)0.9999;
-                    break;
-                case HIGH:
-                    target = (float)0.99995;
-                    break;
-                case VERYHIGH:
-                    target = (float)0.99999;
-                    break;
-            }
-            break;
-        case MS_SSIM:
-            switch (preset) {
-                case LOW:
-                    target = (float)0.85;
-                    break;
-                case MEDIUM:
-                    target = (float)0.94;
-                    break;
-                case HIGH:
-                    target = (float)0.96;
-                    break;
-                case VERYHIGH:
-                    target = (float)0.98;
-                    break;
-            }
-            break;
-        case SMALLFRY:
-            switch (preset) {
-                case LOW:
-                    target = (float)100.75;
-                    break;
-                case MEDIUM:
-                    target = (float)102.25;
-                    break;
-                case HIGH:
-                    target = (float)103.8;
-                    break;
-                case VERYHIGH:
-                    target = (float)105.5;
-                    break;
-            }
-            break;
-        case MPE:
-            switch (preset) {
-                case LOW:
-                    target = (float)1.5;
-                    break;
-                case MEDIUM:
-                    target = (float)1.0;
-                    break;
-                case HIGH:
-                    target = (float)0.8;
-                    break;
-                case VERYHIGH:
-                    target = (float)0.6;
-                    break;
-            }
-            break;
-    }
-}
-
 static int parseSubsampling(const char *s) {
     if (!strcmp("default", s))
         return SUBSAMPLE_DEFAULT;
@@ -227,6 +155,12 @@ void info(const char *format, ...) {
     }
 }
 
+// Passes progress messages from the search on to info()
+static void logMessage(void *opaque, const char *message) {
+    (void) opaque;
+    info("%s", message);
+}
+
 void usage(void) {
     printf("usage: %s [options] input.jpg output.jpg\n\n", progname);
     printf("options:\n\n");
@@ -238,7 +172,7 @@ void usage(void) {
     printf("  -x, --max [arg]              maximum JPEG quality [99]\n");
     printf("  -l, --loops [arg]            set the number of runs to attempt [8]\n");
     printf("  -a, --accurate               favor accuracy over speed\n");
-    printf("  -m, --method [arg]           set comparison method to one of 'mpe', 'ssim', 'ms-ssim', 'smallfry' [ssim]\n");
+    printf("  -m, --method [arg]           set comparison method to one of 'mpe', 'ssim', 'ms-ssim', 'smallfry', 'ssim-dct' [ssim]\n");
     printf("  -s, --strip                  strip metadata\n");
     printf("  -d, --defish [arg]           set defish strength [0.0]\n");
     printf("  -z, --zoom [arg]             set defish zoom [1.0]\n");
@@ -248,6 +182,18 @@ void usage(void) {
     printf("  -S, --subsample [arg]        set subsampling method to one of 'default', 'disable' [default]\n");
     printf("  -T, --input-filetype [arg]   set input file type to one of 'auto', 'jpeg', 'ppm' [auto]\n");
     printf("  -Q, --quiet                  only print out errors\n");
+    printf("  -C, --cache [arg]            reuse and record search results in the given cache file\n");
+    printf("  -g, --min-saving [arg]       stop once the search cannot save this many bytes, or percent with %%, more [0]\n");
+    printf("  -b, --target-size [arg]      find the highest quality that fits in this many bytes, skipping the metric\n");
+    printf("  -e, --sample [arg]           estimate wide search steps from this percentage of the image [0]\n");
+    printf("  -u, --surrogate              decide search steps before the last on PSNR, calibrated to the method per image\n");
+}
+
+// Whether the input can be written out as it is in place of an encode,
+// which would skip any change asked for to its pixels or metadata, or
+// break the size budget
+static int canCopyInput(long size) {
+    return !defishStrength && !strip && (!targetSize || (unsigned long) size <= targetSize);
 }
 
 int copyFile(char *outputPath, unsigned char *buf, long bufSize) {
@@ -271,7 +217,7 @@ int copyFile(char *outputPath, unsigned char *buf, long bufSize) {
 }
 
 int main (int argc, char **argv) {
-    const char *optstring = "Vht:q:n:x:l:am:sd:z:rcpS:T:Q";
+    const char *optstring = "Vht:q:n:x:l:am:sd:z:rcpS:T:QC:g:b:e:u";
     static const struct option opts[] = {
         { "version", no_argument, 0, 'V' },
         { "help", no_argument, 0, 'h' },
@@ -291,9 +237,15 @@ int main (int argc, char **argv) {
         { "subsample", required_argument, 0, 'S' },
         { "input-filetype", required_argument, 0, 'T' },
         { "quiet", no_argument, 0, 'Q' },
+        { "cache", required_argument, 0, 'C' },
+        { "min-saving", required_argument, 0, 'g' },
+        { "target-size", required_argument, 0, 'b' },
+        { "sample", required_argument, 0, 'e' },
+        { "surrogate", no_argument, 0, 'u' },
         { 0, 0, 0, 0 }
     };
     int opt, longind = 0;
+    long value;
 
     progname = "jpeg-recompress";
 
@@ -306,19 +258,34 @@ int main (int argc, char **argv) {
             usage();
             return 0;
         case 't':
-            target = atof(optarg);
+            if (!parseFloat(optarg, 0, FLT_MAX, &target)) {
+                error("invalid target quality: %s", optarg);
+                return 1;
+            }
             break;
         case 'q':
             preset = parseQuality(optarg);
             break;
         case 'n':
-            qMin = atoi(optarg);
+            if (!parseLong(optarg, QUALITY_MIN, QUALITY_MAX, &value)) {
+                error("invalid minimum JPEG quality: %s", optarg);
+                return 1;
+            }
+            qMin = value;
             break;
         case 'x':
-            qMax = atoi(optarg);
+            if (!parseLong(optarg, QUALITY_MIN, QUALITY_MAX, &value)) {
+                error("invalid maximum JPEG quality: %s", optarg);
+                return 1;
+            }
+            qMax = value;
             break;
         case 'l':
-            attempts = atoi(optarg);
+            if (!parseLong(optarg, 1, QUALITY_MAX - QUALITY_MIN + 1, &value)) {
+                error("invalid number of runs: %s", optarg);
+                return 1;
+            }
+            attempts = value;
             break;
         case 'a':
             accurate = 1;
@@ -330,10 +297,16 @@ int main (int argc, char **argv) {
             strip = 1;
             break;
         case 'd':
-            defishStrength = atof(optarg);
+            if (!parseFloat(optarg, 0, 100, &defishStrength)) {
+                error("invalid defish strength: %s", optarg);
+                return 1;
+            }
             break;
         case 'z':
-            defishZoom = atof(optarg);
+            if (!parseFloat(optarg, 0.01, 100, &defishZoom)) {
+                error("invalid defish zoom: %s", optarg);
+                return 1;
+            }
             break;
         case 'r':
             inputFiletype = FILETYPE_PPM;
@@ -357,6 +330,31 @@ int main (int argc, char **argv) {
         case 'Q':
             quiet = 1;
             break;
+        case 'C':
+            cachePath = optarg;
+            break;
+        case 'g':
+            if (!parseMinSaving(optarg, &minSaving, &minSavingPercent)) {
+                error("invalid minimum saving: %s", optarg);
+                return 1;
+            }
+            break;
+        case 'b':
+            if (!parseLong(optarg, 0, LONG_MAX, &value)) {
+                error("invalid target size: %s", optarg);
+                return 1;
+            }
+            targetSize = value;
+            break;
+        case 'e':
+            if (!parseFloat(optarg, 0, 100, &samplePercent)) {
+                error("invalid sample percentage: %s", optarg);
+                return 1;
+            }
+            break;
+        case 'u':
+            useSurrogate = 1;
+            break;
         };
     }
 
@@ -378,9 +376,12 @@ int main (int argc, char **argv) {
 
     // No target passed, use preset!
     if (!target) {
-        setTargetFromPreset();
+        target = presetTarget(jpegPresets, method, preset);
     }
 
+    // Pick the pixel kernels for this CPU before anything is measured
+    cpuInit();
+
     unsigned char *buf;
     long bufSize = 0;
     unsigned char *original;
@@ -390,13 +391,15 @@ int main (int argc, char **argv) {
     unsigned char *compressed = NULL;
     unsigned long compressedSize = 0;
     unsigned long totalSize = 0;
-    unsigned char *compressedGray;
-    long compressedGraySize = 0;
     unsigned char *tmpImage;
     int width, height;
     unsigned char *metaBuf = NULL;
     unsigned int metaSize = 0;
     unsigned int metaSizeCOM = strlen(COMMENT) + 4;
+    struct jpegHeader header;
+    struct cache *cache = NULL;
+    uint64_t cacheKey = 0;
+    uint64_t priorKey = 0;
     FILE *file;
     char *inputPath = argv[optind];
     char *outputPath = argv[optind + 1];
@@ -411,13 +414,73 @@ int main (int argc, char **argv) {
     if (inputFiletype == FILETYPE_AUTO)
         inputFiletype = detectFiletypeFromBuffer(buf, bufSize);
 
+    if (inputFiletype == FILETYPE_JPEG) {
+        /*
+         * Triage the file using its markers alone, so that files which
+         * will only be copied through never pay for a full decode.
+         */
+        if (!readJpegHeader(buf, bufSize, &header, COMMENT)) {
+            error("invalid input file: %s", inputPath);
+            free(buf);
+            return 1;
+        }
+
+        if (header.hasComment) {
+            if (copyFiles && canCopyInput(bufSize)) {
+                info("File already processed by jpeg-recompress!\n");
+
+                copyFile(outputPath, buf, bufSize);
+
+                free(buf);
+                return 0;
+            } else {
+                error("file already processed by jpeg-recompress!");
+                free(buf);
+                return 2;
+            }
+        }
+
+        /*
+         * Re-encoding above the quality the input was saved at can only
+         * add bytes, so use its quantization tables to cap the search.
+         */
+        int inputQuality = estimateJpegQuality(&header);
+        if (inputQuality) {
+            info("Estimated input quality is %i\n", inputQuality);
+
+            if (inputQuality >= qMin) {
+                qMax = MIN(qMax, inputQuality);
+            } else if (!canCopyInput(bufSize)) {
+                // The changes asked for still have to be made, searching
+                // the whole range
+                info("Input quality is below the minimum JPEG quality, encoding anyway to apply the requested changes\n");
+            } else if (copyFiles) {
+                info("Input quality is below the minimum JPEG quality!\n");
+
+                copyFile(outputPath, buf, bufSize);
+
+                free(buf);
+                return 0;
+            } else {
+                error("input quality is below the minimum JPEG quality!");
+                free(buf);
+                return 1;
+            }
+        }
+
+        // Read metadata (EXIF / IPTC / XMP tags)
+        getMetadata(buf, bufSize, &metaBuf, &metaSize, NULL);
+    }
+
     /*
      * Read original image and decode. We need the raw buffer contents and its
-     * size to obtain meta data and the original file size later.
+     * size to obtain the original file size later.
      */
     originalSize = decodeFileFromBuffer(buf, bufSize, &original, inputFiletype, &width, &height, JCS_RGB);
     if (!originalSize) {
         error("invalid input file: %s", inputPath);
+        if (metaBuf != NULL)
+            free(metaBuf);
         free(buf);
         return 1;
     }
@@ -425,38 +488,28 @@ int main (int argc, char **argv) {
     if (defishStrength) {
         info("Defishing...\n");
         tmpImage = malloc(width * height * 3);
-        defish(original, tmpImage, width, height, 3, defishStrength, defishZoom);
+        if (tmpImage == NULL || !defish(original, tmpImage, width, height, 3, defishStrength, defishZoom)) {
+            error("not enough memory to defish image");
+            free(tmpImage);
+            if (metaBuf != NULL)
+                free(metaBuf);
+            free(original);
+            free(buf);
+            return 1;
+        }
         free(original);
         original = tmpImage;
     }
 
-    // Convert RGB input into Y
-    originalGraySize = grayscale(original, &originalGray, width, height);
-    if (!originalGraySize) {
-        free(original);
-        free(buf);
-        return 1;
-    }
-
-    if (inputFiletype == FILETYPE_JPEG) {
-        // Read metadata (EXIF / IPTC / XMP tags)
-        if (getMetadata(buf, bufSize, &metaBuf, &metaSize, COMMENT)) {
-
-            free(originalGray);
+    // Convert RGB input into Y, unless only the size matters
+    if (!targetSize) {
+        originalGraySize = grayscale(original, &originalGray, width, height);
+        if (!originalGraySize) {
+            if (metaBuf != NULL)
+                free(metaBuf);
             free(original);
-
-            if (copyFiles) {
-                info("File already processed by jpeg-recompress!\n");
-
-                copyFile(outputPath, buf, bufSize);
-
-                free(buf);
-                return 0;
-            } else {
-                error("file already processed by jpeg-recompress!");
-                free(buf);
-                return 2;
-            }
+            free(buf);
+            return 1;
         }
     }
 
@@ -471,141 +524,122 @@ int main (int argc, char **argv) {
         info("Metadata size is %ukb\n", metaSize / 1024);
     }
 
-    // Do a binary search to find the optimal encoding quality for the
-    // given target SSIM value.
-    float newDiff;
-    float bestDiff = FLT_MAX;
-    int bestQuality = INT_MIN;
-    int quality;
-    int min = qMin, max = qMax;
-    for (int attempt = attempts - 1; attempt >= 0; --attempt) {
-        quality = (min + max) / 2;
-
-        // We were already at this quality level? If yes then let's make this
-        // the final run and the final image will be processed optimized this time
-        if (quality == bestQuality)
-            attempt = 0;
-
-        // Terminate early once bisection interval is a singleton.
-        if (min == max)
-            attempt = 0;
-
-        int progressive = attempt ? 0 : !noProgressive;
-        int optimize = accurate ? 1 : (attempt ? 0 : 1);
-
-        // If compressed buffer is not empty the free it
-        if (compressed != NULL) {
-            free(compressed);
-            compressed = NULL;
-        }
-
-        // Recompress to a new quality level, without optimizations (for speed)
-        compressedSize = encodeJpeg(&compressed, original, width, height, JCS_RGB, quality, progressive, optimize, subsample);
-
-        // Load compressed luma for quality comparison
-        compressedGraySize = decodeJpeg(compressed, compressedSize, &compressedGray, &width, &height, JCS_GRAYSCALE);
-        if (!compressedGraySize) {
-            error("unable to decode file that was just encoded!");
-
-            free(compressed);
+    // Metadata and our comment come out of the size budget
+    unsigned long budget = 0;
+    if (targetSize) {
+        if (targetSize <= metaSize + metaSizeCOM) {
+            error("target size is too small to hold the metadata!");
             if (metaBuf != NULL)
                 free(metaBuf);
-            free(originalGray);
             free(original);
             free(buf);
-
             return 1;
         }
 
-        // Measure quality difference
-        float metric;
-        switch (method) {
-            case MS_SSIM:
-                metric = iqa_ms_ssim(originalGray, compressedGray, width, height, width, 0);
-                break;
-            case SMALLFRY:
-                metric = smallfry_metric(originalGray, compressedGray, width, height);
-                break;
-            case MPE:
-                metric = meanPixelError(originalGray, compressedGray, width, height, 1);
-                break;
-            case SSIM: default:
-                metric = iqa_ssim(originalGray, compressedGray, width, height, width, 0, 0);
-                break;
-        }
+        budget = targetSize - metaSize - metaSizeCOM;
+    }
 
-        // We no longer need compressedGray
-        free(compressedGray);
+    if (cachePath) {
+        cache = cacheOpen(cachePath);
+    }
 
-        newDiff = fabs(target - metric);
-        if (newDiff < bestDiff) {
-            bestDiff = newDiff;
-            bestQuality = quality;
-        }
+    if (cache != NULL) {
+        // Key on the pixels to encode plus every setting that affects the search
+        char settings[256];
+        snprintf(settings, sizeof(settings), "%s %s %f %lu %i %i %i %lu %f %f %i %i %i %i %ix%i",
+            progname, methodName[method], target, targetSize, qMin, qMax, attempts,
+            minSaving, minSavingPercent, samplePercent, useSurrogate,
+            accurate, noProgressive, subsample, width, height);
 
-        if (attempt) {
-            info("%s at q=%i (%i - %i): %f (target is %f difference is %f)\n", methodName[method], quality, min, max, metric, target, newDiff);
-        } else {
-            info("Final optimized %s at q=%i (%i - %i): %f (target was %f, difference is %f)\n", methodName[method], quality, min, max, metric, target, newDiff);
-        }
+        cacheKey = hashBuffer(0, settings, strlen(settings));
+        cacheKey = hashBuffer(cacheKey, original, (size_t) width * height * 3);
 
-        totalSize = compressedSize + metaSizeCOM + metaSize;
-        if (metric < target) {
-            if (totalSize + minDelta >= bufSize) {
-                free(compressed);
-                if (metaBuf != NULL)
-                    free(metaBuf);
-                free(originalGray);
-                free(original);
-
-                if (copyFiles) {
-                    info("Output file would be larger than input!\n");
-
-                    copyFile(outputPath, buf, bufSize);
-
-                    free(buf);
-                    return 0;
-                } else {
-                    error("output file would be larger than input!");
-                    free(buf);
-                    return 1;
-                }
-            }
+        // Images of the same size searched the same way share a prior
+        snprintf(settings, sizeof(settings), "prior %s %s %f %lu %lu %f %f %i %ix%i",
+            progname, methodName[method], target, targetSize, minSaving,
+            minSavingPercent, samplePercent, useSurrogate, width, height);
 
-            switch (method) {
-                case SSIM: case MS_SSIM: case SMALLFRY:
-                    // Too distorted, increase quality
-                    min = MIN(quality + 1, max);
-                    break;
-                case MPE:
-                    // Higher than required, decrease quality
-                    max = MAX(quality - 1, min);
-                    break;
-            }
+        priorKey = hashBuffer(0, settings, strlen(settings));
+    }
+
+    // Give up once an encode that is not good enough would already make
+    // the output larger than the input, unless the input cannot stand in
+    // for it
+    long room = bufSize - minDelta - (long) metaSizeCOM - (long) metaSize;
+    if (!canCopyInput(bufSize))
+        room = 0;
+    else if (room < 1)
+        room = 1;
+
+    struct searchSettings settings = {
+        method, target, qMin, qMax, attempts, budget,
+        minSaving, minSavingPercent, room,
+        getTimeMs(), 0, samplePercent, useSurrogate,
+        cache, cacheKey, priorKey, logMessage, NULL
+    };
+    // Search encodes are baseline and, unless accurate, unoptimized. The
+    // last one uses the final settings, as do any re-encodes after.
+    struct jpegCodec jpeg = { original, width, height, !noProgressive, accurate, subsample };
+    struct searchCodec codec;
+    struct searchReference ref;
+    struct searchResult search;
+    enum searchStatus status = SEARCH_ERROR;
+
+    jpegCodecInit(&codec, &jpeg);
+
+    if (!searchReferenceInit(&ref, &settings, originalGray, width, height))
+        search.error = "could not allocate the search reference";
+    else
+        status = searchQuality(&settings, &codec, &ref, &search);
+
+    searchReferenceFree(&ref);
+    cacheClose(cache);
+    free(originalGray);
+    free(original);
+
+    if (status == SEARCH_TOO_LARGE) {
+        if (metaBuf != NULL)
+            free(metaBuf);
+
+        if (copyFiles) {
+            info("Output file would be larger than input!\n");
+
+            copyFile(outputPath, buf, bufSize);
+
+            free(buf);
+            return 0;
         } else {
-            switch (method) {
-                case SSIM: case MS_SSIM: case SMALLFRY:
-                    // Higher than required, decrease quality
-                    max = MAX(quality - 1, min);
-                    break;
-                case MPE:
-                    // Too distorted, increase quality
-                    min = MIN(quality + 1, max);
-                    break;
-            }
+            error("output file would be larger than input!");
+            free(buf);
+            return 1;
         }
+    }
+
+    if (status != SEARCH_DONE) {
+        if (status == SEARCH_NO_FIT)
+            error("could not find a quality that fits in %lu bytes!", targetSize);
+        else
+            error("%s", search.error);
 
+        if (metaBuf != NULL)
+            free(metaBuf);
+        free(buf);
+
+        return 1;
     }
 
-    free(originalGray);
-    free(original);
+    compressed = search.data;
+    compressedSize = search.size;
+    totalSize = compressedSize + metaSizeCOM + metaSize;
 
     // Calculate and show savings, if any
     int percent = totalSize * 100 / bufSize;
     unsigned long saved = (bufSize > totalSize) ? bufSize - totalSize : 0;
     info("New size is %i%% of original (saved %lu kb)\n", percent, saved / 1024);
 
-    if (totalSize >= bufSize) {
+    if (totalSize >= bufSize && !canCopyInput(bufSize)) {
+        info("Output file is larger than input, but has the requested changes\n");
+    } else if (totalSize >= bufSize) {
         error("output file is larger than input, aborting!");
 
         copyFile(outputPath, buf, bufSize);
@@ -691,7 +725,7 @@ int main (int argc, char **argv) {
 
     /* Write additional metadata markers. */
     if (metaBuf != NULL) {
-        wSize = fwrite(metaBuf, metaSize, 1, file);
+        wSize = metaSize ? fwrite(metaBuf, metaSize, 1, file) : 1;
 
         free(metaBuf);
 
@@ -0,0 +1,452 @@
+#ifndef _WIN32
+    // pread(), ftruncate() and friends are hidden by -std=c99
+    #define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "cache.h"
+#include "util.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <pthread.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+#define CACHE_MAGIC "A2WCACHE"
+#define CACHE_VERSION 2
+// Number of slots, must be a power of two
+#define CACHE_SLOTS 65536
+// Number of slots searched for a key before giving up
+#define CACHE_PROBES 16
+// Number of recent images that dominate a quality prior
+#define PRIOR_WINDOW 16
+
+struct cacheSlot {
+    uint64_t key;
+    // Store counter value when written, used to pick eviction victims
+    uint32_t stamp;
+    // Search result
+    int32_t quality;
+    uint32_t size;
+    // Quality prior
+    uint32_t count;
+    float mean;
+    float variance;
+    uint32_t images[2];
+    uint32_t encodes[2];
+};
+
+struct cacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t slots;
+    // Incremented on every store
+    uint32_t stamp;
+    uint32_t reserved;
+};
+
+struct cacheFile {
+    struct cacheHeader header;
+    struct cacheSlot slot[CACHE_SLOTS];
+};
+
+struct cache {
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+    struct cacheFile *data;
+};
+
+#ifdef _WIN32
+
+static int lockCache(struct cache *cache, int exclusive) {
+    OVERLAPPED overlapped;
+
+    memset(&overlapped, 0, sizeof(overlapped));
+    return LockFileEx(cache->file, exclusive ? LOCKFILE_EXCLUSIVE_LOCK : 0, 0, MAXDWORD, MAXDWORD, &overlapped) ? 1 : 0;
+}
+
+static void unlockCache(struct cache *cache) {
+    OVERLAPPED overlapped;
+
+    memset(&overlapped, 0, sizeof(overlapped));
+    UnlockFileEx(cache->file, 0, MAXDWORD, MAXDWORD, &overlapped);
+}
+
+#else
+
+/*
+    Record locks belong to the process, so they do not keep its threads
+    apart, and closing any descriptor of the file drops them all. Threads
+    take this lock first, which also covers closing a cache. It is never
+    shared, as the first reader to unlock would drop the record lock of
+    the others.
+*/
+static pthread_mutex_t threadLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int lockCache(struct cache *cache, int exclusive) {
+    struct flock lock;
+
+    if (pthread_mutex_lock(&threadLock) != 0)
+        return 0;
+
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = exclusive ? F_WRLCK : F_RDLCK;
+    lock.l_whence = SEEK_SET;
+
+    while (fcntl(cache->fd, F_SETLKW, &lock) == -1) {
+        if (errno != EINTR) {
+            pthread_mutex_unlock(&threadLock);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void unlockCache(struct cache *cache) {
+    struct flock lock;
+
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_UNLCK;
+    lock.l_whence = SEEK_SET;
+    fcntl(cache->fd, F_SETLK, &lock);
+
+    pthread_mutex_unlock(&threadLock);
+}
+
+#endif
+
+// Map the file, which must be exactly sizeof(struct cacheFile) long
+static int mapCache(struct cache *cache) {
+#ifdef _WIN32
+    cache->mapping = CreateFileMapping(cache->file, NULL, PAGE_READWRITE, 0, 0, NULL);
+    if (cache->mapping == NULL)
+        return 0;
+
+    cache->data = MapViewOfFile(cache->mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(struct cacheFile));
+    if (cache->data == NULL) {
+        CloseHandle(cache->mapping);
+        return 0;
+    }
+#else
+    void *data = mmap(NULL, sizeof(struct cacheFile), PROT_READ | PROT_WRITE, MAP_SHARED, cache->fd, 0);
+    if (data == MAP_FAILED)
+        return 0;
+
+    cache->data = data;
+#endif
+    return 1;
+}
+
+/*
+    Make sure the file has the right size and header, resetting it if it
+    is empty or a cache of another version. Returns 1 on success, 0 on
+    error or -1 if the file holds something else, which is left alone.
+*/
+static int prepareCache(struct cache *cache) {
+    struct cacheHeader header;
+    long long size = -1;
+    int headerRead = 0;
+
+#ifdef _WIN32
+    LARGE_INTEGER fileSize;
+    DWORD bytesRead = 0;
+
+    if (GetFileSizeEx(cache->file, &fileSize)) {
+        size = fileSize.QuadPart;
+        SetFilePointer(cache->file, 0, NULL, FILE_BEGIN);
+        headerRead = size >= (long long) sizeof(header) &&
+                     ReadFile(cache->file, &header, sizeof(header), &bytesRead, NULL) && bytesRead == sizeof(header);
+    }
+#else
+    struct stat st;
+
+    if (fstat(cache->fd, &st) == 0) {
+        size = st.st_size;
+        headerRead = size >= (long long) sizeof(header) && pread(cache->fd, &header, sizeof(header), 0) == sizeof(header);
+    }
+#endif
+
+    if (size < 0)
+        return 0;
+
+    int ours = headerRead && !memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic));
+
+    if (ours && size == sizeof(struct cacheFile) && header.version == CACHE_VERSION && header.slots == CACHE_SLOTS)
+        return mapCache(cache);
+
+    // Only ever reset a new file or one of our own, never a file given
+    // by mistake
+    if (size && !ours)
+        return -1;
+
+    // New, truncated or from another version: start over with an empty table
+#ifdef _WIN32
+    LARGE_INTEGER zero;
+
+    zero.QuadPart = 0;
+    fileSize.QuadPart = sizeof(struct cacheFile);
+    if (!SetFilePointerEx(cache->file, zero, NULL, FILE_BEGIN) || !SetEndOfFile(cache->file) ||
+        !SetFilePointerEx(cache->file, fileSize, NULL, FILE_BEGIN) || !SetEndOfFile(cache->file))
+        return 0;
+#else
+    if (ftruncate(cache->fd, 0) || ftruncate(cache->fd, sizeof(struct cacheFile)))
+        return 0;
+#endif
+
+    if (!mapCache(cache))
+        return 0;
+
+    memcpy(cache->data->header.magic, CACHE_MAGIC, sizeof(cache->data->header.magic));
+    cache->data->header.version = CACHE_VERSION;
+    cache->data->header.slots = CACHE_SLOTS;
+    cache->data->header.stamp = 0;
+
+    return 1;
+}
+
+struct cache *cacheOpen(const char *path) {
+    struct cache *cache = calloc(1, sizeof(struct cache));
+    int ok;
+
+    if (cache == NULL)
+        return NULL;
+
+#ifdef _WIN32
+    cache->file = CreateFile(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (cache->file == INVALID_HANDLE_VALUE) {
+        error("unable to open cache file: %s", path);
+        free(cache);
+        return NULL;
+    }
+#else
+    cache->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (cache->fd == -1) {
+        error("unable to open cache file: %s", path);
+        free(cache);
+        return NULL;
+    }
+#endif
+
+    // Only one process may create or reset the file at a time
+    ok = lockCache(cache, 1);
+    if (ok) {
+        ok = prepareCache(cache);
+        unlockCache(cache);
+    }
+
+    if (ok != 1) {
+        if (ok < 0)
+            error("not a cache file, running without a cache: %s", path);
+        else
+            error("unable to map cache file: %s", path);
+#ifdef _WIN32
+        CloseHandle(cache->file);
+#else
+        pthread_mutex_lock(&threadLock);
+        close(cache->fd);
+        pthread_mutex_unlock(&threadLock);
+#endif
+        free(cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+void cacheClose(struct cache *cache) {
+    if (cache == NULL)
+        return;
+
+#ifdef _WIN32
+    UnmapViewOfFile(cache->data);
+    CloseHandle(cache->mapping);
+    CloseHandle(cache->file);
+#else
+    munmap(cache->data, sizeof(struct cacheFile));
+
+    // Not while another thread holds a record lock on the file
+    pthread_mutex_lock(&threadLock);
+    close(cache->fd);
+    pthread_mutex_unlock(&threadLock);
+#endif
+
+    free(cache);
+}
+
+// Key zero marks an empty slot
+static uint64_t slotKey(uint64_t key) {
+    return key ? key : 1;
+}
+
+// Find the slot holding a key, the cache must be locked
+static struct cacheSlot *findSlot(struct cache *cache, uint64_t key) {
+    for (int probe = 0; probe < CACHE_PROBES; probe++) {
+        struct cacheSlot *slot = &cache->data->slot[(key + probe) & (CACHE_SLOTS - 1)];
+
+        if (slot->key == key) {
+            return slot;
+        } else if (!slot->key) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+// Find the slot to write a key to, the cache must be locked exclusively
+static struct cacheSlot *claimSlot(struct cache *cache, uint64_t key) {
+    struct cacheSlot *victim = NULL;
+    uint32_t now = cache->data->header.stamp;
+
+    for (int probe = 0; probe < CACHE_PROBES; probe++) {
+        struct cacheSlot *slot = &cache->data->slot[(key + probe) & (CACHE_SLOTS - 1)];
+
+        if (slot->key == key) {
+            return slot;
+        } else if (!slot->key) {
+            victim = slot;
+            break;
+        }
+
+        // Stamps wrap around, so compare ages rather than raw values
+        if (victim == NULL || now - slot->stamp > now - victim->stamp)
+            victim = slot;
+    }
+
+    memset(victim, 0, sizeof(*victim));
+    victim->key = key;
+
+    return victim;
+}
+
+int cacheLookup(struct cache *cache, uint64_t key, int *quality, unsigned long *size) {
+    struct cacheSlot *slot;
+    int found = 0;
+
+    key = slotKey(key);
+
+    if (!lockCache(cache, 0))
+        return 0;
+
+    slot = findSlot(cache, key);
+    if (slot != NULL && slot->size) {
+        *quality = slot->quality;
+        *size = slot->size;
+        found = 1;
+    }
+
+    unlockCache(cache);
+
+    return found;
+}
+
+int cacheStore(struct cache *cache, uint64_t key, int quality, unsigned long size) {
+    struct cacheSlot *slot;
+
+    key = slotKey(key);
+
+    if (!lockCache(cache, 1))
+        return 0;
+
+    slot = claimSlot(cache, key);
+    slot->quality = quality;
+    slot->size = (uint32_t) MAX(1, MIN(size, UINT32_MAX));
+    slot->stamp = ++cache->data->header.stamp;
+
+    unlockCache(cache);
+
+    return 1;
+}
+
+int cacheGetPrior(struct cache *cache, uint64_t key, struct qualityPrior *prior) {
+    struct cacheSlot *slot;
+    int found = 0;
+
+    memset(prior, 0, sizeof(*prior));
+    key = slotKey(key);
+
+    if (!lockCache(cache, 0))
+        return 0;
+
+    slot = findSlot(cache, key);
+    if (slot != NULL && slot->count) {
+        prior->count = slot->count;
+        prior->mean = slot->mean;
+        prior->deviation = sqrt(slot->variance);
+        for (int i = 0; i < 2; i++) {
+            prior->images[i] = slot->images[i];
+            prior->encodes[i] = slot->encodes[i];
+        }
+        found = 1;
+    }
+
+    unlockCache(cache);
+
+    return found;
+}
+
+int cacheUpdatePrior(struct cache *cache, uint64_t key, int quality, int encodes, int seeded) {
+    struct cacheSlot *slot;
+    float alpha, delta;
+
+    key = slotKey(key);
+    seeded = seeded ? 1 : 0;
+
+    if (!lockCache(cache, 1))
+        return 0;
+
+    slot = claimSlot(cache, key);
+
+    // Exponentially weighted mean and variance, see Finch (2009)
+    slot->count++;
+    alpha = 1.0f / MIN(slot->count, PRIOR_WINDOW);
+    delta = quality - slot->mean;
+    slot->mean += alpha * delta;
+    slot->variance = (1.0f - alpha) * (slot->variance + alpha * delta * delta);
+
+    slot->images[seeded]++;
+    slot->encodes[seeded] += encodes;
+    slot->stamp = ++cache->data->header.stamp;
+
+    unlockCache(cache);
+
+    return 1;
+}
+
+uint64_t hashBuffer(uint64_t hash, const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    const uint64_t prime = 0x100000001b3ULL;
+    uint64_t word;
+
+    if (!hash)
+        hash = 0xcbf29ce484222325ULL;
+
+    // FNV-1a style mixing, a word at a time to keep up with large images
+    while (size >= sizeof(word)) {
+        memcpy(&word, bytes, sizeof(word));
+        hash = (hash ^ word) * prime;
+        hash ^= hash >> 29;
+        bytes += sizeof(word);
+        size -= sizeof(word);
+    }
+
+    while (size--) {
+        hash = (hash ^ *bytes++) * prime;
+    }
+
+    return hash;
+}
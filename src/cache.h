@@ -0,0 +1,74 @@
+/*
+    Persistent cache of quality search results
+*/
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    A cache file is a fixed size open addressing hash table that is
+    memory mapped by every process using it. Each access takes a lock
+    on the file, so many parallel workers can share one cache safely.
+*/
+struct cache;
+
+/*
+    Running distribution of the qualities chosen for a group of similar
+    images, e.g. photos of the same size from one shoot. Recent images
+    are weighted more heavily than old ones.
+*/
+struct qualityPrior {
+    // Number of images recorded
+    unsigned int count;
+    float mean;
+    float deviation;
+    // Images searched and encodes spent without (0) and with (1) the prior
+    unsigned int images[2];
+    unsigned long encodes[2];
+};
+
+/*
+    Open a cache file, creating or resetting it when it does not exist,
+    is empty or was written by an incompatible version. Returns NULL on
+    error, or if the file holds anything else, which is left untouched.
+*/
+struct cache *cacheOpen(const char *path);
+
+/* Unmap and close a cache file. */
+void cacheClose(struct cache *cache);
+
+/*
+    Look up the result stored for a key. Returns 1 and fills in quality
+    and size if the key is present, otherwise returns 0.
+*/
+int cacheLookup(struct cache *cache, uint64_t key, int *quality, unsigned long *size);
+
+/*
+    Store the result for a key, replacing any previous result. When the
+    key's probe sequence is full the oldest slot in it is evicted.
+    Returns 1 on success or 0 on error.
+*/
+int cacheStore(struct cache *cache, uint64_t key, int quality, unsigned long size);
+
+/*
+    Get the quality prior stored for a key. Returns 1 if present,
+    otherwise returns 0 and clears the prior.
+*/
+int cacheGetPrior(struct cache *cache, uint64_t key, struct qualityPrior *prior);
+
+/*
+    Record the quality chosen for an image in the prior for a key, along
+    with the number of encodes the search needed and whether it was
+    seeded from the prior. Returns 1 on success or 0 on error.
+*/
+int cacheUpdatePrior(struct cache *cache, uint64_t key, int quality, int encodes, int seeded);
+
+/*
+    Fold a buffer into a 64-bit hash. Start with hash = 0 and chain calls
+    to build a key from the decoded image and the encoder settings.
+*/
+uint64_t hashBuffer(uint64_t hash, const void *data, size_t size);
+
+#endif
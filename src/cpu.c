@@ -0,0 +1,114 @@
+#include "cpu.h"
+#include "kernels.h"
+#include "util.h"
+#include "iqa/include/iqa.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+extern const struct pixelKernels pixelKernelsBaseline;
+#ifdef HAVE_X86_KERNELS
+extern const struct pixelKernels pixelKernelsAvx2;
+extern const struct pixelKernels pixelKernelsAvx512;
+#endif
+
+static const char *levelNames[] = { "baseline", "avx2", "avx512" };
+
+static int initialized = 0;
+static enum cpuLevel selected = CPU_BASELINE;
+static const struct pixelKernels *current = &pixelKernelsBaseline;
+
+// Best level the CPU and operating system support
+static enum cpuLevel detectLevel(void) {
+#ifdef HAVE_X86_KERNELS
+#if defined(__GNUC__)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+        return CPU_AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return CPU_AVX2;
+#elif defined(_MSC_VER)
+    int info[4];
+
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return CPU_BASELINE;
+
+    // The OS must save the AVX state, and the ZMM state for AVX-512
+    __cpuid(info, 1);
+    if (!(info[2] & (1 << 27)) || !(info[2] & (1 << 28)))
+        return CPU_BASELINE;
+
+    unsigned long long xcr0 = _xgetbv(0);
+    if ((xcr0 & 0x6) != 0x6)
+        return CPU_BASELINE;
+
+    __cpuidex(info, 7, 0);
+    if ((info[1] & (1 << 16)) && (info[1] & (1 << 30)) && (xcr0 & 0xe6) == 0xe6)
+        return CPU_AVX512;
+    if (info[1] & (1 << 5))
+        return CPU_AVX2;
+#endif
+#endif
+
+    return CPU_BASELINE;
+}
+
+enum cpuLevel cpuInit(void) {
+    if (initialized)
+        return selected;
+
+    selected = detectLevel();
+
+    const char *forced = getenv("JPEG_ARCHIVE_CPU");
+    if (forced != NULL && *forced) {
+        enum cpuLevel level = CPU_BASELINE;
+
+        while (level < CPU_AVX512 && strcmp(forced, levelNames[level]))
+            level++;
+
+        if (strcmp(forced, levelNames[level])) {
+            error("unknown JPEG_ARCHIVE_CPU level %s, using %s", forced, levelNames[selected]);
+        } else if (level > selected) {
+            error("CPU does not support %s, using %s", forced, levelNames[selected]);
+        } else {
+            selected = level;
+        }
+    }
+
+    switch (selected) {
+#ifdef HAVE_X86_KERNELS
+        case CPU_AVX512:
+            current = &pixelKernelsAvx512;
+            break;
+        case CPU_AVX2:
+            current = &pixelKernelsAvx2;
+            break;
+#endif
+        default:
+            current = &pixelKernelsBaseline;
+            break;
+    }
+
+    iqa_set_cpu_level(selected);
+    initialized = 1;
+
+    return selected;
+}
+
+const char *cpuLevelName(enum cpuLevel level) {
+    return levelNames[level];
+}
+
+const struct pixelKernels *pixelKernels(void) {
+    if (!initialized)
+        cpuInit();
+
+    return current;
+}
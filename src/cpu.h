@@ -0,0 +1,27 @@
+/*
+    Runtime selection of the pixel kernels for the instruction sets the
+    CPU supports
+*/
+#ifndef CPU_H
+#define CPU_H
+
+enum cpuLevel {
+    // Whatever the compiler targets by default, SSE2 on x86-64
+    CPU_BASELINE,
+    CPU_AVX2,
+    CPU_AVX512
+};
+
+/*
+    Select the kernels of the tools and of iqa for the best level the
+    CPU supports, and return it. The environment variable
+    JPEG_ARCHIVE_CPU set to baseline, avx2 or avx512 forces a lower
+    level, e.g. for A/B testing. Levels above what the CPU supports are
+    ignored with a warning. Only the first call does any work.
+*/
+enum cpuLevel cpuInit(void);
+
+/* Name of a level as used by JPEG_ARCHIVE_CPU. */
+const char *cpuLevelName(enum cpuLevel level);
+
+#endif
@@ -0,0 +1,463 @@
+#ifndef _WIN32
+    // sigaction(), kill() and friends are hidden by -std=c99
+    #define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "daemon.h"
+#include "util.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _OPENMP
+    #include <omp.h>
+#endif
+
+#ifndef _WIN32
+    #include <arpa/inet.h>
+    #include <signal.h>
+    #include <sys/socket.h>
+    #include <sys/stat.h>
+    #include <sys/time.h>
+    #include <sys/un.h>
+    #include <sys/wait.h>
+    #include <unistd.h>
+#endif
+
+// Most arguments in a request
+#define DAEMON_MAX_ARGC 256
+
+#ifdef _WIN32
+
+int daemonServe(const struct daemonSettings *settings, daemonHandler handler, void *opaque) {
+    (void) settings;
+    (void) handler;
+    (void) opaque;
+
+    error("the daemon is not available on this platform");
+    return 0;
+}
+
+int daemonWriteLine(int fd, const char *format, ...) {
+    (void) fd;
+    (void) format;
+    return 0;
+}
+
+int daemonWriteData(int fd, const void *data, size_t size) {
+    (void) fd;
+    (void) data;
+    (void) size;
+    return 0;
+}
+
+int daemonRequest(const char *socketPath, int argc, char **argv, const unsigned char *input, size_t inputSize, char *message, size_t messageSize) {
+    (void) socketPath;
+    (void) argc;
+    (void) argv;
+    (void) input;
+    (void) inputSize;
+
+    snprintf(message, messageSize, "the daemon is not available on this platform");
+    return -1;
+}
+
+int daemonReadLine(int fd, char *line, size_t size) {
+    (void) fd;
+    (void) line;
+    (void) size;
+    return 0;
+}
+
+int daemonReadData(int fd, void *data, size_t size) {
+    (void) fd;
+    (void) data;
+    (void) size;
+    return 0;
+}
+
+#else
+
+// Set by SIGINT and SIGTERM
+static volatile sig_atomic_t stopping = 0;
+// Whether a worker is answering a request
+static volatile sig_atomic_t busy = 0;
+
+static void onStop(int signal) {
+    (void) signal;
+    stopping = 1;
+}
+
+// An idle worker stops at once, as it may be waiting in accept(), and a
+// busy one after its request
+static void onWorkerStop(int signal) {
+    (void) signal;
+
+    if (!busy)
+        _exit(0);
+
+    stopping = 1;
+}
+
+int daemonWriteData(int fd, const void *data, size_t size) {
+    const unsigned char *bytes = data;
+
+    while (size) {
+        ssize_t written = write(fd, bytes, size);
+
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return 0;
+
+        bytes += written;
+        size -= written;
+    }
+
+    return 1;
+}
+
+int daemonWriteLine(int fd, const char *format, ...) {
+    char line[1024];
+    va_list args;
+
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line) - 1, format, args);
+    va_end(args);
+
+    if (length < 0)
+        return 0;
+
+    // Overlong lines are cut short rather than split
+    if (length > (int) sizeof(line) - 2)
+        length = sizeof(line) - 2;
+
+    line[length++] = '\n';
+
+    return daemonWriteData(fd, line, length);
+}
+
+int daemonReadData(int fd, void *data, size_t size) {
+    unsigned char *bytes = data;
+
+    while (size) {
+        ssize_t got = read(fd, bytes, size);
+
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return 0;
+
+        bytes += got;
+        size -= got;
+    }
+
+    return 1;
+}
+
+int daemonReadLine(int fd, char *line, size_t size) {
+    size_t length = 0;
+
+    // A byte at a time, so nothing of the data after the line is taken
+    while (length + 1 < size) {
+        if (!daemonReadData(fd, line + length, 1))
+            return 0;
+
+        if (line[length] == '\n')
+            break;
+
+        length++;
+    }
+
+    line[length] = '\0';
+
+    return 1;
+}
+
+static int readLength(int fd, uint32_t *length) {
+    if (!daemonReadData(fd, length, sizeof(*length)))
+        return 0;
+
+    *length = ntohl(*length);
+
+    return 1;
+}
+
+static int writeLength(int fd, uint32_t length) {
+    length = htonl(length);
+
+    return daemonWriteData(fd, &length, sizeof(length));
+}
+
+static int fillAddress(struct sockaddr_un *address, const char *socketPath) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+
+    if (strlen(socketPath) >= sizeof(address->sun_path))
+        return 0;
+
+    strcpy(address->sun_path, socketPath);
+
+    return 1;
+}
+
+int daemonRequest(const char *socketPath, int argc, char **argv, const unsigned char *input, size_t inputSize, char *message, size_t messageSize) {
+    struct sockaddr_un address;
+    size_t argumentsSize = 0;
+
+    for (int i = 1; i < argc; i++)
+        argumentsSize += strlen(argv[i]) + 1;
+
+    if (argumentsSize > DAEMON_MAX_ARGUMENTS || inputSize > DAEMON_MAX_INPUT) {
+        snprintf(message, messageSize, "request is too large for the daemon");
+        return -1;
+    }
+
+    if (!fillAddress(&address, socketPath)) {
+        snprintf(message, messageSize, "socket path is too long");
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &address, sizeof(address)) != 0) {
+        snprintf(message, messageSize, "could not connect to the daemon (%s)", strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    int ok = writeLength(fd, argumentsSize);
+    for (int i = 1; i < argc && ok; i++)
+        ok = daemonWriteData(fd, argv[i], strlen(argv[i]) + 1);
+
+    ok = ok && writeLength(fd, inputSize) && daemonWriteData(fd, input, inputSize);
+
+    if (!ok) {
+        snprintf(message, messageSize, "could not send the request to the daemon");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Read a request and pass it to the handler
+static void serveConnection(int fd, const struct daemonSettings *settings, daemonHandler handler, void *opaque) {
+    char arguments[DAEMON_MAX_ARGUMENTS + 1];
+    char *argv[DAEMON_MAX_ARGC + 1];
+    uint32_t argumentsSize, inputSize;
+    int argc = 0;
+
+    if (!readLength(fd, &argumentsSize) || argumentsSize > DAEMON_MAX_ARGUMENTS ||
+        !daemonReadData(fd, arguments, argumentsSize) ||
+        (argumentsSize && arguments[argumentsSize - 1] != '\0')) {
+        daemonWriteLine(fd, "error invalid request");
+        return;
+    }
+
+    argv[argc++] = (char *) progname;
+    for (uint32_t i = 0; i < argumentsSize; i += strlen(arguments + i) + 1) {
+        if (argc == DAEMON_MAX_ARGC) {
+            daemonWriteLine(fd, "error too many arguments");
+            return;
+        }
+
+        argv[argc++] = arguments + i;
+    }
+    argv[argc] = NULL;
+
+    if (!readLength(fd, &inputSize) || inputSize > DAEMON_MAX_INPUT) {
+        daemonWriteLine(fd, "error invalid request");
+        return;
+    }
+
+    unsigned char *input = malloc(inputSize ? inputSize : 1);
+    if (input == NULL) {
+        daemonWriteLine(fd, "error not enough memory for the input");
+        return;
+    }
+
+    if (!daemonReadData(fd, input, inputSize)) {
+        free(input);
+        return;
+    }
+
+    // A request that runs over its time takes its worker down with it
+    alarm(settings->requestTimeout);
+    handler(opaque, argc, argv, input, inputSize, fd);
+    alarm(0);
+
+    free(input);
+}
+
+static void runWorker(int listener, const struct daemonSettings *settings, int threads, daemonHandler handler, void *opaque) {
+    // A client that stalls or goes away cannot hold or stop the worker
+    struct timeval timeout = { DAEMON_IO_TIMEOUT, 0 };
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onWorkerStop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+#ifdef _OPENMP
+    // The workers run side by side, so each gets its share of the CPUs
+    // rather than a thread for every one
+    omp_set_num_threads(threads);
+#else
+    (void) threads;
+#endif
+
+    while (!stopping) {
+        int fd = accept(listener, NULL, NULL);
+
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            error("could not accept a connection: %s", strerror(errno));
+            return;
+        }
+
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        busy = 1;
+        serveConnection(fd, settings, handler, opaque);
+        close(fd);
+        busy = 0;
+    }
+}
+
+// Fork a worker with threads to use, returning its process id or -1
+static pid_t startWorker(int listener, const struct daemonSettings *settings, int threads, daemonHandler handler, void *opaque) {
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        runWorker(listener, settings, threads, handler, opaque);
+        _exit(0);
+    }
+
+    if (pid < 0)
+        error("could not start a worker: %s", strerror(errno));
+
+    return pid;
+}
+
+// Bind and listen on the socket, replacing a stale one. Returns it or -1.
+static int openListener(const struct daemonSettings *settings) {
+    struct sockaddr_un address;
+    struct stat status;
+
+    if (!fillAddress(&address, settings->socketPath)) {
+        error("socket path is too long: %s", settings->socketPath);
+        return -1;
+    }
+
+    // Only ever remove a socket, never a file given by mistake
+    if (lstat(settings->socketPath, &status) == 0 && S_ISSOCK(status.st_mode))
+        unlink(settings->socketPath);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 ||
+        bind(listener, (struct sockaddr *) &address, sizeof(address)) != 0 ||
+        listen(listener, settings->queueLength) != 0) {
+        error("could not listen on %s: %s", settings->socketPath, strerror(errno));
+        if (listener >= 0)
+            close(listener);
+        return -1;
+    }
+
+    return listener;
+}
+
+int daemonServe(const struct daemonSettings *settings, daemonHandler handler, void *opaque) {
+    int workers = settings->workers;
+    long cpus = 1;
+    struct sigaction action;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    cpus = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+#endif
+    if (workers < 1)
+        workers = cpus;
+
+    const int threads = MAX(cpus / workers, 1);
+
+    pid_t *pids = calloc(workers, sizeof(pid_t));
+    if (pids == NULL) {
+        error("not enough memory");
+        return 0;
+    }
+
+    int listener = openListener(settings);
+    if (listener < 0) {
+        free(pids);
+        return 0;
+    }
+
+    // Without SA_RESTART, so a signal wakes up waitpid() and accept()
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onStop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    // Keep every slot filled, replacing workers that die, e.g. on a
+    // crash or a request timeout
+    while (!stopping) {
+        int status;
+        int failed = 0;
+
+        for (int i = 0; i < workers; i++) {
+            if (pids[i] <= 0 && (pids[i] = startWorker(listener, settings, threads, handler, opaque)) < 0)
+                failed = 1;
+        }
+
+        // Forking can fail for a while, e.g. when out of memory
+        if (failed)
+            sleep(1);
+
+        pid_t pid = waitpid(-1, &status, failed ? WNOHANG : 0);
+        if (pid <= 0)
+            continue;
+
+        for (int i = 0; i < workers; i++) {
+            if (pids[i] != pid)
+                continue;
+
+            if (WIFSIGNALED(status))
+                error("worker %li stopped by signal %i, starting another", (long) pid, WTERMSIG(status));
+            else if (!stopping)
+                error("worker %li exited with status %i, starting another", (long) pid, WEXITSTATUS(status));
+
+            pids[i] = 0;
+        }
+    }
+
+    close(listener);
+    unlink(settings->socketPath);
+
+    // Let the workers finish their requests
+    for (int i = 0; i < workers; i++) {
+        if (pids[i] > 0)
+            kill(pids[i], SIGTERM);
+    }
+
+    for (int i = 0; i < workers; i++) {
+        if (pids[i] > 0)
+            waitpid(pids[i], NULL, 0);
+    }
+
+    free(pids);
+
+    return 1;
+}
+
+#endif
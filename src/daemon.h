@@ -0,0 +1,82 @@
+/*
+    Long-lived service answering requests over a Unix domain socket.
+
+    A supervisor forks a pool of worker processes which take connections
+    from the socket's backlog, the queue of requests waiting for a
+    worker. Each worker serves one request after another, so one that
+    crashes or runs out of time only fails the request it was on, and
+    the supervisor starts a new worker in its place. With OpenMP, the
+    workers split the CPUs between their thread teams.
+
+    A request is its arguments followed by its input:
+
+        uint32  length of the arguments in bytes
+        ...     the arguments, each terminated by a NUL
+        uint32  length of the input in bytes
+        ...     the input
+
+    with integers in network byte order. What the reply holds is up to
+    the handler, which writes lines and data to the connection.
+
+    Only available on POSIX systems.
+*/
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <stddef.h>
+
+// Largest request accepted, in bytes of arguments and of input
+#define DAEMON_MAX_ARGUMENTS 4096
+#define DAEMON_MAX_INPUT (256 << 20)
+
+// Seconds a connection may stall sending or receiving before it is
+// dropped
+#define DAEMON_IO_TIMEOUT 30
+
+struct daemonSettings {
+    const char *socketPath;
+    // Number of worker processes, or 0 for one per CPU
+    int workers;
+    // Length of the socket's backlog of requests waiting for a worker.
+    // Once it is full, connecting waits or fails depending on the system.
+    int queueLength;
+    // Seconds a request may take before its worker is stopped, or 0 for
+    // no limit
+    int requestTimeout;
+};
+
+/*
+    Answer a request, writing the reply to fd. argv[0] is the program
+    name, followed by the arguments of the request.
+*/
+typedef void (*daemonHandler)(void *opaque, int argc, char **argv, const unsigned char *input, size_t inputSize, int fd);
+
+/*
+    Serve requests on the socket until SIGINT or SIGTERM, letting the
+    workers finish what they are doing. Returns 1 after a clean stop or
+    0 if the socket could not be set up.
+*/
+int daemonServe(const struct daemonSettings *settings, daemonHandler handler, void *opaque);
+
+/*
+    Write a formatted line, which gets a newline added, or size bytes of
+    data to a connection. Return 1 on success.
+*/
+int daemonWriteLine(int fd, const char *format, ...);
+int daemonWriteData(int fd, const void *data, size_t size);
+
+/*
+    Send a request to the service on the socket. Returns the connection
+    to read the reply from, or -1 with the reason in message.
+*/
+int daemonRequest(const char *socketPath, int argc, char **argv, const unsigned char *input, size_t inputSize, char *message, size_t messageSize);
+
+/*
+    Read a line of up to size - 1 characters without its newline, or
+    exactly size bytes of data, from a connection. Return 1 on success
+    or 0 at the end of the reply or on an error.
+*/
+int daemonReadLine(int fd, char *line, size_t size);
+int daemonReadData(int fd, void *data, size_t size);
+
+#endif
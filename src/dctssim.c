@@ -0,0 +1,163 @@
+#include "dctssim.h"
+#include "util.h"
+
+#include <stdlib.h>
+
+// SSIM stabilizing constants for 8-bit images, (K * 255)^2
+#define DCT_SSIM_C1 6.5025
+#define DCT_SSIM_C2 58.5225
+
+// Orthonormal 8-point DCT basis, which is the transform JPEG uses:
+// c(u) * cos((2x + 1) * u * pi / 16) with c(0) = sqrt(1/8) and c(u) = 1/2.
+// A constant, so concurrent searches never race to fill it in.
+static const float basis[8][8] = {
+    { 0.353553385f, 0.353553385f, 0.353553385f, 0.353553385f, 0.353553385f, 0.353553385f, 0.353553385f, 0.353553385f },
+    { 0.490392625f, 0.415734798f, 0.277785122f, 0.0975451618f, -0.0975451618f, -0.277785122f, -0.415734798f, -0.490392625f },
+    { 0.461939752f, 0.191341713f, -0.191341713f, -0.461939752f, -0.461939752f, -0.191341713f, 0.191341713f, 0.461939752f },
+    { 0.415734798f, -0.0975451618f, -0.490392625f, -0.277785122f, 0.277785122f, 0.490392625f, 0.0975451618f, -0.415734798f },
+    { 0.353553385f, -0.353553385f, -0.353553385f, 0.353553385f, 0.353553385f, -0.353553385f, -0.353553385f, 0.353553385f },
+    { 0.277785122f, -0.490392625f, 0.0975451618f, 0.415734798f, -0.415734798f, -0.0975451618f, 0.490392625f, -0.277785122f },
+    { 0.191341713f, -0.461939752f, 0.461939752f, -0.191341713f, -0.191341713f, 0.461939752f, -0.461939752f, 0.191341713f },
+    { 0.0975451618f, -0.277785122f, 0.415734798f, -0.490392625f, 0.490392625f, -0.415734798f, 0.277785122f, -0.0975451618f }
+};
+
+// Transform the level shifted 8x8 block at (bx, by), repeating the last
+// column and row for partial blocks
+static void forwardDct(const unsigned char *gray, int width, int height, int bx, int by, float *coef) {
+    float rows[8][8];
+
+    for (int y = 0; y < 8; y++) {
+        const unsigned char *line = gray + (size_t) MIN(by * 8 + y, height - 1) * width;
+        float pixels[8];
+
+        for (int x = 0; x < 8; x++)
+            pixels[x] = (float) line[MIN(bx * 8 + x, width - 1)] - 128;
+
+        for (int u = 0; u < 8; u++) {
+            float sum = 0;
+            for (int x = 0; x < 8; x++)
+                sum += basis[u][x] * pixels[x];
+            rows[y][u] = sum;
+        }
+    }
+
+    for (int v = 0; v < 8; v++) {
+        for (int u = 0; u < 8; u++) {
+            float sum = 0;
+            for (int y = 0; y < 8; y++)
+                sum += basis[v][y] * rows[y][u];
+            coef[v * 8 + u] = sum;
+        }
+    }
+}
+
+// SSIM of one block from the coefficients of both sides. The DC term of
+// the orthonormal transform is 8 times the mean, and the AC energy over
+// 64 pixels is the variance.
+static double blockSsim(const float *x, const float *y) {
+    double meanX = x[0] / 8 + 128;
+    double meanY = y[0] / 8 + 128;
+    double varX = 0, varY = 0, cov = 0;
+
+    for (int k = 1; k < 64; k++) {
+        varX += x[k] * x[k];
+        varY += y[k] * y[k];
+        cov += x[k] * y[k];
+    }
+
+    varX /= 64;
+    varY /= 64;
+    cov /= 64;
+
+    return ((2 * meanX * meanY + DCT_SSIM_C1) * (2 * cov + DCT_SSIM_C2)) /
+           ((meanX * meanX + meanY * meanY + DCT_SSIM_C1) * (varX + varY + DCT_SSIM_C2));
+}
+
+int dctReferenceInit(struct dctReference *ref, const unsigned char *gray, int width, int height) {
+    ref->width = width;
+    ref->height = height;
+    ref->blocksWide = (width + 7) / 8;
+    ref->blocksHigh = (height + 7) / 8;
+    ref->coef = malloc((size_t) ref->blocksWide * ref->blocksHigh * 64 * sizeof(float));
+
+    if (ref->coef == NULL)
+        return 0;
+
+    for (int by = 0; by < ref->blocksHigh; by++) {
+        for (int bx = 0; bx < ref->blocksWide; bx++) {
+            forwardDct(gray, width, height, bx, by, ref->coef + ((size_t) by * ref->blocksWide + bx) * 64);
+        }
+    }
+
+    return 1;
+}
+
+void dctReferenceFree(struct dctReference *ref) {
+    free(ref->coef);
+    ref->coef = NULL;
+}
+
+float dctSsimJpeg(const struct dctReference *ref, unsigned char *jpeg, unsigned long jpegSize) {
+    struct jpeg_decompress_struct cinfo;
+    struct jpegError jerr;
+    jvirt_barray_ptr *coefArrays;
+    double total = 0;
+
+    cinfo.err = jpegErrorInit(&jerr);
+
+    // A JPEG that libjpeg cannot read is not estimated
+    if (setjmp(jerr.failed)) {
+        jpeg_destroy_decompress(&cinfo);
+        return -1;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, jpeg, jpegSize);
+    jpeg_read_header(&cinfo, TRUE);
+
+    // Entropy decode only, leaving the quantized coefficients
+    coefArrays = jpeg_read_coefficients(&cinfo);
+
+    jpeg_component_info *luma = &cinfo.comp_info[0];
+    if ((int) cinfo.image_width != ref->width || (int) cinfo.image_height != ref->height ||
+        (int) luma->width_in_blocks < ref->blocksWide || (int) luma->height_in_blocks < ref->blocksHigh) {
+        jpeg_destroy_decompress(&cinfo);
+        return -1;
+    }
+
+    const UINT16 *quant = luma->quant_table->quantval;
+
+    for (int by = 0; by < ref->blocksHigh; by++) {
+        JBLOCKARRAY row = (*cinfo.mem->access_virt_barray)((j_common_ptr) &cinfo, coefArrays[0], by, 1, FALSE);
+
+        for (int bx = 0; bx < ref->blocksWide; bx++) {
+            float coef[64];
+
+            // Both the coefficients and the table are in natural order
+            for (int k = 0; k < 64; k++)
+                coef[k] = (float) row[0][bx][k] * quant[k];
+
+            total += blockSsim(ref->coef + ((size_t) by * ref->blocksWide + bx) * 64, coef);
+        }
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+
+    return (float) (total / ((double) ref->blocksWide * ref->blocksHigh));
+}
+
+float dctSsimPixels(const struct dctReference *ref, const unsigned char *gray) {
+    double total = 0;
+
+    for (int by = 0; by < ref->blocksHigh; by++) {
+        for (int bx = 0; bx < ref->blocksWide; bx++) {
+            float coef[64];
+
+            forwardDct(gray, ref->width, ref->height, bx, by, coef);
+            total += blockSsim(ref->coef + ((size_t) by * ref->blocksWide + bx) * 64, coef);
+        }
+    }
+
+    return (float) (total / ((double) ref->blocksWide * ref->blocksHigh));
+}
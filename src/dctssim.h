@@ -0,0 +1,50 @@
+/*
+    SSIM of 8x8 blocks computed in the DCT domain
+*/
+#ifndef DCTSSIM_H
+#define DCTSSIM_H
+
+/*
+    Luma DCT coefficients of a reference image. Blocks follow the JPEG
+    grid, and partial blocks at the right and bottom edges are filled by
+    repeating the last column and row, the same way the encoder does.
+*/
+struct dctReference {
+    int width;
+    int height;
+    int blocksWide;
+    int blocksHigh;
+    // 64 coefficients per block in natural order. Pixels are level
+    // shifted by 128 before the transform, as in JPEG.
+    float *coef;
+};
+
+/*
+    Transform a grayscale image into a reference. Returns 1 on success
+    or 0 if out of memory.
+*/
+int dctReferenceInit(struct dctReference *ref, const unsigned char *gray, int width, int height);
+
+/* Free the coefficients of a reference. */
+void dctReferenceFree(struct dctReference *ref);
+
+/*
+    Estimate the mean SSIM of the 8x8 blocks of a JPEG against the
+    reference from its quantized luma coefficients alone. A block's mean
+    is its DC coefficient and, by Parseval, its variance and covariance
+    are sums over the AC coefficients, so the JPEG is only entropy
+    decoded: there is no IDCT, upsampling or color conversion. Clamping
+    and rounding in a real decode are ignored, so this is an estimate.
+
+    Returns -1 if the JPEG cannot be read or does not match the
+    reference size.
+*/
+float dctSsimJpeg(const struct dctReference *ref, unsigned char *jpeg, unsigned long jpegSize);
+
+/*
+    The same metric measured on decoded grayscale pixels, to check the
+    final choice.
+*/
+float dctSsimPixels(const struct dctReference *ref, const unsigned char *gray);
+
+#endif
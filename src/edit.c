@@ -1,6 +1,25 @@
 #include <math.h>
+#include <stdint.h>
 #include <stdlib.h>
 
+#include "edit.h"
+#include "kernels.h"
+
+// Frames of at least this many bytes are compared by several threads
+#define MPE_PARALLEL_BYTES (1 << 20)
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+// Downscaling weights are fixed point with this many fractional bits
+#define SCALE_WEIGHT_BITS 14
+#define SCALE_WEIGHT_ONE (1 << SCALE_WEIGHT_BITS)
+
 float clamp(float low, float value, float high) {
     return (value < low) ? low : ((value > high) ? high : value);
 }
@@ -22,30 +41,79 @@ int interpolate(const unsigned char *image, int width, int components, float x,
     return (top * (1.0 - py)) + (bot * py);
 }
 
-float meanPixelError(const unsigned char *original, const unsigned char *compressed, int width, int height, int components) {
-    float pme = 0.0;
+float meanPixelError(const unsigned char *original, const unsigned char *compressed, int width, int height, int components, int stride) {
+    const int length = width * components;
+    const struct pixelKernels *kernels = pixelKernels();
+    int64_t total = 0;
 
+    // Rows are summed as integers, so the result is exact and the same
+    // with any number of threads
+#ifdef _OPENMP
+#pragma omp parallel for reduction(+: total) if ((int64_t) length * height >= MPE_PARALLEL_BYTES)
+#endif
     for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            for (int z = 0; z < components; z++) {
-                int offset = y * width * components + x * components + z;
-                pme += abs(original[offset] - compressed[offset]);
-            }
-        }
+        total += kernels->absoluteError(original + (size_t) y * stride, compressed + (size_t) y * stride, length);
     }
 
-    return pme / (width * height * components);
+    return (float) ((double) total / ((double) length * height));
 }
 
-void defish(const unsigned char *input, unsigned char *output, int width, int height, int components, float strength, float zoom) {
-    const int cx = width / 2;
-    const int cy = height / 2;
+// Fractional bits of the remap weights
+#define DEFISH_WEIGHT_BITS 8
+#define DEFISH_WEIGHT_ONE (1 << DEFISH_WEIGHT_BITS)
+// Pixels per chunk of a remapped row, whose sources are kept on the stack
+#define DEFISH_CHUNK 256
+
+void defishMapFree(struct defishMap *map) {
+    free(map->theta);
+    map->theta = NULL;
+    map->width = 0;
+    map->height = 0;
+}
+
+// Split a source coordinate in [0, size - 1] into the first of the two
+// samples to blend and the weight of the second
+static inline void splitCoordinate(float position, int size, int *first, unsigned short *weight) {
+    int whole = (int) position;
+    int fraction = (int) ((position - whole) * DEFISH_WEIGHT_ONE + 0.5f);
+
+    // Blend the last two samples at the far edge, so the second is
+    // always in the image. The position is then a whole number, so the
+    // fraction was 0.
+    int edge = (whole >= size - 1) & (size > 1);
+
+    *first = whole - edge;
+    *weight = (unsigned short) (edge ? DEFISH_WEIGHT_ONE : MIN(fraction, DEFISH_WEIGHT_ONE));
+}
+
+int defishMapPrepare(struct defishMap *map, int width, int height, float strength, float zoom) {
+    if (map->theta != NULL && map->width == width && map->height == height &&
+        map->strength == strength && map->zoom == zoom)
+        return 1;
+
+    defishMapFree(map);
+
+    // Offsets from the centre run from 0 to width / 2 across, as the
+    // centre is rounded down, and likewise down
+    const int columns = width / 2 + 1;
+    const int rows = height / 2 + 1;
+
+    map->theta = malloc((size_t) columns * rows * sizeof(float));
+    if (map->theta == NULL)
+        return 0;
+
+    map->width = width;
+    map->height = height;
+    map->strength = strength;
+    map->zoom = zoom;
+    map->columns = columns;
+
     const float len = sqrt(width * width + height * height);
 
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            float dx = (cx - x) * zoom;
-            float dy = (cy - y) * zoom;
+    for (int y = 0; y < rows; y++) {
+        for (int x = 0; x < columns; x++) {
+            float dx = x * zoom;
+            float dy = y * zoom;
             float r = sqrt(dx * dx + dy * dy) / len * strength;
             float theta = 1.0;
 
@@ -53,28 +121,305 @@ void defish(const unsigned char *input, unsigned char *output, int width, int he
                 theta = atan(r) / r;
             }
 
-            dx = clamp(0.0, (float) width / 2.0 - theta * dx, width);
-            dy = clamp(0.0, (float) height / 2.0 - theta * dy, height);
+            map->theta[(size_t) y * columns + x] = theta;
+        }
+    }
+
+    return 1;
+}
+
+// Where output pixel x of a row comes from, given the correction t for
+// its distance from the centre and its row's offset dy
+static inline void defishSource(const struct defishMap *map, float t, int x, float dy, unsigned int *source, unsigned short weights[2]) {
+    const int width = map->width;
+    const int height = map->height;
+    const float dx = (width / 2 - x) * map->zoom;
+    int sx, sy;
+
+    // Rounded once either way, as the difference of two floats this
+    // close in size is exact in double, so float gives the same result
+    float px = width * 0.5f - t * dx;
+    float py = height * 0.5f - t * dy;
+
+    px = px < 0 ? 0 : px > width - 1 ? width - 1 : px;
+    py = py < 0 ? 0 : py > height - 1 ? height - 1 : py;
+
+    splitCoordinate(px, width, &sx, &weights[0]);
+    splitCoordinate(py, height, &sy, &weights[1]);
+    *source = (unsigned int) sy * width + sx;
+}
+
+// Blend the four samples around each output pixel of row y into out.
+// Inlined with a constant component count so the inner loop unrolls.
+static inline void defishRow(const struct defishMap *map, const unsigned char *input, unsigned char *out, int components, int y) {
+    const int width = map->width;
+    const int height = map->height;
+    const int cx = width / 2;
+    const int cy = height / 2;
+    // Steps to the sample right of and below the first one, which are 0
+    // for a single column or row
+    const int right = width > 1 ? components : 0;
+    const int down = height > 1 ? width * components : 0;
+    const float *theta = map->theta + (size_t) abs(cy - y) * map->columns;
+    const float dy = (cy - y) * map->zoom;
+
+    for (int start = 0; start < width; start += DEFISH_CHUNK) {
+        const int count = MIN(DEFISH_CHUNK, width - start);
+        // Pixels of the chunk up to the centre, whose corrections are
+        // read backwards, and those after it, read forwards
+        const int left = MIN(MAX(cx + 1 - start, 0), count);
+        unsigned int source[DEFISH_CHUNK];
+        unsigned short weights[DEFISH_CHUNK][2];
+
+        // Work out where the chunk's pixels come from before blending,
+        // which keeps the arithmetic apart from the scattered reads
+        for (int i = 0; i < left; i++)
+            defishSource(map, theta[cx - start - i], start + i, dy, &source[i], weights[i]);
+        for (int i = left; i < count; i++)
+            defishSource(map, theta[start + i - cx], start + i, dy, &source[i], weights[i]);
+
+        for (int i = 0; i < count; i++) {
+            const unsigned char *topLeft = input + (size_t) source[i] * components;
+            const int wx = weights[i][0];
+            const int wy = weights[i][1];
+            unsigned char *pixel = out + (size_t) (start + i) * components;
 
             for (int z = 0; z < components; z++) {
-                output[y * width * components + x * components + z] = interpolate(input, width, components, dx, dy, z);
+                int top = topLeft[z] * (DEFISH_WEIGHT_ONE - wx) + topLeft[z + right] * wx;
+                int bot = topLeft[z + down] * (DEFISH_WEIGHT_ONE - wx) + topLeft[z + down + right] * wx;
+
+                pixel[z] = (top * (DEFISH_WEIGHT_ONE - wy) + bot * wy + (1 << (2 * DEFISH_WEIGHT_BITS - 1))) >> (2 * DEFISH_WEIGHT_BITS);
             }
         }
     }
 }
 
+void defishMapApply(const struct defishMap *map, const unsigned char *input, unsigned char *output, int components) {
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (int y = 0; y < map->height; y++) {
+        unsigned char *out = output + (size_t) y * map->width * components;
+
+        if (components == 3)
+            defishRow(map, input, out, 3, y);
+        else
+            defishRow(map, input, out, components, y);
+    }
+}
+
+int defishStream(const struct defishMap *map, const unsigned char *input, unsigned char *gray, defishSink sink, void *opaque) {
+    const int width = map->width;
+    unsigned char *strip = malloc((size_t) width * 3 * DEFISH_STRIP_ROWS);
+
+    if (strip == NULL)
+        return 0;
+
+    for (int top = 0; top < map->height; top += DEFISH_STRIP_ROWS) {
+        const int rows = MIN(DEFISH_STRIP_ROWS, map->height - top);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+        for (int i = 0; i < rows; i++) {
+            unsigned char *out = strip + (size_t) i * width * 3;
+
+            defishRow(map, input, out, 3, top + i);
+            if (gray != NULL)
+                grayscaleRow(out, gray + (size_t) (top + i) * width, width);
+        }
+
+        if (!sink(opaque, strip, top, rows)) {
+            free(strip);
+            return 0;
+        }
+    }
+
+    free(strip);
+
+    return 1;
+}
+
+int defish(const unsigned char *input, unsigned char *output, int width, int height, int components, float strength, float zoom) {
+    struct defishMap map = { 0 };
+
+    if (!defishMapPrepare(&map, width, height, strength, zoom))
+        return 0;
+
+    defishMapApply(&map, input, output, components);
+    defishMapFree(&map);
+
+    return 1;
+}
+
+int scale(unsigned char *image, int width, int height, unsigned char **newImage, int newWidth, int newHeight) {
+    *newImage = malloc((size_t) newWidth * newHeight);
+    if (*newImage == NULL)
+        return 0;
+
+    for (int y = 0; y < newHeight; y++) {
+        for (int x = 0; x < newWidth; x++) {
+            float oldX = MIN((float) x / newWidth * width, width - 1);
+            float oldY = MIN((float) y / newHeight * height, height - 1);
+
+            (*newImage)[y * newWidth + x] = interpolate(image, width, 1, oldX, oldY, 0);
+        }
+    }
+
+    return 1;
+}
+
+/*
+    Input pixels covered by each output pixel along one axis of a
+    downscale, with how much of each is covered. Every output pixel has
+    the same number of taps, the last of them zero weighted as needed.
+*/
+struct scaleTaps {
+    int count;
+    // First input pixel of each output pixel
+    int *first;
+    // count weights per output pixel, summing to SCALE_WEIGHT_ONE
+    unsigned short *weights;
+};
+
+static void scaleTapsFree(struct scaleTaps *taps) {
+    free(taps->first);
+    free(taps->weights);
+}
+
+static int scaleTapsInit(struct scaleTaps *taps, int size, int newSize) {
+    // An output pixel covers size / newSize input pixels, which straddle
+    // one more unless they line up
+    const int count = MIN((size + newSize - 1) / newSize + 1, size);
+
+    taps->count = count;
+    taps->first = malloc(newSize * sizeof(int));
+    taps->weights = calloc((size_t) newSize * count, sizeof(unsigned short));
+
+    if (taps->first == NULL || taps->weights == NULL) {
+        scaleTapsFree(taps);
+        return 0;
+    }
+
+    for (int x = 0; x < newSize; x++) {
+        unsigned short *weights = taps->weights + (size_t) x * count;
+        // The covered span, in units of 1 / newSize input pixels
+        const int64_t start = (int64_t) x * size;
+        const int64_t end = start + size;
+        const int first = MIN((int) (start / newSize), size - count);
+        int total = 0;
+        int largest = 0;
+
+        for (int t = 0; t < count; t++) {
+            const int64_t low = (int64_t) (first + t) * newSize;
+            const int64_t overlap = MIN(low + newSize, end) - MAX(low, start);
+
+            if (overlap > 0) {
+                weights[t] = (overlap * SCALE_WEIGHT_ONE + size / 2) / size;
+                total += weights[t];
+                largest = weights[t] > weights[largest] ? t : largest;
+            }
+        }
+
+        // Rounding is made up on the largest weight, so flat areas stay
+        // exactly the same
+        weights[largest] += SCALE_WEIGHT_ONE - total;
+        taps->first[x] = first;
+    }
+
+    return 1;
+}
+
+// Average across a row of vertical sums into newWidth output pixels.
+// Inlined with a constant component count so the inner loop unrolls.
+static inline void downscaleRow(const struct scaleTaps *columns, const uint32_t *sum, unsigned char *out, int newWidth, int components) {
+    const int count = columns->count;
+
+    for (int x = 0; x < newWidth; x++) {
+        const uint32_t *in = sum + (size_t) columns->first[x] * components;
+        const unsigned short *weights = columns->weights + (size_t) x * count;
+
+        for (int z = 0; z < components; z++) {
+            // Sums are cut to 16 bits first, so the total fits 32
+            uint32_t total = 0;
+
+            for (int t = 0; t < count; t++)
+                total += (in[t * components + z] >> (SCALE_WEIGHT_BITS - 8)) * weights[t];
+
+            out[x * components + z] = (total + (1 << (SCALE_WEIGHT_BITS + 7))) >> (SCALE_WEIGHT_BITS + 8);
+        }
+    }
+}
+
+int downscale(const unsigned char *input, int width, int height, int components, unsigned char *output, int newWidth, int newHeight) {
+    const struct pixelKernels *kernels = pixelKernels();
+    const int stride = width * components;
+    struct scaleTaps columns = { 0 };
+    struct scaleTaps rows = { 0 };
+    int ok = 1;
+
+    if (newWidth < 1 || newHeight < 1 || newWidth > width || newHeight > height)
+        return 0;
+
+    if (!scaleTapsInit(&columns, width, newWidth) || !scaleTapsInit(&rows, height, newHeight)) {
+        scaleTapsFree(&columns);
+        scaleTapsFree(&rows);
+        return 0;
+    }
+
+    // Each output row sums its input rows, which vectorizes well, and
+    // then averages across the sum
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) reduction(&&: ok)
+#endif
+    for (int y = 0; y < newHeight; y++) {
+        uint32_t *sum = calloc(stride, sizeof(uint32_t));
+        unsigned char *out = output + (size_t) y * newWidth * components;
+
+        if (sum == NULL) {
+            ok = 0;
+            continue;
+        }
+
+        for (int t = 0; t < rows.count; t++) {
+            const uint32_t weight = rows.weights[(size_t) y * rows.count + t];
+
+            if (weight)
+                kernels->weightedRowSum(input + (size_t) (rows.first[y] + t) * stride, stride, weight, sum);
+        }
+
+        if (components == 3)
+            downscaleRow(&columns, sum, out, newWidth, 3);
+        else
+            downscaleRow(&columns, sum, out, newWidth, components);
+
+        free(sum);
+    }
+
+    scaleTapsFree(&columns);
+    scaleTapsFree(&rows);
+
+    return ok;
+}
+
+void grayscaleRow(const unsigned char *input, unsigned char *output, int width) {
+    for (int x = 0; x < width; x++) {
+        // Y = 0.299R + 0.587G + 0.114B
+        output[x] = input[x * 3] * 0.299 +
+                    input[x * 3 + 1] * 0.587 +
+                    input[x * 3 + 2] * 0.114 + 0.5;
+    }
+}
+
 long grayscale(const unsigned char *input, unsigned char **output, int width, int height) {
     int stride = width * 3;
 
     *output = malloc(width * height);
+    if (*output == NULL)
+        return 0;
 
     for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            // Y = 0.299R + 0.587G + 0.114B
-            (*output)[y * width + x] = input[y * stride + x * 3] * 0.299 +
-                                       input[y * stride + x * 3 + 1] * 0.587 +
-                                       input[y * stride + x * 3 + 2] * 0.114 + 0.5;
-        }
+        grayscaleRow(input + (size_t) y * stride, *output + (size_t) y * width, width);
     }
 
     return width * height;
@@ -15,21 +15,101 @@ float clamp(float low, float value, float high);
 int interpolate(const unsigned char *image, int width, int components, float x, float y, int offset);
 
 /*
-    Get mean error per pixel rate.
+    Get mean error per pixel rate. Rows start stride bytes apart.
 */
-float meanPixelError(const unsigned char *original, const unsigned char *compressed, int width, int height, int components);
+float meanPixelError(const unsigned char *original, const unsigned char *compressed, int width, int height, int components, int stride);
+
+/*
+    Geometry that removes fisheye distortion from images of one size, so
+    the costly part is worked out once and can be reused for every image
+    with the same settings. The correction only depends on how far a
+    pixel is from the centre across and down, so it is kept for one
+    quarter of the image, and each row's source positions and bilinear
+    weights are worked out from it as the row is remapped.
+*/
+struct defishMap {
+    int width;
+    int height;
+    float strength;
+    float zoom;
+    // Correction factor by row offset |height / 2 - y| and column
+    // offset |width / 2 - x|, columns to a row
+    int columns;
+    float *theta;
+};
+
+/*
+    Build a map for the given size and settings, unless map already
+    holds one. map must be zeroed before its first use. Returns 1 on
+    success or 0 if out of memory.
+*/
+int defishMapPrepare(struct defishMap *map, int width, int height, float strength, float zoom);
+
+/*
+    Remap an image of the map's size with the given number of color
+    components. Rows are shared between threads when built with OpenMP.
+*/
+void defishMapApply(const struct defishMap *map, const unsigned char *input, unsigned char *output, int components);
+
+/*
+    Rows per strip of defishStream(). Even, so each strip holds whole
+    rows of 4:2:0 chroma.
+*/
+#define DEFISH_STRIP_ROWS 16
+
+/*
+    Receives a strip of rows top to top + rows - 1 of a defished RGB
+    image with a stride of width * 3. Returns 0 to stop the stream.
+*/
+typedef int (*defishSink)(void *opaque, const unsigned char *rgb, int top, int rows);
+
+/*
+    Remap an RGB image a strip of DEFISH_STRIP_ROWS rows at a time, so
+    the corrected image is never held whole. The luma of each row is
+    written to gray, unless it is NULL, and each strip is then passed
+    to sink, e.g. to import it into an encoder. Returns 1 on success,
+    or 0 if out of memory or the sink stopped.
+*/
+int defishStream(const struct defishMap *map, const unsigned char *input, unsigned char *gray, defishSink sink, void *opaque);
+
+/* Free the tables of a map and zero it. */
+void defishMapFree(struct defishMap *map);
 
 /*
     Remove fisheye distortion from an image. The amount of distortion is
     controlled by strength, while zoom controls where the image gets
     cropped. For example, the Tokina 10-17mm ATX fisheye on a Canon APS-C
-    body set to 10mm looks good with strength=2.6 and zoom=1.2.
+    body set to 10mm looks good with strength=2.6 and zoom=1.2. Returns
+    1 on success or 0 if out of memory.
+*/
+int defish(const unsigned char *input, unsigned char *output, int width, int height, int components, float strength, float zoom);
+
+/*
+    Scale a grayscale image by sampling it bilinearly at the top left
+    corner of each output pixel, as the image hash expects. Allocates
+    *newImage. Returns 0 if out of memory. Use downscale() for images
+    that are meant to be looked at.
+*/
+int scale(unsigned char *image, int width, int height, unsigned char **newImage, int newWidth, int newHeight);
+
+/*
+    Shrink an image with the given number of color components to
+    newWidth x newHeight, each no larger than before, by averaging the
+    area of the input that each output pixel covers. Rows are shared
+    between threads when built with OpenMP. Returns 1 on success, or 0
+    if out of memory or the new size is not a shrink.
+*/
+int downscale(const unsigned char *input, int width, int height, int components, unsigned char *output, int newWidth, int newHeight);
+
+/*
+    Convert a row of width RGB pixels to grayscale.
 */
-void defish(const unsigned char *input, unsigned char *output, int width, int height, int components, float strength, float zoom);
+void grayscaleRow(const unsigned char *input, unsigned char *output, int width);
 
 /*
     Convert an RGB image to grayscale. Assumes 8-bit color components, 
-    3 color components and a row stride of width * 3.
+    3 color components and a row stride of width * 3. Returns 0 if out
+    of memory.
 */
 long grayscale(const unsigned char *input, unsigned char **output, int width, int height);
 
@@ -107,5 +107,16 @@ int _iqa_img_filter(float *img, int w, int h, const struct _kernel *k, float *re
  */
 float _iqa_filter_pixel(const float *img, int w, int h, int x, int y, const struct _kernel *k, const float kscale);
 
+/**
+ * Row at a time versions of _iqa_convolve() for each instruction set
+ * level. They write the dst_w x dst_h result to dst, which may be img.
+ * @return 0 on success, 1 if out of memory.
+ */
+int _iqa_convolve_rows_baseline(float *img, int w, int h, const struct _kernel *k, float scale, float *dst);
+#ifdef IQA_X86_KERNELS
+int _iqa_convolve_rows_avx2(float *img, int w, int h, const struct _kernel *k, float scale, float *dst);
+int _iqa_convolve_rows_avx512(float *img, int w, int h, const struct _kernel *k, float scale, float *dst);
+#endif
+
 
 #endif /*_CONVOLVE_H_*/
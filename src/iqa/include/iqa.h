@@ -61,6 +61,22 @@ struct iqa_ms_ssim_args {
     const float *gammas;  /**< Pointer to array of gamma values for each scale. Required if 'scales' isn't 5. */
 };
 
+/**
+ * Instruction set levels the convolution kernels are built for.
+ */
+#define IQA_CPU_BASELINE 0  /**< Compiler default, SSE2 on x86-64 */
+#define IQA_CPU_AVX2     1
+#define IQA_CPU_AVX512   2  /**< AVX-512F and AVX-512BW */
+
+/**
+ * Selects the convolution kernels used by all metrics. The library does
+ * not check the CPU: the caller must only pass a level the CPU supports.
+ * Levels that were not built for the target fall back to the baseline.
+ * All levels give identical results.
+ * @param level One of the IQA_CPU_* levels. Default is IQA_CPU_BASELINE.
+ */
+void iqa_set_cpu_level(int level);
+
 /**
  * Calculates the Mean Squared Error between 2 equal-sized 8-bit images.
  * @note The images must have the same width, height, and stride.
@@ -108,6 +124,85 @@ float iqa_psnr(const unsigned char *ref, const unsigned char *cmp, int w, int h,
 float iqa_ssim(const unsigned char *ref, const unsigned char *cmp, int w, int h, int stride, 
     int gaussian, const struct iqa_ssim_args *args);
 
+/**
+ * Estimates the Structural SIMilarity between 2 equal-sized 8-bit images
+ * well enough to compare it with a target. Bands of the image are scored
+ * in a spread-out order, and scoring stops as soon as the target is more
+ * than z standard errors away from the running estimate of the mean.
+ * Candidates far from the target are usually decided after a small part
+ * of the image.
+ *
+ * @note The images must have the same width, height, and stride.
+ * @param ref Original reference image
+ * @param cmp Distorted image
+ * @param w Width of the images
+ * @param h Height of the images
+ * @param stride The length (in bytes) of each horizontal line in the image.
+ *               This may be different from the image width.
+ * @param gaussian 0 = 8x8 square window, 1 = 11x11 circular-symmetric Gaussian
+ * weighting.
+ * @param args Optional SSIM arguments for fine control of the algorithm. 0 for
+ * defaults. Defaults are a=b=g=1.0, L=255, K1=0.01, K2=0.03
+ * @param target The value the result will be compared with.
+ * @param z Certainty required before stopping, in standard errors (e.g. 3).
+ * 0 scores the whole image.
+ * @param exact Optional. Set to 1 if the whole image was scored, 0 if the
+ * result is an estimate.
+ * @return The (estimated) mean SSIM, or INFINITY if error.
+ */
+float iqa_ssim_early(const unsigned char *ref, const unsigned char *cmp, int w, int h, int stride,
+    int gaussian, const struct iqa_ssim_args *args, float target, float z, int *exact);
+
+/**
+ * State for scoring a series of candidates against the same reference, such
+ * as the steps of a quality search. The last candidate and the SSIM of each
+ * small tile of it are kept, and only the tiles with a window over a block
+ * that differs from the last candidate are scored again. Blocks that decode
+ * to identical pixels at neighbouring qualities, like flat sky, are reused.
+ */
+struct iqa_ssim_state;
+
+/**
+ * Creates an incremental SSIM state for a reference image.
+ *
+ * @param ref Original reference image, which is copied
+ * @param w Width of the image
+ * @param h Height of the image
+ * @param stride The length (in bytes) of each horizontal line in the image.
+ *               Candidates must use the same stride.
+ * @param gaussian 0 = 8x8 square window, 1 = 11x11 circular-symmetric Gaussian
+ * weighting.
+ * @param args Optional SSIM arguments for fine control of the algorithm. 0 for
+ * defaults.
+ * @param block Size of the blocks compared between candidates, ideally the
+ * codec's block size (8 for JPEG, 16 for WebP macroblocks).
+ * @return The state, or 0 if error. Free it with iqa_ssim_state_free().
+ */
+struct iqa_ssim_state *iqa_ssim_state_new(const unsigned char *ref, int w, int h, int stride,
+    int gaussian, const struct iqa_ssim_args *args, int block);
+
+/**
+ * Frees a state created by iqa_ssim_state_new().
+ */
+void iqa_ssim_state_free(struct iqa_ssim_state *state);
+
+/**
+ * Calculates the SSIM of the next candidate, reusing what is unchanged since
+ * the last one. Early exit works as in iqa_ssim_early(), and the tiles it
+ * skips are scored on a later call if needed.
+ *
+ * @param state State created by iqa_ssim_state_new()
+ * @param cmp Distorted image, the same size as the reference
+ * @param target The value the result will be compared with.
+ * @param z Certainty required before stopping, in standard errors. 0 scores
+ * the whole image.
+ * @param exact Optional. Set to 1 if the whole image was scored, 0 if the
+ * result is an estimate.
+ * @return The (estimated) mean SSIM, or INFINITY if error.
+ */
+float iqa_ssim_incremental(struct iqa_ssim_state *state, const unsigned char *cmp,
+    float target, float z, int *exact);
+
 /**
  * Calculates the Multi-Scale Structural SIMilarity between 2 equal-sized 8-bit
  * images. The default algorithm is MS-SSIM* proposed by Rouse/Hemami 2008.
@@ -32,8 +32,16 @@
  */
 
 #include "convolve.h"
+#include "iqa.h"
 #include <stdlib.h>
 
+static int _cpu_level = IQA_CPU_BASELINE;
+
+void iqa_set_cpu_level(int level)
+{
+    _cpu_level = level;
+}
+
 float KBND_SYMMETRIC(const float *img, int w, int h, int x, int y, float bnd_const)
 {
     if (x<0) x=-1-x;
@@ -94,9 +102,32 @@ void _iqa_convolve(float *img, int w, int h, const struct _kernel *k, float *res
     if (!dst)
         dst = img; /* Convolve in-place */
 
+    if (rw) *rw = dst_w;
+    if (rh) *rh = dst_h;
+
     /* Kernel is applied to all positions where the kernel is fully contained
      * in the image */
     scale = _calc_scale(k);
+
+    /* The row kernels only fail when out of memory, and then the
+     * per-pixel loop below gives the same result */
+    switch (_cpu_level) {
+#ifdef IQA_X86_KERNELS
+    case IQA_CPU_AVX512:
+        if (!_iqa_convolve_rows_avx512(img, w, h, k, scale, dst))
+            return;
+        break;
+    case IQA_CPU_AVX2:
+        if (!_iqa_convolve_rows_avx2(img, w, h, k, scale, dst))
+            return;
+        break;
+#endif
+    default:
+        if (!_iqa_convolve_rows_baseline(img, w, h, k, scale, dst))
+            return;
+        break;
+    }
+
     for (y=0; y < dst_h; ++y) {
         for (x=0; x < dst_w; ++x) {
             sum = 0.0;
@@ -112,9 +143,6 @@ void _iqa_convolve(float *img, int w, int h, const struct _kernel *k, float *res
             dst[y*dst_w + x] = (float)(sum * scale);
         }
     }
-
-    if (rw) *rw = dst_w;
-    if (rh) *rh = dst_h;
 }
 
 int _iqa_img_filter(float *img, int w, int h, const struct _kernel *k, float *result)
@@ -0,0 +1,6 @@
+/*
+ * AVX2 build of the row at a time convolution
+ */
+#define IQA_KERNEL_SUFFIX _avx2
+
+#include "convolve_kernel.c"
@@ -0,0 +1,6 @@
+/*
+ * AVX-512 build of the row at a time convolution
+ */
+#define IQA_KERNEL_SUFFIX _avx512
+
+#include "convolve_kernel.c"
@@ -0,0 +1,64 @@
+/*
+ * Row at a time convolution, written so the compiler can vectorize it.
+ * This file is built once per instruction set level: as is for the
+ * baseline, and through convolve_avx2.c and convolve_avx512.c with wider
+ * vectors enabled.
+ */
+
+#include "convolve.h"
+#include <stdlib.h>
+
+#ifndef IQA_KERNEL_SUFFIX
+#define IQA_KERNEL_SUFFIX _baseline
+#endif
+
+#define _IQA_PASTE(name, suffix) name##suffix
+#define _IQA_NAME(name, suffix) _IQA_PASTE(name, suffix)
+
+/*
+ * Each kernel tap is added to a row of sums at once, which vectorizes
+ * across x. Every output pixel still adds its float products to a double
+ * in the same order as _iqa_convolve(), so the results are identical.
+ */
+int _IQA_NAME(_iqa_convolve_rows, IQA_KERNEL_SUFFIX)(float *img, int w, int h, const struct _kernel *k, float scale, float *dst)
+{
+    int x,y,u,v,k_offset;
+    int uc = k->w/2;
+    int vc = k->h/2;
+    int kw_even = (k->w&1)?0:1;
+    int kh_even = (k->h&1)?0:1;
+    int dst_w = w - k->w + 1;
+    int dst_h = h - k->h + 1;
+    double *sum;
+
+    if (dst_w <= 0 || dst_h <= 0)
+        return 0;
+
+    sum = (double*)malloc(dst_w*sizeof(double));
+    if (!sum)
+        return 1;
+
+    /* Rows are written once all their taps are summed. Later rows only
+     * read input below them, so this works in-place too. */
+    for (y=0; y < dst_h; ++y) {
+        for (x=0; x < dst_w; ++x)
+            sum[x] = 0.0;
+
+        k_offset = 0;
+        for (v=-vc; v <= vc-kh_even; ++v) {
+            const float *row = img + (y+vc+v)*w + uc;
+            for (u=-uc; u <= uc-kw_even; ++u, ++k_offset) {
+                const float *src = row + u;
+                const float kv = k->kernel[k_offset];
+                for (x=0; x < dst_w; ++x)
+                    sum[x] += src[x] * kv;
+            }
+        }
+
+        for (x=0; x < dst_w; ++x)
+            dst[y*dst_w + x] = (float)(sum[x] * scale);
+    }
+
+    free(sum);
+    return 0;
+}
@@ -38,6 +38,7 @@
 #include "ssim.h"
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
 
 
 /* Forward declarations. */
@@ -46,6 +47,17 @@ IQA_INLINE static double _calc_contrast(double, float, float, float, float);
 IQA_INLINE static double _calc_structure(float, double, float, float, float, float);
 static int _ssim_map(const struct _ssim_int *, void *);
 static float _ssim_reduce(int, int, void *);
+static float *_ssim_load(const unsigned char *, int, int, int, int, const struct _kernel *, int *, int *);
+
+/* Size, in SSIM map pixels, of the tiles scored by _ssim_tile() */
+#define MAP_TILE_W 128
+#define MAP_TILE_H 16
+
+/* Bands iqa_ssim_early() scores before it may stop */
+#define EARLY_MIN_BANDS 8
+
+/* Width of the tiles iqa_ssim_incremental() keeps sums for */
+#define STATE_TILE_W 16
 
 /* 
  * SSIM(x,y)=(2*ux*uy + C1)*(2sxy + C2) / (ux^2 + uy^2 + C1)*(sx^2 + sy^2 + C2)
@@ -138,6 +150,429 @@ float iqa_ssim(const unsigned char *ref, const unsigned char *cmp, int w, int h,
 }
 
 
+/* _ssim_load */
+static float *_ssim_load(const unsigned char *img, int w, int h, int stride, int scale,
+    const struct _kernel *low_pass, int *rw, int *rh)
+{
+    int x,y,src_offset,offset;
+    float *img_f;
+
+    /* Convert image values to floats. Forcing stride = width. */
+    img_f = (float*)malloc(w*h*sizeof(float));
+    if (!img_f)
+        return 0;
+    for (y=0; y<h; ++y) {
+        src_offset = y*stride;
+        offset = y*w;
+        for (x=0; x<w; ++x, ++offset, ++src_offset)
+            img_f[offset] = (float)img[src_offset];
+    }
+
+    *rw = w;
+    *rh = h;
+
+    /* Scale the image down if required */
+    if (scale > 1 && _iqa_decimate(img_f, w, h, scale, low_pass, 0, rw, rh)) {
+        free(img_f);
+        return 0;
+    }
+    return img_f;
+}
+
+/*
+ * State shared by the tiled SSIM functions, which score the SSIM map a
+ * rectangle at a time without allocating full-size intermediate planes.
+ */
+struct _ssim_tiled {
+    float alpha, beta, gamma;
+    float C1, C2, C3;
+    int custom;             /* 1 if alpha, beta or gamma may differ from 1 */
+    const float *k;         /* Window */
+    int kw, kh;
+    struct _kernel low_pass;
+    int scale;
+    int src_w, src_h, stride;   /* Size of the 8-bit images */
+    int w, h;               /* Size of the (scaled) float images */
+    int dst_w, dst_h;       /* Size of the SSIM map */
+    float *ref_f;           /* Reference and candidate float images */
+    float **cmp_f;
+    int n;
+    float *ref_mu;          /* Reference statistics for one tile */
+    float *ref_sigma_sqd;
+};
+
+/* _ssim_tiled_free */
+static void _ssim_tiled_free(struct _ssim_tiled *t)
+{
+    int i;
+    if (t->cmp_f) {
+        for (i=0; i<t->n; ++i)
+            free(t->cmp_f[i]);
+        free(t->cmp_f);
+    }
+    free(t->ref_f);
+    free(t->ref_mu);
+    free(t->ref_sigma_sqd);
+    free(t->low_pass.kernel);
+}
+
+/*
+ * _ssim_tiled_init: cmp may be 0, in which case the n candidate images are
+ * left for the caller to load.
+ */
+static int _ssim_tiled_init(struct _ssim_tiled *t, const unsigned char *ref, const unsigned char * const *cmp,
+    int n, int w, int h, int stride, int gaussian, const struct iqa_ssim_args *args)
+{
+    int i,offset,scale;
+    float K1=0.01f, K2=0.03f;
+    int L=255;
+
+    t->alpha = t->beta = t->gamma = 1.0f;
+    t->custom = 0;
+    t->n = n;
+    t->src_w = w;
+    t->src_h = h;
+    t->stride = stride;
+    t->ref_f = 0;
+    t->cmp_f = 0;
+    t->ref_mu = 0;
+    t->ref_sigma_sqd = 0;
+    t->low_pass.kernel = 0;
+
+    /* Initialize algorithm parameters */
+    scale = _max( 1, _round( (float)_min(w,h) / 256.0f ) );
+    if (args) {
+        if (args->f)
+            scale = args->f;
+        t->alpha = args->alpha;
+        t->beta  = args->beta;
+        t->gamma = args->gamma;
+        t->custom = 1;
+        L  = args->L;
+        K1 = args->K1;
+        K2 = args->K2;
+    }
+    t->scale = scale;
+    t->C1 = (K1*L)*(K1*L);
+    t->C2 = (K2*L)*(K2*L);
+    t->C3 = t->C2 / 2.0f;
+
+    t->k = (const float*)g_square_window;
+    t->kw = t->kh = SQUARE_LEN;
+    if (gaussian) {
+        t->k = (const float*)g_gaussian_window;
+        t->kw = t->kh = GAUSSIAN_LEN;
+    }
+
+    /* Generate simple low-pass filter */
+    if (scale > 1) {
+        t->low_pass.kernel = (float*)malloc(scale*scale*sizeof(float));
+        if (!t->low_pass.kernel)
+            return 1;
+        t->low_pass.w = t->low_pass.h = scale;
+        t->low_pass.normalized = 0;
+        t->low_pass.bnd_opt = KBND_SYMMETRIC;
+        for (offset=0; offset<scale*scale; ++offset)
+            t->low_pass.kernel[offset] = 1.0f/(scale*scale);
+    }
+
+    /* Every image is read in full exactly once here */
+    t->ref_f = _ssim_load(ref, w, h, stride, scale, &t->low_pass, &t->w, &t->h);
+    t->cmp_f = (float**)calloc(n, sizeof(float*));
+    t->ref_mu = (float*)malloc(MAP_TILE_W*MAP_TILE_H*sizeof(float));
+    t->ref_sigma_sqd = (float*)malloc(MAP_TILE_W*MAP_TILE_H*sizeof(float));
+    if (!t->ref_f || !t->cmp_f || !t->ref_mu || !t->ref_sigma_sqd) {
+        _ssim_tiled_free(t);
+        return 1;
+    }
+    for (i=0; cmp && i<n; ++i) {
+        t->cmp_f[i] = _ssim_load(cmp[i], w, h, stride, scale, &t->low_pass, &t->w, &t->h);
+        if (!t->cmp_f[i]) {
+            _ssim_tiled_free(t);
+            return 1;
+        }
+    }
+
+    /* The SSIM map is smaller by the window width and height */
+    t->dst_w = t->w - t->kw + 1;
+    t->dst_h = t->h - t->kh + 1;
+    if (t->dst_w < 1 || t->dst_h < 1) {
+        _ssim_tiled_free(t);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * _ssim_tile: Adds the SSIM of each map pixel in a tile of at most
+ * MAP_TILE_W x MAP_TILE_H to the sum of each candidate.
+ */
+static void _ssim_tile(struct _ssim_tiled *t, int tx, int ty, int tw, int th, double *ssim_sum)
+{
+    int i,x,y,u,v,offset,img_offset;
+    const float *k = t->k;
+    const float *ref_f = t->ref_f;
+    const float *cmp_f;
+    double mu,sq,both,numerator,denominator,sigma_root;
+    float cmp_mu,cmp_sigma_sqd,sigma_both,ref_m,ref_s;
+
+    /* Reference mean and variance, shared by all candidates */
+    for (y=0; y<th; ++y) {
+        for (x=0; x<tw; ++x) {
+            mu = sq = 0.0;
+            offset = 0;
+            for (v=0; v<t->kh; ++v) {
+                img_offset = (ty+y+v)*t->w + tx+x;
+                for (u=0; u<t->kw; ++u, ++offset) {
+                    mu += ref_f[img_offset+u] * k[offset];
+                    sq += ref_f[img_offset+u] * ref_f[img_offset+u] * k[offset];
+                }
+            }
+            t->ref_mu[y*MAP_TILE_W + x] = (float)mu;
+            t->ref_sigma_sqd[y*MAP_TILE_W + x] = (float)sq - (float)mu * (float)mu;
+        }
+    }
+
+    for (i=0; i<t->n; ++i) {
+        cmp_f = t->cmp_f[i];
+        for (y=0; y<th; ++y) {
+            for (x=0; x<tw; ++x) {
+                mu = sq = both = 0.0;
+                offset = 0;
+                for (v=0; v<t->kh; ++v) {
+                    img_offset = (ty+y+v)*t->w + tx+x;
+                    for (u=0; u<t->kw; ++u, ++offset) {
+                        mu += cmp_f[img_offset+u] * k[offset];
+                        sq += cmp_f[img_offset+u] * cmp_f[img_offset+u] * k[offset];
+                        both += ref_f[img_offset+u] * cmp_f[img_offset+u] * k[offset];
+                    }
+                }
+                ref_m = t->ref_mu[y*MAP_TILE_W + x];
+                ref_s = t->ref_sigma_sqd[y*MAP_TILE_W + x];
+                cmp_mu = (float)mu;
+                cmp_sigma_sqd = (float)sq - cmp_mu * cmp_mu;
+                sigma_both = (float)both - ref_m * cmp_mu;
+
+                if (!t->custom) {
+                    /* The default case */
+                    numerator   = (2.0 * ref_m * cmp_mu + t->C1) * (2.0 * sigma_both + t->C2);
+                    denominator = (ref_m*ref_m + cmp_mu*cmp_mu + t->C1) * (ref_s + cmp_sigma_sqd + t->C2);
+                    ssim_sum[i] += numerator / denominator;
+                }
+                else {
+                    /* User tweaked alpha, beta, or gamma */
+                    if (ref_s < 0.0f)
+                        ref_s = 0.0f;
+                    if (cmp_sigma_sqd < 0.0f)
+                        cmp_sigma_sqd = 0.0f;
+                    sigma_root = sqrt(ref_s * cmp_sigma_sqd);
+
+                    ssim_sum[i] += _calc_luminance(ref_m, cmp_mu, t->C1, t->alpha) *
+                        _calc_contrast(sigma_root, ref_s, cmp_sigma_sqd, t->C2, t->beta) *
+                        _calc_structure(sigma_both, sigma_root, ref_s, cmp_sigma_sqd, t->C3, t->gamma);
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Incremental state. The SSIM map is divided into tiles whose sums are kept
+ * for the last candidate. A new candidate is compared with the last one a
+ * block at a time, and a tile is only scored again if a changed block
+ * falls under one of its windows.
+ */
+struct iqa_ssim_state {
+    struct _ssim_tiled t;   /* t.cmp_f[0] is the last candidate, if any */
+    int block;              /* Block size in (scaled) pixels */
+    int blocks_x, blocks_y;
+    unsigned char *changed; /* Blocks that differ from the last candidate */
+    int tiles_x, tiles_y;
+    double *tile_sum;
+    unsigned char *tile_valid; /* Tiles whose sum is for the last candidate */
+};
+
+/* iqa_ssim_state_new */
+struct iqa_ssim_state *iqa_ssim_state_new(const unsigned char *ref, int w, int h, int stride,
+    int gaussian, const struct iqa_ssim_args *args, int block)
+{
+    struct iqa_ssim_state *state;
+
+    state = (struct iqa_ssim_state*)calloc(1, sizeof(struct iqa_ssim_state));
+    if (!state)
+        return 0;
+    if (_ssim_tiled_init(&state->t, ref, 0, 1, w, h, stride, gaussian, args)) {
+        free(state);
+        return 0;
+    }
+
+    state->block = _max(1, block / state->t.scale);
+    state->blocks_x = (state->t.w + state->block - 1) / state->block;
+    state->blocks_y = (state->t.h + state->block - 1) / state->block;
+    state->tiles_x = (state->t.dst_w + STATE_TILE_W - 1) / STATE_TILE_W;
+    state->tiles_y = (state->t.dst_h + MAP_TILE_H - 1) / MAP_TILE_H;
+    state->changed = (unsigned char*)malloc(state->blocks_x * state->blocks_y);
+    state->tile_sum = (double*)malloc(state->tiles_x * state->tiles_y * sizeof(double));
+    state->tile_valid = (unsigned char*)calloc(state->tiles_x * state->tiles_y, 1);
+    if (!state->changed || !state->tile_sum || !state->tile_valid) {
+        iqa_ssim_state_free(state);
+        return 0;
+    }
+    return state;
+}
+
+/* iqa_ssim_state_free */
+void iqa_ssim_state_free(struct iqa_ssim_state *state)
+{
+    if (!state)
+        return;
+    _ssim_tiled_free(&state->t);
+    free(state->changed);
+    free(state->tile_sum);
+    free(state->tile_valid);
+    free(state);
+}
+
+/*
+ * _ssim_invalidate: Marks the blocks that differ between the last
+ * candidate and cmp_f, and drops the sums of tiles with a window over any
+ * of them.
+ */
+static void _ssim_invalidate(struct iqa_ssim_state *state, const float *cmp_f)
+{
+    struct _ssim_tiled *t = &state->t;
+    const float *last_f = t->cmp_f[0];
+    int bx,by,y,x0,x1,y0,y1,tx,ty,bw;
+
+    for (by=0; by<state->blocks_y; ++by) {
+        for (bx=0; bx<state->blocks_x; ++bx) {
+            x0 = bx * state->block;
+            bw = _min(state->block, t->w - x0);
+            y1 = _min((by+1) * state->block, t->h);
+            for (y=by*state->block; y<y1; ++y) {
+                if (memcmp(last_f + y*t->w + x0, cmp_f + y*t->w + x0, bw*sizeof(float)))
+                    break;
+            }
+            state->changed[by*state->blocks_x + bx] = y < y1;
+        }
+    }
+
+    for (ty=0; ty<state->tiles_y; ++ty) {
+        for (tx=0; tx<state->tiles_x; ++tx) {
+            if (!state->tile_valid[ty*state->tiles_x + tx])
+                continue;
+
+            /* Blocks under the windows of the tile's map pixels */
+            x0 = tx*STATE_TILE_W / state->block;
+            x1 = (_min((tx+1)*STATE_TILE_W, t->dst_w) + t->kw - 2) / state->block;
+            y0 = ty*MAP_TILE_H / state->block;
+            y1 = (_min((ty+1)*MAP_TILE_H, t->dst_h) + t->kh - 2) / state->block;
+            for (by=y0; by<=y1; ++by) {
+                for (bx=x0; bx<=x1; ++bx) {
+                    if (state->changed[by*state->blocks_x + bx]) {
+                        state->tile_valid[ty*state->tiles_x + tx] = 0;
+                        by = y1;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Scores rows of tiles in bit-reversed order, so that the rows seen so far
+ * are spread over the whole image, and treats their means as a sample of
+ * all row means. Stops once the target lies more than z standard errors
+ * (with the finite population correction) from the running estimate.
+ */
+float iqa_ssim_incremental(struct iqa_ssim_state *state, const unsigned char *cmp,
+    float target, float z, int *exact)
+{
+    struct _ssim_tiled *t;
+    float *cmp_f;
+    int bands,bits,index,band,tx,tw,th,rows,cw,ch,scored=0;
+    double band_sum,band_mean,delta,total=0.0;
+    double mean=0.0,m2=0.0,estimate=0.0,se;
+    long pixels=0;
+
+    if (exact)
+        *exact = 0;
+    if (!state)
+        return INFINITY;
+    t = &state->t;
+
+    cmp_f = _ssim_load(cmp, t->src_w, t->src_h, t->stride, t->scale, &t->low_pass, &cw, &ch);
+    if (!cmp_f)
+        return INFINITY;
+    if (t->cmp_f[0]) {
+        _ssim_invalidate(state, cmp_f);
+        free(t->cmp_f[0]);
+    }
+    t->cmp_f[0] = cmp_f;
+
+    bands = state->tiles_y;
+    for (bits=0; (1<<bits) < bands; ++bits);
+
+    for (index=0; index < (1<<bits); ++index) {
+        /* Reverse the bits of the index to get the band to score */
+        for (band=0, rows=0; rows<bits; ++rows)
+            band |= ((index >> rows) & 1) << (bits - 1 - rows);
+        if (band >= bands)
+            continue;
+
+        th = _min(MAP_TILE_H, t->dst_h - band*MAP_TILE_H);
+        band_sum = 0.0;
+        for (tx=0; tx<state->tiles_x; ++tx) {
+            if (!state->tile_valid[band*state->tiles_x + tx]) {
+                tw = _min(STATE_TILE_W, t->dst_w - tx*STATE_TILE_W);
+                state->tile_sum[band*state->tiles_x + tx] = 0.0;
+                _ssim_tile(t, tx*STATE_TILE_W, band*MAP_TILE_H, tw, th, &state->tile_sum[band*state->tiles_x + tx]);
+                state->tile_valid[band*state->tiles_x + tx] = 1;
+            }
+            band_sum += state->tile_sum[band*state->tiles_x + tx];
+        }
+        total += band_sum;
+        pixels += (long)th * t->dst_w;
+        estimate = total / (double)pixels;
+
+        /* Welford's running variance of the band means */
+        band_mean = band_sum / ((double)th * t->dst_w);
+        ++scored;
+        delta = band_mean - mean;
+        mean += delta / scored;
+        m2 += delta * (band_mean - mean);
+
+        if (z > 0.0f && scored >= EARLY_MIN_BANDS && scored < bands) {
+            se = sqrt(m2 / (scored - 1) / scored * (1.0 - (double)scored / bands));
+            if (fabs(estimate - target) > z * se)
+                break;
+        }
+    }
+
+    if (exact)
+        *exact = scored == bands;
+    return (float)estimate;
+}
+
+/* iqa_ssim_early */
+float iqa_ssim_early(const unsigned char *ref, const unsigned char *cmp, int w, int h, int stride,
+    int gaussian, const struct iqa_ssim_args *args, float target, float z, int *exact)
+{
+    struct iqa_ssim_state *state;
+    float result;
+
+    if (exact)
+        *exact = 0;
+    state = iqa_ssim_state_new(ref, w, h, stride, gaussian, args, 8);
+    if (!state)
+        return INFINITY;
+    result = iqa_ssim_incremental(state, cmp, target, z, exact);
+    iqa_ssim_state_free(state);
+    return result;
+}
+
+
 /* _iqa_ssim */
 float _iqa_ssim(float *ref, float *cmp, int w, int h, const struct _kernel *k, const struct _map_reduce *mr, const struct iqa_ssim_args *args)
 {
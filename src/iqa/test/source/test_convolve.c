@@ -32,8 +32,10 @@
  */
 
 #include "convolve.h"
+#include "iqa.h"
 #include "test_convolve.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include "math_utils.h"
 #include <string.h>
 
@@ -75,6 +77,7 @@ static int _test_convolve_3x3_kernel();
 static int _test_img_filter_1x1_kernel();
 static int _test_img_filter_2x2_kernel();
 static int _test_img_filter_3x3_kernel();
+static int _test_convolve_cpu_levels();
 
 /*----------------------------------------------------------------------------
  * TEST ENTRY POINT
@@ -91,6 +94,8 @@ int test_convolve()
     failure += _test_img_filter_1x1_kernel();
     failure += _test_img_filter_2x2_kernel();
     failure += _test_img_filter_3x3_kernel();
+    printf("\nCPU Levels:\n");
+    failure += _test_convolve_cpu_levels();
 
     return failure;
 }
@@ -399,3 +404,78 @@ int _test_img_filter_3x3_kernel()
 
     return failures;
 }
+
+/*----------------------------------------------------------------------------
+ * _test_convolve_cpu_levels
+ *---------------------------------------------------------------------------*/
+#define LVL_W 61
+#define LVL_H 37
+#define LVL_K 11
+
+static int _cpu_supports(int level)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    if (level == IQA_CPU_AVX512)
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+    if (level == IQA_CPU_AVX2)
+        return __builtin_cpu_supports("avx2");
+#endif
+    return level == IQA_CPU_BASELINE;
+}
+
+int _test_convolve_cpu_levels()
+{
+    static const char *names[] = { "baseline", "avx2", "avx512" };
+    int level, x, rw, rh, passed, failures=0;
+    struct _kernel k;
+    float kernel[LVL_K*LVL_K];
+    float img[LVL_W*LVL_H];
+    float expected[LVL_W*LVL_H];
+    float result[LVL_W*LVL_H];
+
+    /* Uneven values that round differently if any sum is reordered */
+    srand(7);
+    for (x=0; x < LVL_W*LVL_H; ++x)
+        img[x] = (float)(rand() % 256) + (float)rand() / RAND_MAX;
+    for (x=0; x < LVL_K*LVL_K; ++x)
+        kernel[x] = (float)rand() / RAND_MAX;
+
+    k.w = k.h = LVL_K;
+    k.kernel = kernel;
+    k.normalized = 0;
+
+    iqa_set_cpu_level(IQA_CPU_BASELINE);
+    _iqa_convolve(img, LVL_W, LVL_H, &k, expected, 0, 0);
+
+    for (level=IQA_CPU_BASELINE; level <= IQA_CPU_AVX512; ++level) {
+        printf("\t%s:\n", names[level]);
+        if (!_cpu_supports(level)) {
+            printf("\t  not supported\t\tSKIPPED\n");
+            continue;
+        }
+        iqa_set_cpu_level(level);
+
+        printf("\t  w/ result: ");
+        memset(result,0,sizeof(result));
+        _iqa_convolve(img, LVL_W, LVL_H, &k, result, &rw, &rh);
+        passed = 0;
+        if (rw == LVL_W-LVL_K+1 && rh == LVL_H-LVL_K+1 &&
+            memcmp(result, expected, rw*rh*sizeof(float)) == 0)
+            passed = 1;
+        printf("[%i,%i]\t%s\n", rw, rh, passed?"PASS":"FAILED");
+        failures += passed?0:1;
+
+        printf("\t  in-place:  ");
+        memcpy(result, img, sizeof(img));
+        _iqa_convolve(result, LVL_W, LVL_H, &k, 0, &rw, &rh);
+        passed = 0;
+        if (memcmp(result, expected, rw*rh*sizeof(float)) == 0)
+            passed = 1;
+        printf("[%i,%i]\t%s\n", rw, rh, passed?"PASS":"FAILED");
+        failures += passed?0:1;
+    }
+
+    iqa_set_cpu_level(IQA_CPU_BASELINE);
+    return failures;
+}
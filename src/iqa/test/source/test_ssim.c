@@ -151,6 +151,8 @@ static const struct answer ans_key_courtright[] = {
 static int _test_ssim_22x15(int gaussian, const struct answer *answers, const struct iqa_ssim_args *args);
 static int _test_ssim_einstein_bmp(int gaussian, const struct answer *answers, const struct iqa_ssim_args *args);
 static int _test_ssim_courtright_bmp(int gaussian, const struct answer *answers, const struct iqa_ssim_args *args);
+static int _test_ssim_early_einstein_bmp(int gaussian, const struct answer *answers, const struct iqa_ssim_args *args);
+static int _test_ssim_incremental_einstein_bmp(int gaussian, const struct answer *answers, const struct iqa_ssim_args *args);
 
 
 /*----------------------------------------------------------------------------
@@ -168,6 +170,10 @@ int test_ssim()
     failure += _test_ssim_einstein_bmp(0, ans_key_einstein_linear, 0);
     failure += _test_ssim_einstein_bmp(1, ans_key_einstein_args, &ssim_args);
     failure += _test_ssim_courtright_bmp(1, ans_key_courtright, 0);
+    failure += _test_ssim_early_einstein_bmp(1, ans_key_einstein_gauss, 0);
+    failure += _test_ssim_early_einstein_bmp(0, ans_key_einstein_linear, 0);
+    failure += _test_ssim_incremental_einstein_bmp(1, ans_key_einstein_gauss, 0);
+    failure += _test_ssim_incremental_einstein_bmp(1, ans_key_einstein_args, &ssim_args);
 
     return failure;
 }
@@ -440,3 +446,137 @@ int _test_ssim_courtright_bmp(int gaussian, const struct answer *answers, const
     return failures;
 }
 
+/*----------------------------------------------------------------------------
+ * _test_ssim_early_einstein_bmp
+ *
+ * Without early exit the result must match the answer key. With a target
+ * 0.1 above or below the answer the estimate must fall on the right side.
+ *---------------------------------------------------------------------------*/
+int _test_ssim_early_einstein_bmp(int gaussian, const struct answer *answers, const struct iqa_ssim_args *args)
+{
+    static const char *names[] = {
+        BMP_ORIGINAL, BMP_BLUR, BMP_CONTRAST, BMP_FLIPVERT, BMP_IMPULSE, BMP_JPG, BMP_MEANSHIFT
+    };
+    static const char *labels[] = {
+        "Identical", "Blur", "Contrast", "Flip Vertical", "Impulse", "Jpeg", "Meanshift"
+    };
+    struct bmp orig, cmp;
+    float result, below, above;
+    int i, exact, passed, failures=0;
+
+    printf("\tEinstein early exit (%s%s):\n", gaussian?"Gaussian":"Linear",args?" - Custom Args":"");
+
+    if (load_bmp(BMP_ORIGINAL, &orig)) {
+        printf("FAILED to load \'%s\'\n", BMP_ORIGINAL);
+        return 1;
+    }
+
+    for (i=0; i<7; ++i) {
+        if (load_bmp(names[i], &cmp)) {
+            printf("FAILED to load \'%s\'\n", names[i]);
+            failures++;
+            continue;
+        }
+
+        result = iqa_ssim_early(orig.img, cmp.img, orig.w, orig.h, orig.stride, gaussian, args,
+            answers[i].value, 0.0f, &exact);
+        below = iqa_ssim_early(orig.img, cmp.img, orig.w, orig.h, orig.stride, gaussian, args,
+            answers[i].value - 0.1f, 3.0f, 0);
+        above = iqa_ssim_early(orig.img, cmp.img, orig.w, orig.h, orig.stride, gaussian, args,
+            answers[i].value + 0.1f, 3.0f, 0);
+
+        passed = exact && _cmp_float(result, answers[i].value, answers[i].precision) == 0 &&
+            below > answers[i].value - 0.1f && above < answers[i].value + 0.1f;
+        printf("\t  %s: \t\t%.5f\t%.5f\t%.5f\t%s\n", labels[i], result, below, above, passed?"PASS":"FAILED");
+        failures += passed?0:1;
+
+        free_bmp(&cmp);
+    }
+
+    free_bmp(&orig);
+    return failures;
+}
+
+/*----------------------------------------------------------------------------
+ * _test_ssim_incremental_einstein_bmp
+ *
+ * Scores every distorted image in turn with one state, then the Jpeg image
+ * again (nothing changed) and with a small patch changed (a few tiles
+ * changed). Every result must match a full calculation.
+ *---------------------------------------------------------------------------*/
+int _test_ssim_incremental_einstein_bmp(int gaussian, const struct answer *answers, const struct iqa_ssim_args *args)
+{
+    static const char *names[] = {
+        BMP_ORIGINAL, BMP_BLUR, BMP_CONTRAST, BMP_FLIPVERT, BMP_IMPULSE, BMP_JPG, BMP_MEANSHIFT
+    };
+    static const char *labels[] = {
+        "Identical", "Blur", "Contrast", "Flip Vertical", "Impulse", "Jpeg", "Meanshift"
+    };
+    struct iqa_ssim_state *state;
+    struct bmp orig, cmp;
+    float result, expected;
+    int i, x, y, exact, passed, failures=0;
+    unsigned long long start, end;
+
+    printf("\tEinstein incremental (%s%s):\n", gaussian?"Gaussian":"Linear",args?" - Custom Args":"");
+
+    if (load_bmp(BMP_ORIGINAL, &orig)) {
+        printf("FAILED to load \'%s\'\n", BMP_ORIGINAL);
+        return 1;
+    }
+
+    state = iqa_ssim_state_new(orig.img, orig.w, orig.h, orig.stride, gaussian, args, 8);
+    if (!state) {
+        printf("\t  FAILED to create state\n");
+        free_bmp(&orig);
+        return 1;
+    }
+
+    for (i=0; i<7; ++i) {
+        if (load_bmp(names[i], &cmp)) {
+            printf("FAILED to load \'%s\'\n", names[i]);
+            failures++;
+            continue;
+        }
+        result = iqa_ssim_incremental(state, cmp.img, 0.0f, 0.0f, &exact);
+        passed = exact && _cmp_float(result, answers[i].value, answers[i].precision) == 0;
+        printf("\t  %s: \t\t%.5f\t%s\n", labels[i], result, passed?"PASS":"FAILED");
+        failures += passed?0:1;
+        free_bmp(&cmp);
+    }
+
+    if (load_bmp(BMP_JPG, &cmp)) {
+        printf("FAILED to load \'%s\'\n", BMP_JPG);
+        iqa_ssim_state_free(state);
+        free_bmp(&orig);
+        return failures + 1;
+    }
+
+    /* Twice in a row, so the second call reuses every tile */
+    iqa_ssim_incremental(state, cmp.img, 0.0f, 0.0f, 0);
+    start = hpt_get_time();
+    result = iqa_ssim_incremental(state, cmp.img, 0.0f, 0.0f, &exact);
+    end = hpt_get_time();
+    passed = exact && _cmp_float(result, answers[5].value, answers[5].precision) == 0;
+    printf("\t  Unchanged (%.3lf ms): \t%.5f\t%s\n",
+        hpt_elapsed_time(start,end,hpt_get_frequency()) * 1000.0, result, passed?"PASS":"FAILED");
+    failures += passed?0:1;
+
+    /* Change a small patch */
+    for (y=100; y<120; ++y)
+        for (x=60; x<90; ++x)
+            cmp.img[y*cmp.stride + x] = 255 - cmp.img[y*cmp.stride + x];
+    expected = iqa_ssim(orig.img, cmp.img, orig.w, orig.h, orig.stride, gaussian, args);
+    start = hpt_get_time();
+    result = iqa_ssim_incremental(state, cmp.img, 0.0f, 0.0f, &exact);
+    end = hpt_get_time();
+    passed = exact && _cmp_float(result, expected, 5) == 0;
+    printf("\t  Patched (%.3lf ms): \t%.5f\t%s\n",
+        hpt_elapsed_time(start,end,hpt_get_frequency()) * 1000.0, result, passed?"PASS":"FAILED");
+    failures += passed?0:1;
+
+    free_bmp(&cmp);
+    iqa_ssim_state_free(state);
+    free_bmp(&orig);
+    return failures;
+}
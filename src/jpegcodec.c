@@ -0,0 +1,57 @@
+#include "jpegcodec.h"
+#include "util.h"
+
+const float jpegPresets[5][4] = {
+    { 0.999f, 0.9999f, 0.99995f, 0.99999f },    // SSIM
+    { 0.85f, 0.94f, 0.96f, 0.98f },             // MS_SSIM
+    { 100.75f, 102.25f, 103.8f, 105.5f },       // SMALLFRY
+    { 1.5f, 1.0f, 0.8f, 0.6f },                 // MPE
+    // Blocks are scored at full size, where plain SSIM scales large
+    // images down first, so the values are lower
+    { 0.98f, 0.99f, 0.995f, 0.998f }            // SSIM_DCT
+};
+
+static int encodeJpegCodec(void *opaque, int quality, int final, unsigned long limit, unsigned char **data, unsigned long *size) {
+    struct jpegCodec *jpeg = opaque;
+
+    // Drafts are baseline and, unless accurate, unoptimized (for speed)
+    int progressive = final ? jpeg->progressive : 0;
+    int optimize = jpeg->accurate ? 1 : final;
+
+    // Encodes over the limit are abandoned part way
+    *size = encodeJpegLimit(data, (unsigned char *) jpeg->original, jpeg->width, jpeg->height, JCS_RGB, quality, progressive, optimize, jpeg->subsample, limit);
+
+    if (!*size)
+        return -1;
+
+    if (limit && *size > limit) {
+        *size = 0;
+        return 0;
+    }
+
+    return 1;
+}
+
+static long decodeJpegLuma(void *opaque, const unsigned char *data, unsigned long size, unsigned char **gray) {
+    int width, height;
+
+    (void) opaque;
+
+    return decodeJpeg((unsigned char *) data, size, gray, &width, &height, JCS_GRAYSCALE);
+}
+
+static float estimateJpegDct(void *opaque, const struct dctReference *dct, const unsigned char *data, unsigned long size) {
+    (void) opaque;
+
+    return dctSsimJpeg(dct, (unsigned char *) data, size);
+}
+
+void jpegCodecInit(struct searchCodec *codec, struct jpegCodec *jpeg) {
+    codec->opaque = jpeg;
+    codec->blockSize = 8;
+    // Only the last search step is encoded with the final settings
+    codec->drafts = jpeg->progressive || !jpeg->accurate;
+    codec->encode = encodeJpegCodec;
+    codec->decodeLuma = decodeJpegLuma;
+    codec->estimateDct = estimateJpegDct;
+}
@@ -0,0 +1,31 @@
+/*
+    JPEG output for the quality search
+*/
+#ifndef JPEGCODEC_H
+#define JPEGCODEC_H
+
+#include "search.h"
+#include "util.h"
+
+// Targets of the quality presets, LOW to VERYHIGH, for each method
+extern const float jpegPresets[5][4];
+
+// Settings of the JPEG encodes of an image
+struct jpegCodec {
+    // RGB pixels to encode
+    const unsigned char *original;
+    int width;
+    int height;
+    int progressive;
+    // Whether drafts are optimized too, favoring accuracy over speed
+    int accurate;
+    enum SUBSAMPLING_METHOD subsample;
+};
+
+/*
+    Set up a search codec encoding with jpeg, which must outlive it.
+    Drafts are baseline and, unless accurate, unoptimized.
+*/
+void jpegCodecInit(struct searchCodec *codec, struct jpegCodec *jpeg);
+
+#endif
@@ -0,0 +1,116 @@
+/*
+    Pixel kernels in plain C, written so the compiler can vectorize them.
+    This file is built once per instruction set level: as is for the
+    baseline, and through kernels_avx2.c and kernels_avx512.c with wider
+    vectors enabled. Every level computes exactly the same results.
+*/
+#include "kernels.h"
+
+#include <stdlib.h>
+
+#ifndef KERNEL_SUFFIX
+#define KERNEL_SUFFIX Baseline
+#endif
+
+#define KERNEL_PASTE(name, suffix) name##suffix
+#define KERNEL_NAME(name, suffix) KERNEL_PASTE(name, suffix)
+#define KERNEL(name) KERNEL_NAME(name, KERNEL_SUFFIX)
+
+// Pixels per chunk, few enough that 32-bit sums of squared errors
+// cannot wrap
+#define KERNEL_CHUNK 4096
+
+// Edges per chunk of edgeRow(), whose steps are kept on the stack
+#define KERNEL_EDGE_CHUNK 256
+
+static uint64_t KERNEL(absoluteError)(const unsigned char *original, const unsigned char *compressed, int length) {
+    uint64_t sum = 0;
+
+    for (int start = 0; start < length; start += KERNEL_CHUNK) {
+        const int end = length - start < KERNEL_CHUNK ? length : start + KERNEL_CHUNK;
+        int chunk = 0;
+
+        for (int i = start; i < end; i++)
+            chunk += abs(original[i] - compressed[i]);
+
+        sum += chunk;
+    }
+
+    return sum;
+}
+
+static void KERNEL(errorStats)(const unsigned char *original, const unsigned char *compressed, int width, unsigned char *max, uint64_t *sse) {
+    unsigned char largest = *max;
+    uint64_t sum = 0;
+
+    for (int start = 0; start < width; start += KERNEL_CHUNK) {
+        const int end = width - start < KERNEL_CHUNK ? width : start + KERNEL_CHUNK;
+        int chunk = 0;
+
+        for (int i = start; i < end; i++) {
+            const int difference = original[i] - compressed[i];
+
+            chunk += difference * difference;
+            largest = original[i] > largest ? original[i] : largest;
+        }
+
+        sum += chunk;
+    }
+
+    *max = largest;
+    *sse += sum;
+}
+
+static double KERNEL(edgeRow)(const unsigned char *const original[4], const unsigned char *const compressed[4], int width) {
+    short steps[KERNEL_EDGE_CHUNK];
+    short arounds[KERNEL_EDGE_CHUNK];
+    double sum = 0.0;
+
+    for (int start = 0; start < width; start += KERNEL_EDGE_CHUNK) {
+        const int count = width - start < KERNEL_EDGE_CHUNK ? width - start : KERNEL_EDGE_CHUNK;
+        const unsigned char *o0 = original[0] + start, *c0 = compressed[0] + start;
+        const unsigned char *o1 = original[1] + start, *c1 = compressed[1] + start;
+        const unsigned char *o2 = original[2] + start, *c2 = compressed[2] + start;
+        const unsigned char *o3 = original[3] + start, *c3 = compressed[3] + start;
+        int ones = 0, over = 0;
+
+        // Edges with a ratio over 5 count fully and are decided here
+        for (int i = 0; i < count; i++) {
+            const int a = abs(o0[i] - c0[i]);
+            const int b = abs(o1[i] - c1[i]);
+            const int c = abs(o2[i] - c2[i]);
+            const int d = abs(o3[i] - c3[i]);
+            const int step = abs(b - c);
+            const int around = abs(a - b) + abs(c - d);
+
+            steps[i] = step;
+            arounds[i] = around;
+            ones += 2 * step > 5 * around;
+            over += step > around;
+        }
+
+        sum += ones;
+
+        // The few with a ratio between 2 and 5 are scored one by one
+        if (over > ones) {
+            for (int i = 0; i < count; i++) {
+                if (steps[i] > arounds[i] && 2 * steps[i] <= 5 * arounds[i])
+                    sum += edgeRatio(steps[i], arounds[i]);
+            }
+        }
+    }
+
+    return sum;
+}
+
+static void KERNEL(weightedRowSum)(const unsigned char *row, int length, uint32_t weight, uint32_t *sum) {
+    for (int i = 0; i < length; i++)
+        sum[i] += row[i] * weight;
+}
+
+const struct pixelKernels KERNEL(pixelKernels) = {
+    KERNEL(absoluteError),
+    KERNEL(errorStats),
+    KERNEL(edgeRow),
+    KERNEL(weightedRowSum)
+};
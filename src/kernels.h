@@ -0,0 +1,48 @@
+/*
+    Pixel kernels built for several instruction set levels, of which
+    cpu.c selects one at startup
+*/
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stdint.h>
+
+struct pixelKernels {
+    /*
+        Sum of the absolute differences of length bytes.
+    */
+    uint64_t (*absoluteError)(const unsigned char *original, const unsigned char *compressed, int length);
+
+    /*
+        Raise max to the largest value in a row of the original and add
+        the squared error of the row to sse.
+    */
+    void (*errorStats)(const unsigned char *original, const unsigned char *compressed, int width, unsigned char *max, uint64_t *sse);
+
+    /*
+        SmallFry blockiness summed along a horizontal block edge, which
+        lies between rows 1 and 2 of the four given rows of each image.
+    */
+    double (*edgeRow)(const unsigned char *const original[4], const unsigned char *const compressed[4], int width);
+
+    /*
+        Add length bytes of a row, each times weight, to sum.
+    */
+    void (*weightedRowSum)(const unsigned char *row, int length, uint32_t weight, uint32_t *sum);
+};
+
+/*
+    Blockiness of a block edge whose step to surrounding activity ratio,
+    2 * step / (around + 0.0001), is between 2 and 5.
+*/
+static inline double edgeRatio(int step, int around) {
+    return (step / ((around + 0.0001) / 2.0) - 2.0) / (5.0 - 2.0);
+}
+
+/*
+    Kernels for the level chosen by cpuInit(), which is called on first
+    use if it has not been already.
+*/
+const struct pixelKernels *pixelKernels(void);
+
+#endif
@@ -0,0 +1,6 @@
+/*
+    AVX2 build of the pixel kernels
+*/
+#define KERNEL_SUFFIX Avx2
+
+#include "kernels.c"
@@ -0,0 +1,6 @@
+/*
+    AVX-512 build of the pixel kernels
+*/
+#define KERNEL_SUFFIX Avx512
+
+#include "kernels.c"
@@ -0,0 +1,784 @@
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <pthread.h>
+#endif
+
+#include "../../libwebp/src/webp/decode.h"
+#include "../../libwebp/src/webp/encode.h"
+
+#include "cache.h"
+#include "cpu.h"
+#include "edit.h"
+#include "jpegcodec.h"
+#include "libarchive2webp.h"
+#include "search.h"
+
+/*
+    Memory writer that refuses to grow the output beyond limit bytes,
+    which makes WebPEncode() fail. libwebp only sets an error code for
+    some of the writes, so the failure is flagged here instead. The
+    writer comes first, so WebPMemoryWrite() can be handed the struct.
+*/
+struct limitWriter {
+    WebPMemoryWriter writer;
+    unsigned long limit;
+    int over;
+};
+
+static int writeWithinLimit(const uint8_t *data, size_t size, const WebPPicture *picture) {
+    struct limitWriter *output = (struct limitWriter *) picture->custom_ptr;
+
+    if (output->writer.size + size > output->limit) {
+        output->over = 1;
+        return 0;
+    }
+
+    return WebPMemoryWrite(data, size, picture);
+}
+
+/*
+    Defish map kept from one conversion to the next, as a batch of
+    images usually shares one geometry. A conversion takes it out of
+    the slot while it uses it, and one running alongside builds a map of
+    its own instead, which is freed after use.
+*/
+static struct defishMap sharedMap;
+static int sharedMapTaken;
+
+#ifdef _WIN32
+    static SRWLOCK sharedMapLock = SRWLOCK_INIT;
+    #define lockSharedMap() AcquireSRWLockExclusive(&sharedMapLock)
+    #define unlockSharedMap() ReleaseSRWLockExclusive(&sharedMapLock)
+#else
+    static pthread_mutex_t sharedMapLock = PTHREAD_MUTEX_INITIALIZER;
+    #define lockSharedMap() pthread_mutex_lock(&sharedMapLock)
+    #define unlockSharedMap() pthread_mutex_unlock(&sharedMapLock)
+#endif
+
+// Take the shared map, or an empty one if it is in use. Returns whether
+// the shared map was taken, to be handed to putDefishMap().
+static int takeDefishMap(struct defishMap *map) {
+    int taken = 0;
+
+    lockSharedMap();
+    if (!sharedMapTaken) {
+        *map = sharedMap;
+        sharedMapTaken = taken = 1;
+    }
+    unlockSharedMap();
+
+    if (!taken)
+        memset(map, 0, sizeof(*map));
+
+    return taken;
+}
+
+static void putDefishMap(struct defishMap *map, int taken) {
+    if (!taken) {
+        defishMapFree(map);
+        return;
+    }
+
+    lockSharedMap();
+    sharedMap = *map;
+    sharedMapTaken = 0;
+    unlockSharedMap();
+}
+
+// Defish a whole RGB image through the shared map
+static int defishImage(const struct archive2webpOptions *options, const unsigned char *input, unsigned char *output, int width, int height) {
+    struct defishMap map;
+    int taken = takeDefishMap(&map);
+    int ok = defishMapPrepare(&map, width, height, options->defishStrength, options->defishZoom);
+
+    if (ok)
+        defishMapApply(&map, input, output, 3);
+
+    putDefishMap(&map, taken);
+
+    return ok;
+}
+
+// Where the strips of a defished image go
+struct stripImport {
+    WebPPicture *picture;
+    // Picture each strip is imported into before its planes are copied
+    // into place
+    WebPPicture strip;
+    // Cache key to extend with the pixels, or NULL
+    uint64_t *cacheKey;
+};
+
+static int importStrip(void *opaque, const unsigned char *rgb, int top, int rows) {
+    struct stripImport *import = opaque;
+    WebPPicture *picture = import->picture;
+    WebPPicture *strip = &import->strip;
+    const int width = picture->width;
+
+    // Strips are a multiple of 8 bytes, so this hashes the same as the
+    // whole image in one go
+    if (import->cacheKey != NULL)
+        *import->cacheKey = hashBuffer(*import->cacheKey, rgb, (size_t) width * 3 * rows);
+
+    // Strips hold whole rows of chroma, which libwebp converts the same
+    // as in an import of the whole image
+    strip->width = width;
+    strip->height = rows;
+    if (!WebPPictureImportRGB(strip, rgb, width * 3))
+        return 0;
+
+    for (int y = 0; y < rows; y++)
+        memcpy(picture->y + (size_t) (top + y) * picture->y_stride, strip->y + (size_t) y * strip->y_stride, width);
+
+    for (int y = 0; y < (rows + 1) / 2; y++) {
+        memcpy(picture->u + (size_t) (top / 2 + y) * picture->uv_stride, strip->u + (size_t) y * strip->uv_stride, (width + 1) / 2);
+        memcpy(picture->v + (size_t) (top / 2 + y) * picture->uv_stride, strip->v + (size_t) y * strip->uv_stride, (width + 1) / 2);
+    }
+
+    return 1;
+}
+
+// Targets of the quality presets, LOW to VERYHIGH, for each method
+static const float presets[4][4] = {
+    { 0.995f, 0.999f, 0.9995f, 0.9999f },   // SSIM
+    { 0.85f, 0.94f, 0.96f, 0.98f },         // MS_SSIM
+    { 100.75f, 102.25f, 103.8f, 105.5f },   // SMALLFRY
+    { 1.5f, 1.0f, 0.8f, 0.6f }              // MPE
+};
+
+float archive2webpPresetTarget(enum METHOD method, enum QUALITY_PRESET preset) {
+    if (method < SSIM || method > MPE || preset < LOW || preset > VERYHIGH)
+        return 0;
+
+    return presetTarget(presets, method, preset);
+}
+
+// The WebP side of the search
+struct webpCodec {
+    WebPConfig config;
+    WebPPicture *picture;
+};
+
+static int encodeWebp(void *opaque, int quality, int final, unsigned long limit, unsigned char **data, unsigned long *size) {
+    struct webpCodec *codec = opaque;
+    struct limitWriter output;
+
+    // Every encode uses the final settings
+    (void) final;
+
+    WebPMemoryWriterInit(&output.writer);
+    output.limit = limit;
+    output.over = 0;
+
+    codec->picture->writer = limit ? writeWithinLimit : WebPMemoryWrite;
+    codec->picture->custom_ptr = (void *) &output;
+    codec->config.quality = (float) quality;
+
+    if (!WebPEncode(&codec->config, codec->picture)) {
+        WebPMemoryWriterClear(&output.writer);
+        return output.over ? 0 : -1;
+    }
+
+    *data = output.writer.mem;
+    *size = output.writer.size;
+
+    return 1;
+}
+
+static long decodeWebpLuma(void *opaque, const unsigned char *data, unsigned long size, unsigned char **gray) {
+    int width, height;
+    uint8_t *decoded = WebPDecodeRGB(data, size, &width, &height);
+    long graySize;
+
+    (void) opaque;
+
+    if (decoded == NULL)
+        return 0;
+
+    graySize = grayscale(decoded, gray, width, height);
+    WebPFree(decoded);
+
+    return graySize;
+}
+
+void archive2webpInit(void) {
+    cpuInit();
+}
+
+void archive2webpOptionsInit(struct archive2webpOptions *options) {
+    memset(options, 0, sizeof(*options));
+    options->method = SSIM;
+    options->preset = MEDIUM;
+    options->qMin = 1;
+    options->qMax = 99;
+    options->attempts = 8;
+    options->defishZoom = 1.0;
+    options->inputFiletype = FILETYPE_AUTO;
+    options->name = "archive2webp";
+    options->jpegProgressive = 1;
+    options->jpegSubsample = SUBSAMPLE_DEFAULT;
+}
+
+void archive2webpResultFree(struct archive2webpResult *result) {
+    free(result->webp.data);
+    free(result->jpeg.data);
+    memset(&result->webp, 0, sizeof(result->webp));
+    memset(&result->jpeg, 0, sizeof(result->jpeg));
+}
+
+// Pass a progress message to the caller's log, if any
+static void report(const struct archive2webpOptions *options, const char *format, ...) {
+    char message[512];
+    va_list args;
+
+    if (options->log == NULL)
+        return;
+
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+
+    options->log(options->logOpaque, message);
+}
+
+// Log of one of the searches running at once, which marks its messages
+struct labelledLog {
+    const struct archive2webpOptions *options;
+    const char *label;
+};
+
+static void logLabelled(void *opaque, const char *message) {
+    const struct labelledLog *log = opaque;
+
+    // One message at a time, so the callback need not expect both
+    #pragma omp critical (archive2webpLog)
+    report(log->options, "%s: %s", log->label, message);
+}
+
+// Everything a conversion holds, so any failure can release it all
+struct conversion {
+    WebPPicture picture;
+    // Decoded RGB image, kept for the JPEG encodes
+    unsigned char *original;
+    unsigned char *originalGray;
+    struct searchReference ref;
+    struct cache *cache;
+    struct searchResult webp;
+    struct searchResult jpeg;
+};
+
+static void conversionFree(struct conversion *c) {
+    searchReferenceFree(&c->ref);
+    WebPPictureFree(&c->picture);
+    free(c->original);
+    free(c->originalGray);
+    cacheClose(c->cache);
+    free(c->webp.data);
+    free(c->jpeg.data);
+    memset(c, 0, sizeof(*c));
+}
+
+// Release a failed conversion and record why it failed. Returns 0.
+static int fail(struct conversion *c, struct archive2webpResult *result, const char *message) {
+    conversionFree(c);
+    snprintf(result->error, sizeof(result->error), "%s", message);
+    return 0;
+}
+
+// Hand the winning encode of a search over to the caller
+static void takeOutput(struct archive2webpOutput *output, struct searchResult *search) {
+    output->data = search->data;
+    output->size = search->size;
+    output->quality = search->quality;
+    output->metric = search->metric;
+    output->encodes = search->encodes;
+    output->stopReason = search->stopReason;
+
+    search->data = NULL;
+}
+
+// Cache keys of the image and of the prior for similar images, from the
+// settings of a search. The pixels are hashed into the image key later.
+static void cacheKeys(const char *name, const char *extra, const struct searchSettings *settings, int width, int height, uint64_t *cacheKey, uint64_t *priorKey) {
+    char key[512];
+
+    // Key on the pixels to encode plus every setting that affects the
+    // search. The deadline does not, as searches it stops are not stored.
+    snprintf(key, sizeof(key), "%s %s %f %lu %i %i %i %lu %f %f %i%s %ix%i",
+        name, methodName[settings->method], settings->target, settings->targetSize,
+        settings->qMin, settings->qMax, settings->attempts, settings->minSaving, settings->minSavingPercent,
+        settings->samplePercent, settings->useSurrogate, extra, width, height);
+
+    *cacheKey = hashBuffer(0, key, strlen(key));
+
+    // Images of the same size searched the same way share a prior
+    snprintf(key, sizeof(key), "prior %s %s %f %lu %lu %f %f %i %ix%i",
+        name, methodName[settings->method], settings->target, settings->targetSize, settings->minSaving,
+        settings->minSavingPercent, settings->samplePercent, settings->useSurrogate, width, height);
+
+    *priorKey = hashBuffer(0, key, strlen(key));
+}
+
+// An image ready to be converted
+struct source {
+    // Decoded RGB pixels, which the conversion takes over
+    unsigned char *rgb;
+    int width;
+    int height;
+    // Highest JPEG quality worth searching
+    int jpegQMax;
+    // The JPEG the pixels were decoded from, or NULL when they are not
+    // comparable to one, e.g. after resizing or defishing
+    const unsigned char *jpeg;
+    size_t jpegSize;
+    // When the deadline started counting
+    double startTime;
+};
+
+// Check the options and decode the input. Returns 0 with a message in
+// result->error on failure.
+static int decodeInput(const struct archive2webpOptions *options, const unsigned char *input, size_t inputSize, struct source *source, struct archive2webpResult *result) {
+    enum filetype inputFiletype = options->inputFiletype;
+    struct jpegHeader header;
+
+    memset(source, 0, sizeof(*source));
+    memset(result, 0, sizeof(*result));
+
+    // The deadline covers everything done for this image
+    source->startTime = getTimeMs();
+    source->jpegQMax = options->qMax;
+
+    if (options->method < SSIM || options->method > MPE) {
+        snprintf(result->error, sizeof(result->error), "invalid method");
+        return 0;
+    }
+
+    if (options->qMin < QUALITY_MIN || options->qMax > QUALITY_MAX) {
+        snprintf(result->error, sizeof(result->error), "image quality must be from %i to %i", QUALITY_MIN, QUALITY_MAX);
+        return 0;
+    }
+
+    if (options->qMin > options->qMax) {
+        snprintf(result->error, sizeof(result->error), "maximum image quality must not be smaller than minimum image quality");
+        return 0;
+    }
+
+    /* Detect input file type. */
+    if (inputFiletype == FILETYPE_AUTO)
+        inputFiletype = detectFiletypeFromBuffer((unsigned char *) input, inputSize);
+
+    if (inputFiletype == FILETYPE_JPEG) {
+        if (!readJpegHeader(input, inputSize, &header, NULL)) {
+            snprintf(result->error, sizeof(result->error), "invalid input file");
+            return 0;
+        }
+
+        /*
+         * Detail lost when the input was saved cannot be recovered, so
+         * there is no point in searching above the quality it used. The
+         * estimate is on the IJG scale, so it only caps the JPEG search:
+         * WebP qualities do not line up with it.
+         */
+        int inputQuality = estimateJpegQuality(&header);
+        if (inputQuality) {
+            report(options, "Estimated input quality is %i\n", inputQuality);
+            source->jpegQMax = MAX(options->qMin, MIN(options->qMax, inputQuality));
+        }
+
+        // The defished image no longer matches the input, which can then
+        // neither bound nor stand in for the JPEG output
+        if (!options->defishStrength) {
+            source->jpeg = input;
+            source->jpegSize = inputSize;
+        }
+    }
+
+    /* Read original image and decode. */
+    if (!decodeFileFromBuffer((unsigned char *) input, inputSize, &source->rgb, inputFiletype, &source->width, &source->height, JCS_RGB)) {
+        snprintf(result->error, sizeof(result->error), "invalid input file");
+        return 0;
+    }
+
+    return 1;
+}
+
+// Convert a decoded image, which is freed in the process
+static int convertImage(const struct archive2webpOptions *options, struct source *source, struct archive2webpResult *result) {
+    const enum METHOD method = options->method;
+    const unsigned long targetSize = options->targetSize;
+    const int width = source->width;
+    const int height = source->height;
+    float target = options->target;
+    struct conversion c;
+    struct webpCodec webp;
+
+    memset(&c, 0, sizeof(c));
+    memset(result, 0, sizeof(*result));
+
+    c.original = source->rgb;
+    source->rgb = NULL;
+
+    // No target passed, use preset!
+    if (!target)
+        target = archive2webpPresetTarget(method, options->preset);
+
+    if (!WebPConfigPreset(&webp.config, WEBP_PRESET_PHOTO, 50))
+        return fail(&c, result, "could not initialize WebP configuration");
+
+    if (!WebPPictureInit(&c.picture))
+        return fail(&c, result, "could not initialize WebP picture");
+
+    webp.picture = &c.picture;
+
+    long originalGraySize = 0;
+
+    // WebP image dimensions
+    c.picture.width = width;
+    c.picture.height = height;
+    result->width = width;
+    result->height = height;
+
+    struct searchSettings webpSettings = {
+        method, target, options->qMin, options->qMax, options->attempts, targetSize,
+        options->minSaving, options->minSavingPercent, 0,
+        source->startTime, options->deadlineMs, options->samplePercent, options->useSurrogate,
+        NULL, 0, 0, options->log, options->logOpaque
+    };
+
+    // The JPEG is searched the same way, towards its own target. Unless
+    // searching on size, it gives up where it would not beat a JPEG input
+    // by more than a few bytes.
+    struct searchSettings jpegSettings = webpSettings;
+    jpegSettings.qMax = source->jpegQMax;
+    jpegSettings.target = options->jpegTarget ? options->jpegTarget : presetTarget(jpegPresets, method, options->preset);
+    if (source->jpeg != NULL && !targetSize)
+        jpegSettings.maxSize = source->jpegSize > 10 ? source->jpegSize - 10 : 1;
+
+    if (options->cachePath) {
+        c.cache = cacheOpen(options->cachePath);
+    }
+
+    if (c.cache != NULL) {
+        char name[128];
+        char extra[32];
+
+        webpSettings.cache = jpegSettings.cache = c.cache;
+        cacheKeys(options->name, "", &webpSettings, width, height, &webpSettings.cacheKey, &webpSettings.priorKey);
+
+        if (options->jpeg) {
+            snprintf(extra, sizeof(extra), " %i %i %i", options->jpegAccurate, !options->jpegProgressive, options->jpegSubsample);
+            snprintf(name, sizeof(name), "%s-jpeg", options->name);
+            cacheKeys(name, extra, &jpegSettings, width, height, &jpegSettings.cacheKey, &jpegSettings.priorKey);
+        }
+    }
+
+    if (options->defishStrength && !options->jpeg) {
+        // Defish, convert to Y and import into the picture a strip at a
+        // time, so the corrected image is never held whole
+        struct defishMap map;
+        int taken = takeDefishMap(&map);
+        struct stripImport import;
+
+        memset(&import, 0, sizeof(import));
+        import.picture = &c.picture;
+        import.cacheKey = c.cache != NULL ? &webpSettings.cacheKey : NULL;
+
+        report(options, "Defishing...\n");
+
+        if (!targetSize) {
+            c.originalGray = malloc((size_t) width * height);
+            originalGraySize = c.originalGray != NULL ? (long) width * height : 0;
+        }
+
+        int ok = WebPPictureInit(&import.strip) && (targetSize || c.originalGray != NULL) && WebPPictureAlloc(&c.picture) &&
+                 defishMapPrepare(&map, width, height, options->defishStrength, options->defishZoom) &&
+                 defishStream(&map, c.original, c.originalGray, importStrip, &import);
+
+        WebPPictureFree(&import.strip);
+        putDefishMap(&map, taken);
+        free(c.original);
+        c.original = NULL;
+
+        if (!ok)
+            return fail(&c, result, "not enough memory to defish image");
+    } else {
+        if (options->defishStrength) {
+            // The JPEG encodes need the whole corrected image
+            unsigned char *defished = malloc((size_t) width * height * 3);
+
+            report(options, "Defishing...\n");
+
+            if (defished == NULL || !defishImage(options, c.original, defished, width, height)) {
+                free(defished);
+                return fail(&c, result, "not enough memory to defish image");
+            }
+
+            free(c.original);
+            c.original = defished;
+        }
+
+        int rgb_stride = width * 3;
+        if (!WebPPictureImportRGB(&c.picture, c.original, rgb_stride))
+            return fail(&c, result, "could not import RGB image to WebP");
+
+        if (c.cache != NULL) {
+            webpSettings.cacheKey = hashBuffer(webpSettings.cacheKey, c.original, (size_t) width * height * 3);
+            jpegSettings.cacheKey = hashBuffer(jpegSettings.cacheKey, c.original, (size_t) width * height * 3);
+        }
+
+        // Convert RGB input into Y, unless only the size matters
+        if (!targetSize)
+            originalGraySize = grayscale(c.original, &c.originalGray, width, height);
+
+        if (!options->jpeg) {
+            free(c.original);
+            c.original = NULL;
+        }
+    }
+
+    if (!targetSize && !originalGraySize)
+        return fail(&c, result, "could not create the original grayscale image");
+
+    struct searchCodec webpCodec = { &webp, 16, 0, encodeWebp, decodeWebpLuma, NULL };
+    struct jpegCodec jpeg = { c.original, width, height, options->jpegProgressive, options->jpegAccurate, options->jpegSubsample };
+    struct searchCodec jpegCodec;
+    struct labelledLog webpLog = { options, "WebP" };
+    struct labelledLog jpegLog = { options, "JPEG" };
+    enum searchStatus webpStatus = SEARCH_ERROR;
+    enum searchStatus jpegStatus = SEARCH_DONE;
+
+    jpegCodecInit(&jpegCodec, &jpeg);
+
+    if (!searchReferenceInit(&c.ref, &webpSettings, c.originalGray, width, height))
+        return fail(&c, result, "not enough memory for the search reference");
+
+    // Both searches log at once, so say which line is whose
+    if (options->jpeg && options->log != NULL) {
+        webpSettings.log = jpegSettings.log = logLabelled;
+        webpSettings.logOpaque = &webpLog;
+        jpegSettings.logOpaque = &jpegLog;
+    }
+
+    // The searches share the decode and the reference, which they only
+    // read, and run side by side
+    #pragma omp parallel sections if (options->jpeg)
+    {
+        #pragma omp section
+        webpStatus = searchQuality(&webpSettings, &webpCodec, &c.ref, &c.webp);
+
+        #pragma omp section
+        {
+            if (options->jpeg)
+                jpegStatus = searchQuality(&jpegSettings, &jpegCodec, &c.ref, &c.jpeg);
+        }
+    }
+
+    if (webpStatus == SEARCH_ERROR)
+        return fail(&c, result, c.webp.error);
+
+    if (jpegStatus == SEARCH_ERROR)
+        return fail(&c, result, c.jpeg.error);
+
+    if (webpStatus == SEARCH_NO_FIT || jpegStatus == SEARCH_NO_FIT) {
+        char message[128];
+        snprintf(message, sizeof(message), "could not find a quality that fits in %lu bytes", targetSize);
+        return fail(&c, result, message);
+    }
+
+    // The search only stops early on the size of its drafts, so the final
+    // encode can still come out larger than a JPEG input
+    if (options->jpeg && source->jpeg != NULL && jpegStatus == SEARCH_DONE && c.jpeg.size >= source->jpegSize)
+        jpegStatus = SEARCH_TOO_LARGE;
+
+    if (jpegStatus == SEARCH_TOO_LARGE) {
+        // Recompressing cannot make the JPEG input smaller, so keep it
+        report(options, "JPEG: output would be larger than input, keeping the input\n");
+
+        free(c.jpeg.data);
+        c.jpeg.data = malloc(source->jpegSize);
+        if (c.jpeg.data == NULL)
+            return fail(&c, result, "not enough memory to copy the input");
+
+        memcpy(c.jpeg.data, source->jpeg, source->jpegSize);
+        c.jpeg.size = source->jpegSize;
+        c.jpeg.quality = 0;
+        c.jpeg.stopReason = "larger than input";
+    }
+
+    takeOutput(&result->webp, &c.webp);
+    if (options->jpeg)
+        takeOutput(&result->jpeg, &c.jpeg);
+
+    conversionFree(&c);
+
+    result->elapsedMs = getTimeMs() - source->startTime;
+
+    return 1;
+}
+
+int archive2webpConvert(const struct archive2webpOptions *options, const unsigned char *input, size_t inputSize, struct archive2webpResult *result) {
+    struct source source;
+
+    if (!decodeInput(options, input, inputSize, &source, result))
+        return 0;
+
+    return convertImage(options, &source, result);
+}
+
+// Copy an RGB image at a smaller or the same size, or NULL if out of memory
+static unsigned char *resizedCopy(const unsigned char *rgb, int width, int height, int newWidth, int newHeight) {
+    unsigned char *copy = malloc((size_t) newWidth * newHeight * 3);
+
+    if (copy == NULL)
+        return NULL;
+
+    if (newWidth == width && newHeight == height) {
+        memcpy(copy, rgb, (size_t) width * height * 3);
+    } else if (!downscale(rgb, width, height, 3, copy, newWidth, newHeight)) {
+        free(copy);
+        return NULL;
+    }
+
+    return copy;
+}
+
+// Height of an image shrunk to newWidth, keeping its aspect ratio
+static int scaledHeight(int width, int height, int newWidth) {
+    return MAX(1, (int) ((double) height * newWidth / width + 0.5));
+}
+
+int archive2webpConvertWidths(const struct archive2webpOptions *options, const unsigned char *input, size_t inputSize, const int *widths, int count, struct archive2webpResult *results) {
+    struct archive2webpOptions resized = *options;
+    struct source source;
+    char message[256] = "";
+    int *order;
+
+    memset(results, 0, sizeof(*results) * count);
+
+    for (int i = 0; i < count; i++) {
+        if (widths[i] < 1) {
+            snprintf(results[0].error, sizeof(results[0].error), "invalid width %i", widths[i]);
+            return 0;
+        }
+    }
+
+    if (!decodeInput(options, input, inputSize, &source, &results[0]))
+        return 0;
+
+    const int width = source.width;
+    const int height = source.height;
+
+    // Sizes are made widest first, each from the one before
+    order = malloc(count * sizeof(int));
+    if (order == NULL) {
+        free(source.rgb);
+        snprintf(results[0].error, sizeof(results[0].error), "not enough memory");
+        return 0;
+    }
+
+    for (int i = 0; i < count; i++) {
+        int j = i;
+
+        for (; j > 0 && widths[order[j - 1]] < widths[i]; j--)
+            order[j] = order[j - 1];
+
+        order[j] = i;
+    }
+
+    // Defish once at full size, so every size is corrected the same
+    if (options->defishStrength) {
+        unsigned char *defished = malloc((size_t) width * height * 3);
+
+        report(options, "Defishing...\n");
+
+        if (defished == NULL || !defishImage(options, source.rgb, defished, width, height)) {
+            free(defished);
+            free(order);
+            free(source.rgb);
+            snprintf(results[0].error, sizeof(results[0].error), "not enough memory to defish image");
+            return 0;
+        }
+
+        free(source.rgb);
+        source.rgb = defished;
+        resized.defishStrength = 0;
+    }
+
+    // The widest size is made from the input, and each size after it
+    // from the one before, before that one is handed over to be
+    // converted and freed
+    struct source image = source;
+    int ok = 1;
+
+    image.rgb = NULL;
+
+    for (int i = 0; i < count && ok; i++) {
+        struct archive2webpResult *result = &results[order[i]];
+        const int newWidth = MIN(widths[order[i]], width);
+        const int newHeight = scaledHeight(width, height, newWidth);
+        struct source current = image;
+
+        if (i == 0) {
+            current.rgb = newWidth == width ? source.rgb : resizedCopy(source.rgb, width, height, newWidth, newHeight);
+            if (current.rgb != source.rgb)
+                free(source.rgb);
+        } else {
+            current.startTime = getTimeMs();
+        }
+
+        current.width = newWidth;
+        current.height = newHeight;
+
+        // Only the input's own size can be compared to a JPEG input
+        if (newWidth != width) {
+            current.jpeg = NULL;
+            current.jpegSize = 0;
+        }
+
+        image.rgb = NULL;
+
+        if (current.rgb == NULL) {
+            snprintf(result->error, sizeof(result->error), "not enough memory to resize image");
+            ok = 0;
+            break;
+        }
+
+        if (i + 1 < count) {
+            const int nextWidth = MIN(widths[order[i + 1]], width);
+            image.rgb = resizedCopy(current.rgb, newWidth, newHeight, nextWidth, scaledHeight(width, height, nextWidth));
+        }
+
+        report(options, "Converting at %ix%i\n", newWidth, newHeight);
+
+        ok = convertImage(&resized, &current, result);
+    }
+
+    free(image.rgb);
+
+    if (!ok) {
+        // Report the failed size in the first result, and drop the rest
+        for (int i = 0; i < count; i++) {
+            if (results[i].error[0]) {
+                snprintf(message, sizeof(message), "%.200s at width %i", results[i].error, widths[i]);
+                break;
+            }
+        }
+
+        for (int i = 0; i < count; i++)
+            archive2webpResultFree(&results[i]);
+
+        memset(results, 0, sizeof(*results) * count);
+        snprintf(results[0].error, sizeof(results[0].error), "%s", message);
+    }
+
+    free(order);
+
+    return ok;
+}
@@ -0,0 +1,132 @@
+/*
+    In-memory interface to archive2webp: converts an image held in a
+    buffer to the smallest WebP that meets a quality target. Everything
+    a conversion needs is in its options and result, so any number of
+    conversions can run at once on different threads.
+
+    Link with libiqa, libwebp and libjpeg, and build with OpenMP to
+    search for a JPEG and a WebP at the same time.
+*/
+#ifndef LIBARCHIVE2WEBP_H
+#define LIBARCHIVE2WEBP_H
+
+#include <stddef.h>
+
+#include "search.h"
+#include "util.h"
+
+/*
+    Settings of a conversion, which are only read, so one set can be
+    shared by concurrent conversions. archive2webpOptionsInit() fills in
+    the defaults of the command line tool.
+*/
+struct archive2webpOptions {
+    enum METHOD method;
+    // Target value of the metric, or 0 to use the preset's
+    float target;
+    enum QUALITY_PRESET preset;
+    // Range of qualities to search, within QUALITY_MIN to QUALITY_MAX
+    int qMin;
+    int qMax;
+    // Number of binary search steps
+    int attempts;
+    // Defish strength, or 0 to leave the image alone, and zoom. The
+    // correction map is kept for the next image of the same geometry.
+    float defishStrength;
+    float defishZoom;
+    enum filetype inputFiletype;
+    // File used to cache search results between runs, or NULL
+    const char *cachePath;
+    // Stop searching once the remaining qualities cannot save this much
+    unsigned long minSaving;
+    float minSavingPercent;
+    // Time allowed for the conversion in milliseconds, or 0 for no limit
+    long deadlineMs;
+    // Output size in bytes to fit instead of a target quality, or 0
+    unsigned long targetSize;
+    // Percentage of the image to estimate wide search steps from, or 0
+    float samplePercent;
+    // Whether to decide search steps on PSNR mapped to the chosen metric
+    int useSurrogate;
+    // Called with each progress message, or NULL to drop them. With jpeg
+    // the two searches run on threads of their own and call it from
+    // either, though never both at once. Conversions running side by
+    // side call it concurrently if they share it.
+    void (*log)(void *opaque, const char *message);
+    void *logOpaque;
+    // Name used in cache keys, so results are only shared between
+    // conversions with the same name
+    const char *name;
+    // Also make an optimized JPEG from the same decode and reference,
+    // searched alongside the WebP on a thread of its own
+    int jpeg;
+    // Target of the JPEG search, or 0 to use the preset's JPEG target
+    float jpegTarget;
+    int jpegProgressive;
+    // Whether to favor accuracy over speed in the JPEG search
+    int jpegAccurate;
+    enum SUBSAMPLING_METHOD jpegSubsample;
+};
+
+/* An image made by a conversion. The data is allocated for the caller. */
+struct archive2webpOutput {
+    unsigned char *data;
+    size_t size;
+    // Quality chosen, and the metric measured at it unless searching
+    // on size alone or reusing a cached quality
+    int quality;
+    float metric;
+    int encodes;
+    // Why the search stopped, e.g. "converged" or "deadline"
+    const char *stopReason;
+};
+
+/* Outcome of a conversion, released by archive2webpResultFree(). */
+struct archive2webpResult {
+    struct archive2webpOutput webp;
+    // Only made with options->jpeg. When no quality makes a JPEG input
+    // smaller, this is a copy of the input with quality 0, unless the
+    // image was defished or resized.
+    struct archive2webpOutput jpeg;
+    int width;
+    int height;
+    double elapsedMs;
+    // What went wrong when the conversion failed
+    char error[256];
+};
+
+/*
+    Prepare state shared by all conversions: the pixel kernels for this
+    CPU. Call once before the first conversion, and before starting any
+    threads.
+*/
+void archive2webpInit(void);
+
+/* Set options to the defaults of the command line tool. */
+void archive2webpOptionsInit(struct archive2webpOptions *options);
+
+/* Target value of the preset for a method. */
+float archive2webpPresetTarget(enum METHOD method, enum QUALITY_PRESET preset);
+
+/*
+    Convert the image in input, a JPEG or PPM, to WebP, and to JPEG too
+    if asked. Returns 1 and fills in result on success. Returns 0 with a
+    message in result->error and no data on failure.
+*/
+int archive2webpConvert(const struct archive2webpOptions *options, const unsigned char *input, size_t inputSize, struct archive2webpResult *result);
+
+/*
+    Convert the image in input at each of count (at least one) widths,
+    e.g. for a srcset. The input is decoded and defished once, and each
+    size is shrunk from the next larger one and searched on its own,
+    with its own deadline. Heights keep the aspect ratio, and widths
+    beyond the input's are made at its size. Returns 1 and fills in
+    results[i] for widths[i] on success. Returns 0 with a message in
+    results[0].error and no data on failure.
+*/
+int archive2webpConvertWidths(const struct archive2webpOptions *options, const unsigned char *input, size_t inputSize, const int *widths, int count, struct archive2webpResult *results);
+
+/* Free the images of a result. */
+void archive2webpResultFree(struct archive2webpResult *result);
+
+#endif
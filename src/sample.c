@@ -0,0 +1,108 @@
+#include "sample.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct tileVariance {
+    double variance;
+    int index;
+};
+
+static int compareTiles(const void *a, const void *b) {
+    const struct tileVariance *left = a;
+    const struct tileVariance *right = b;
+
+    if (left->variance != right->variance)
+        return left->variance < right->variance ? -1 : 1;
+
+    // Keep the order deterministic for equal variances
+    return left->index - right->index;
+}
+
+int samplePlanInit(struct samplePlan *plan, const unsigned char *gray, int width, int height, int tileSize, float percent) {
+    int tilesWide = width / tileSize;
+    int tilesHigh = height / tileSize;
+    int total = tilesWide * tilesHigh;
+
+    memset(plan, 0, sizeof(*plan));
+    plan->tileSize = tileSize;
+
+    // Lay the tiles out in a grid that is as square as possible
+    int wanted = (int) (total * percent / 100 + 0.5);
+    int columns = (int) ceil(sqrt(wanted));
+    int rows = columns ? wanted / columns : 0;
+    int count = columns * rows;
+
+    if (count < SAMPLE_MIN_TILES || count >= total)
+        return 0;
+
+    struct tileVariance *tiles = malloc(total * sizeof(struct tileVariance));
+    plan->x = malloc(count * sizeof(int));
+    plan->y = malloc(count * sizeof(int));
+    plan->reference = malloc((size_t) count * tileSize * tileSize);
+
+    if (tiles == NULL || plan->x == NULL || plan->y == NULL || plan->reference == NULL) {
+        free(tiles);
+        samplePlanFree(plan);
+        return 0;
+    }
+
+    for (int i = 0; i < total; i++) {
+        int left = (i % tilesWide) * tileSize;
+        int top = (i / tilesWide) * tileSize;
+        double sum = 0, sumSquares = 0;
+
+        for (int y = top; y < top + tileSize; y++) {
+            const unsigned char *line = gray + (size_t) y * width + left;
+            for (int x = 0; x < tileSize; x++) {
+                sum += line[x];
+                sumSquares += line[x] * line[x];
+            }
+        }
+
+        double mean = sum / (tileSize * tileSize);
+        tiles[i].variance = sumSquares / (tileSize * tileSize) - mean * mean;
+        tiles[i].index = i;
+    }
+
+    qsort(tiles, total, sizeof(struct tileVariance), compareTiles);
+
+    // Take the middle tile of each stratum
+    for (int i = 0; i < count; i++) {
+        int index = tiles[(int) (((long) 2 * i + 1) * total / (2 * count))].index;
+
+        plan->x[i] = (index % tilesWide) * tileSize;
+        plan->y[i] = (index / tilesWide) * tileSize;
+    }
+
+    free(tiles);
+
+    plan->count = count;
+    plan->columns = columns;
+    plan->width = columns * tileSize;
+    plan->height = rows * tileSize;
+
+    sampleGather(plan, gray, width, plan->reference);
+
+    return 1;
+}
+
+void sampleGather(const struct samplePlan *plan, const unsigned char *gray, int width, unsigned char *sample) {
+    int tileSize = plan->tileSize;
+
+    for (int i = 0; i < plan->count; i++) {
+        unsigned char *out = sample + (size_t) (i / plan->columns) * tileSize * plan->width + (i % plan->columns) * tileSize;
+        const unsigned char *in = gray + (size_t) plan->y[i] * width + plan->x[i];
+
+        for (int y = 0; y < tileSize; y++)
+            memcpy(out + (size_t) y * plan->width, in + (size_t) y * width, tileSize);
+    }
+}
+
+void samplePlanFree(struct samplePlan *plan) {
+    free(plan->x);
+    free(plan->y);
+    free(plan->reference);
+    memset(plan, 0, sizeof(*plan));
+}
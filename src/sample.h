@@ -0,0 +1,58 @@
+/*
+    Content-stratified sampling of image tiles, used to estimate a
+    metric cheaply on early search steps
+*/
+#ifndef SAMPLE_H
+#define SAMPLE_H
+
+// Smallest tile side in pixels
+#define SAMPLE_TILE_SIZE 32
+
+// Fewest tiles worth sampling, below this the full frame is used
+#define SAMPLE_MIN_TILES 4
+
+// Search steps whose bracket spans at least this many qualities only
+// need a coarse answer and are estimated from the sample
+#define SAMPLE_MIN_RANGE 32
+
+/*
+    Tiles chosen from a grayscale image. Tiles are ranked by variance
+    and one is taken from the middle of each of count equal strata, so
+    flat and textured areas are both covered. The tiles are laid out
+    in a grid as one image, so any metric can be run on the sample of
+    the reference and the same sample of a candidate. A plan is only
+    read once built, so concurrent searches may share it.
+*/
+struct samplePlan {
+    int tileSize;
+    // Number of tiles and the columns of the grid they are laid out in
+    int count;
+    int columns;
+    // Top left corner of each tile in the image
+    int *x;
+    int *y;
+    // Size of the image the tiles are laid out in
+    int width;
+    int height;
+    // The sampled tiles of the reference
+    unsigned char *reference;
+};
+
+/*
+    Build a plan sampling about percent of a grayscale image in tiles of
+    tileSize pixels, which are aligned to multiples of tileSize. Returns
+    1 on success, or 0 if the image is too small to be worth sampling or
+    out of memory, in which case plan->count is 0.
+*/
+int samplePlanInit(struct samplePlan *plan, const unsigned char *gray, int width, int height, int tileSize, float percent);
+
+/*
+    Copy the planned tiles of a grayscale image of the given width into
+    sample, which must hold plan->width * plan->height bytes.
+*/
+void sampleGather(const struct samplePlan *plan, const unsigned char *gray, int width, unsigned char *sample);
+
+/* Free the memory held by a plan. */
+void samplePlanFree(struct samplePlan *plan);
+
+#endif
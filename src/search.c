@@ -0,0 +1,714 @@
+#include "search.h"
+#include "edit.h"
+#include "smallfry.h"
+#include "util.h"
+
+#include <float.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Images needed before a prior is trusted to seed the search
+#define PRIOR_MIN_IMAGES 3
+
+void bracketInit(struct searchBracket *bracket, int min, int max) {
+    bracket->min = min;
+    bracket->max = max;
+    bracket->next = 0;
+    bracket->seedWidth = 0;
+    bracket->passQuality = 0;
+    bracket->passSize = 0;
+    bracket->failQuality = 0;
+    bracket->failSize = 0;
+    bracket->minSaving = 0;
+    bracket->minSavingPercent = 0;
+}
+
+int bracketSeed(struct searchBracket *bracket, const struct qualityPrior *prior) {
+    if (prior == NULL || prior->count < PRIOR_MIN_IMAGES)
+        return 0;
+
+    bracket->next = MAX(bracket->min, MIN((int) (prior->mean + 0.5), bracket->max));
+
+    // Two deviations either side covers most of the images seen so far
+    bracket->seedWidth = (int) ceil(2.0 * prior->deviation) + 1;
+
+    return 1;
+}
+
+int bracketNext(struct searchBracket *bracket) {
+    int quality = bracket->next;
+
+    if (quality) {
+        bracket->next = 0;
+        return quality;
+    }
+
+    return (bracket->min + bracket->max) / 2;
+}
+
+int parseMinSaving(const char *arg, unsigned long *bytes, float *percent) {
+    char *end;
+    double value = strtod(arg, &end);
+
+    if (end == arg || value < 0)
+        return 0;
+
+    if (*end == '%' && end[1] == '\0') {
+        *bytes = 0;
+        *percent = value;
+    } else if (*end == '\0') {
+        *bytes = (unsigned long) value;
+        *percent = 0;
+    } else {
+        return 0;
+    }
+
+    return 1;
+}
+
+int bracketUpdate(struct searchBracket *bracket, int quality, int increase, unsigned long size) {
+    if (increase) {
+        bracket->min = MIN(quality + 1, bracket->max);
+
+        if (quality > bracket->failQuality) {
+            bracket->failQuality = quality;
+            bracket->failSize = size;
+        }
+    } else {
+        bracket->max = MAX(quality - 1, bracket->min);
+
+        if (!bracket->passQuality || quality < bracket->passQuality) {
+            bracket->passQuality = quality;
+            bracket->passSize = size;
+        }
+    }
+
+    if (bracket->seedWidth) {
+        // That was the seed, now check the edge of the expected interval
+        int edge = increase ? quality + bracket->seedWidth : quality - bracket->seedWidth;
+
+        if (edge > bracket->min && edge < bracket->max)
+            bracket->next = edge;
+
+        bracket->seedWidth = 0;
+    }
+
+    // Anything left lies between the two known encodes, so at best it
+    // gets down to the size of the failing one
+    if (bracket->passQuality && bracket->failQuality && bracket->min < bracket->max
+        && (bracket->minSaving || bracket->minSavingPercent)) {
+        unsigned long saving = bracket->passSize > bracket->failSize ? bracket->passSize - bracket->failSize : 0;
+
+        if (saving < bracket->minSaving || saving * 100.0 < bracket->passSize * bracket->minSavingPercent) {
+            bracket->min = bracket->max = bracket->passQuality;
+            bracket->next = 0;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void surrogateInit(struct surrogateFit *fit, enum surrogateScale scale) {
+    fit->scale = scale;
+    fit->count = 0;
+    fit->sumX = 0;
+    fit->sumY = 0;
+    fit->sumXX = 0;
+    fit->sumXY = 0;
+    fit->minX = 0;
+    fit->maxX = 0;
+}
+
+// Put a metric value on the scale it is fitted on. Returns 0 if it
+// cannot be, e.g. a similarity of exactly 1.
+static int surrogateTransform(enum surrogateScale scale, float metric, double *y) {
+    switch (scale) {
+        case SURROGATE_SIMILARITY:
+            if (metric >= 1)
+                return 0;
+            *y = log(1 - metric);
+            return 1;
+        case SURROGATE_ERROR:
+            if (metric <= 0)
+                return 0;
+            *y = log(metric);
+            return 1;
+        default:
+            *y = metric;
+            return 1;
+    }
+}
+
+void surrogateAdd(struct surrogateFit *fit, float surrogate, float metric) {
+    double y;
+
+    // Identical images have an infinite PSNR
+    if (!isfinite(surrogate) || !isfinite(metric) || !surrogateTransform(fit->scale, metric, &y))
+        return;
+
+    if (!fit->count || surrogate < fit->minX)
+        fit->minX = surrogate;
+    if (!fit->count || surrogate > fit->maxX)
+        fit->maxX = surrogate;
+
+    fit->count++;
+    fit->sumX += surrogate;
+    fit->sumY += y;
+    fit->sumXX += (double) surrogate * surrogate;
+    fit->sumXY += surrogate * y;
+}
+
+int surrogatePredict(const struct surrogateFit *fit, float surrogate, float target, float *metric) {
+    double goal;
+
+    if (fit->count < SURROGATE_PAIRS || !isfinite(surrogate))
+        return 0;
+
+    // Only interpolate between measured pairs
+    if (surrogate < fit->minX || surrogate > fit->maxX)
+        return 0;
+
+    double n = fit->count;
+    double det = n * fit->sumXX - fit->sumX * fit->sumX;
+
+    // All pairs at the same surrogate value give no slope
+    if (det < 1e-6 * n * n)
+        return 0;
+
+    double slope = (n * fit->sumXY - fit->sumX * fit->sumY) / det;
+    double y = (fit->sumY - slope * fit->sumX) / n + slope * surrogate;
+
+    // Too close to call, which on the log scales is a relative margin
+    if (surrogateTransform(fit->scale, target, &goal)) {
+        double margin = fit->scale == SURROGATE_LINEAR ? SURROGATE_MARGIN * fabs(goal) : SURROGATE_MARGIN;
+        if (fabs(y - goal) < margin)
+            return 0;
+    }
+
+    switch (fit->scale) {
+        case SURROGATE_SIMILARITY:
+            *metric = (float) (1 - exp(y));
+            break;
+        case SURROGATE_ERROR:
+            *metric = (float) exp(y);
+            break;
+        default:
+            *metric = (float) y;
+            break;
+    }
+
+    return 1;
+}
+
+const char methodName[6][9] = {
+    "",
+    "ssim",
+    "ms-ssim",
+    "smallfry",
+    "mpe",
+    "ssim-dct"
+};
+
+float presetTarget(const float presets[][4], enum METHOD method, enum QUALITY_PRESET preset) {
+    return presets[method - SSIM][preset];
+}
+
+// Pass a progress message to the search's log, if any
+static void report(const struct searchSettings *settings, const char *format, ...) {
+    char message[512];
+    va_list args;
+
+    if (settings->log == NULL)
+        return;
+
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+
+    settings->log(settings->logOpaque, message);
+}
+
+int searchReferenceInit(struct searchReference *ref, const struct searchSettings *settings, const unsigned char *gray, int width, int height) {
+    memset(ref, 0, sizeof(*ref));
+    ref->gray = gray;
+    ref->width = width;
+    ref->height = height;
+
+    if (gray == NULL)
+        return 1;
+
+    // With ssim-dct the reference is transformed once, and drafts can be
+    // scored from their coefficients
+    if (settings->method == SSIM_DCT && !dctReferenceInit(&ref->dct, gray, width, height))
+        return 0;
+
+    // Wide search steps only need a coarse answer, so they can be scored
+    // on a sample of tiles. Tiles hold several windows of the scaled image
+    // SSIM works on, and the sample is scored at the same scale. MS-SSIM
+    // needs whole windows at its coarsest scale too.
+    int ssimScale = MAX(1, (int) (MIN(width, height) / 256.0 + 0.5));
+    int tileSize = settings->method == MS_SSIM ? SAMPLE_TILE_SIZE * 8 : MAX(SAMPLE_TILE_SIZE, 32 * ssimScale);
+    struct iqa_ssim_args sampleArgs = { 1.0f, 1.0f, 1.0f, 255, 0.01f, 0.03f, ssimScale };
+
+    ref->sampleArgs = sampleArgs;
+    if (settings->samplePercent > 0 && settings->method != SSIM_DCT &&
+        samplePlanInit(&ref->plan, gray, width, height, tileSize, settings->samplePercent)) {
+        report(settings, "Sampling %i tiles of %ipx for wide search steps\n", ref->plan.count, ref->plan.tileSize);
+    }
+
+    return 1;
+}
+
+void searchReferenceFree(struct searchReference *ref) {
+    samplePlanFree(&ref->plan);
+    dctReferenceFree(&ref->dct);
+}
+
+// Measure the similarity of two grayscale images with the chosen method
+static float compareGray(enum METHOD method, const unsigned char *original, const unsigned char *compressed, int width, int height, const struct iqa_ssim_args *ssimArgs) {
+    switch (method) {
+        case MS_SSIM:
+            return iqa_ms_ssim(original, compressed, width, height, width, 0);
+        case SMALLFRY:
+            return smallfry_metric((unsigned char *) original, (unsigned char *) compressed, width, height);
+        case MPE:
+            return meanPixelError(original, compressed, width, height, 1, width);
+        case SSIM: default:
+            return iqa_ssim(original, compressed, width, height, width, 0, ssimArgs);
+    }
+}
+
+// Whether a metric value meets the target. MPE is an error rather than a
+// similarity, so it runs the other way.
+static int meetsTarget(enum METHOD method, float metric, float target) {
+    return method == MPE ? metric < target : metric >= target;
+}
+
+// Measure an encode on the whole image, exactly as the last step of a
+// search does. Returns 0 if it cannot be decoded.
+static int measureEncode(const struct searchSettings *settings, const struct searchCodec *codec, const struct searchReference *ref, struct iqa_ssim_state *ssimState, const unsigned char *data, unsigned long size, float *metric) {
+    unsigned char *gray;
+    int exact;
+
+    if (!codec->decodeLuma(codec->opaque, data, size, &gray))
+        return 0;
+
+    if (settings->method == SSIM_DCT)
+        *metric = dctSsimPixels(&ref->dct, gray);
+    else if (settings->method == SSIM && ssimState)
+        *metric = iqa_ssim_incremental(ssimState, gray, settings->target, 0, &exact);
+    else
+        *metric = compareGray(settings->method, ref->gray, gray, ref->width, ref->height, NULL);
+
+    free(gray);
+
+    return 1;
+}
+
+// Release what a failed search holds and say why. Returns SEARCH_ERROR.
+static enum searchStatus searchFailed(struct searchResult *result, const char *error, struct iqa_ssim_state *ssimState, unsigned char *sample, unsigned char *encoded, unsigned char *candidate) {
+    iqa_ssim_state_free(ssimState);
+    free(sample);
+    free(encoded);
+    free(candidate);
+    result->error = error;
+    return SEARCH_ERROR;
+}
+
+enum searchStatus searchQuality(const struct searchSettings *settings, const struct searchCodec *codec, const struct searchReference *ref, struct searchResult *result) {
+    const enum METHOD method = settings->method;
+    const float target = settings->target;
+    const unsigned long limit = settings->targetSize;
+    const struct samplePlan *plan = &ref->plan;
+    const int width = ref->width;
+    const int height = ref->height;
+
+    memset(result, 0, sizeof(*result));
+
+    // Qualities index the record of what was tried
+    if (settings->qMin < QUALITY_MIN || settings->qMax > QUALITY_MAX || settings->qMin > settings->qMax) {
+        result->error = "quality range out of bounds";
+        return SEARCH_ERROR;
+    }
+
+    // Do a binary search to find the optimal encoding quality for the
+    // given target metric value.
+    float newDiff = 0;
+    int quality;
+    int encodes = 0;
+    int seeded = 0;
+    int cachedQuality = 0;
+    unsigned long cachedSize = 0;
+    struct searchBracket bracket;
+    struct qualityPrior prior;
+
+    // Qualities encoded so far, trying one again would teach us nothing
+    char tried[QUALITY_MAX + 1] = { 0 };
+
+    // The current encode, and the best candidate so far: the smallest
+    // encode meeting the target (on size, the highest quality that
+    // fits), or the closest miss until one does. The candidate's bytes
+    // are kept unless they are too large.
+    unsigned char *encoded = NULL;
+    unsigned long encodedSize = 0;
+    unsigned char *candidate = NULL;
+    unsigned long candidateSize = 0;
+    int candidateQuality = 0;
+    int candidatePass = 0;
+    int candidateFinal = 0;
+    float candidateDiff = FLT_MAX;
+    float candidateMetric = 0;
+    // Whether the candidate's metric was estimated rather than measured
+    // on the whole image, and the lowest quality measured to pass
+    int candidateEstimated = 0;
+    int measuredPass = 0;
+
+    // Longest encode and compare seen so far, used to predict the next
+    double roundMs = 0;
+    const char *stopReason = "out of attempts";
+    // Whether the deadline stopped the search before it was done
+    int cutShort = 0;
+
+    // SSIM is scored incrementally, so blocks that decode the same as in
+    // the previous step are not scored again
+    struct iqa_ssim_state *ssimState = NULL;
+    if (method == SSIM && !limit)
+        ssimState = iqa_ssim_state_new(ref->gray, width, height, width, 0, 0, codec->blockSize);
+
+    // Room for the sampled tiles of each encode, kept by every search so
+    // that they can share the reference
+    unsigned char *sample = NULL;
+    if (plan->count)
+        sample = malloc((size_t) plan->width * plan->height);
+
+    // PSNR is mapped onto the chosen metric from the first few steps,
+    // which measure both
+    struct surrogateFit fit;
+    surrogateInit(&fit, method == MPE ? SURROGATE_ERROR : method == SMALLFRY ? SURROGATE_LINEAR : SURROGATE_SIMILARITY);
+
+    bracketInit(&bracket, settings->qMin, settings->qMax);
+
+    // When bisecting on size the bracket sizes are not a saving to bound
+    if (!limit) {
+        bracket.minSaving = settings->minSaving;
+        bracket.minSavingPercent = settings->minSavingPercent;
+    }
+
+    // A cached result needs no search, just the final encode, otherwise
+    // start near the qualities chosen for similar images
+    int attempts = settings->attempts;
+    if (settings->cache != NULL && cacheLookup(settings->cache, settings->cacheKey, &cachedQuality, &cachedSize)) {
+        report(settings, "Using cached quality %i (size %lu)\n", cachedQuality, cachedSize);
+        candidateQuality = MAX(settings->qMin, MIN(cachedQuality, settings->qMax));
+        candidatePass = 1;
+        attempts = 0;
+        stopReason = "cached";
+    } else if (settings->cache != NULL && cacheGetPrior(settings->cache, settings->priorKey, &prior)) {
+        seeded = bracketSeed(&bracket, &prior);
+        if (seeded)
+            report(settings, "Seeding search at q=%i from %u similar images\n", bracket.next, prior.count);
+    }
+
+    for (int attempt = attempts - 1; attempt >= 0; --attempt) {
+        double roundStart = getTimeMs();
+
+        quality = bracketNext(&bracket);
+
+        if (tried[quality]) {
+            stopReason = "quality repeated";
+            break;
+        }
+
+        tried[quality] = 1;
+        encodes++;
+
+        // Terminate early once bisection interval is a singleton. The
+        // last encode of the search uses the final settings, so it can
+        // be kept as is if it wins. On size every encode does, as a
+        // draft's size says little about the final one's.
+        if (bracket.min == bracket.max) {
+            attempt = 0;
+            stopReason = "converged";
+        }
+        int final = !attempt;
+        int finalSettings = final || limit;
+
+        free(encoded);
+        encoded = NULL;
+
+        // Encodes over the budget are abandoned part way
+        int encodeStatus = codec->encode(codec->opaque, quality, finalSettings, limit, &encoded, &encodedSize);
+        if (encodeStatus < 0)
+            return searchFailed(result, "could not encode image", ssimState, sample, encoded, candidate);
+        if (!encodeStatus)
+            encodedSize = 0;
+
+        int increase;
+        int estimated = 0;
+        float metric = 0;
+
+        if (limit) {
+            // Only the size matters, so skip the decode and metric
+            increase = encodeStatus;
+
+            if (increase) {
+                report(settings, "%s at q=%i (%i - %i): %lu bytes (budget: %lu)\n", final ? "Final size" : "Size", quality, bracket.min, bracket.max, encodedSize, limit);
+            } else {
+                report(settings, "%s at q=%i (%i - %i): over budget of %lu\n", final ? "Final size" : "Size", quality, bracket.min, bracket.max, limit);
+            }
+        } else {
+            // Measure quality difference. Steps before the last only need
+            // to know which side of the target the metric is on.
+            int exact = 1;
+
+            if (method == SSIM_DCT && !final && codec->estimateDct != NULL) {
+                // Estimated from the coefficients, so nothing is decoded,
+                // unless the draft cannot be read that way
+                metric = codec->estimateDct(codec->opaque, &ref->dct, encoded, encodedSize);
+                estimated = metric >= 0;
+                exact = !estimated;
+            }
+
+            if (!estimated) {
+                unsigned char *compressedGray;
+
+                if (!codec->decodeLuma(codec->opaque, encoded, encodedSize, &compressedGray))
+                    return searchFailed(result, "unable to decode the image that was just encoded", ssimState, sample, encoded, candidate);
+
+                // With a surrogate, steps before the last are decided on PSNR
+                // once the mapping is learned. Until then both are measured,
+                // and the pairs need the exact metric. A predicted pass is
+                // measured on the whole image if it ends up kept.
+                float psnr = 0;
+                int pairing = 0;
+                int surrogated = 0;
+                if (settings->useSurrogate && !final) {
+                    psnr = iqa_psnr(ref->gray, compressedGray, width, height, width);
+                    surrogated = surrogatePredict(&fit, psnr, target, &metric);
+                    pairing = !surrogated;
+                    exact = !surrogated;
+                    estimated = surrogated;
+                }
+
+                // Wide steps are scored on the sample, unless it is too small
+                // for the metric. A pass there is only an estimate, measured
+                // on the whole image if it ends up kept.
+                int sampled = !surrogated && !pairing && sample != NULL && !final && bracket.max - bracket.min >= SAMPLE_MIN_RANGE;
+                if (sampled) {
+                    sampleGather(plan, compressedGray, width, sample);
+                    metric = compareGray(method, plan->reference, sample, plan->width, plan->height, &ref->sampleArgs);
+                    sampled = isfinite(metric);
+                    exact = !sampled;
+                    estimated = sampled;
+                }
+
+                if (!sampled && !surrogated) {
+                    if (method == SSIM_DCT)
+                        metric = dctSsimPixels(&ref->dct, compressedGray);
+                    else if (method == SSIM && ssimState)
+                        metric = iqa_ssim_incremental(ssimState, compressedGray, target, final || pairing ? 0 : METRIC_CONFIDENCE, &exact);
+                    else
+                        metric = compareGray(method, ref->gray, compressedGray, width, height, NULL);
+
+                    if (pairing)
+                        surrogateAdd(&fit, psnr, metric);
+                }
+
+                free(compressedGray);
+            }
+
+            newDiff = fabs(target - metric);
+
+            if (!final) {
+                report(settings, "%s at q=%i (%i - %i): %f%s (target: %f diff: %f) size: %lu\n", methodName[method], quality, bracket.min, bracket.max, metric, exact ? "" : " estimated", target, newDiff, encodedSize);
+            } else {
+                report(settings, "Final optimized %s at q=%i: %f (target: %f diff: %f) size: %lu\n", methodName[method], quality, metric, target, newDiff, encodedSize);
+            }
+
+            increase = !meetsTarget(method, metric, target);
+
+            if (!increase && !estimated && (!measuredPass || quality < measuredPass))
+                measuredPass = quality;
+
+            // Higher qualities only get larger, so if this one is not
+            // good enough there is nothing left worth searching
+            if (increase && settings->maxSize && encodedSize >= settings->maxSize) {
+                iqa_ssim_state_free(ssimState);
+                free(sample);
+                free(encoded);
+                free(candidate);
+                return SEARCH_TOO_LARGE;
+            }
+        }
+
+        // Keep this encode if it beats the best candidate so far
+        int better;
+        if (limit)
+            better = increase && quality > candidateQuality;
+        else
+            better = increase ? !candidatePass && newDiff < candidateDiff : !candidatePass || encodedSize < candidateSize;
+
+        if (better) {
+            free(candidate);
+            candidate = NULL;
+
+            if (encodedSize <= CANDIDATE_MAX_SIZE) {
+                candidate = encoded;
+                encoded = NULL;
+            }
+
+            candidateSize = encodedSize;
+            candidateQuality = quality;
+            candidatePass = limit ? increase : !increase;
+            candidateFinal = finalSettings;
+            candidateDiff = newDiff;
+            candidateMetric = metric;
+            candidateEstimated = estimated;
+        }
+
+        if (bracketUpdate(&bracket, quality, increase, encodedSize)) {
+            // The best candidate is already the one to settle on
+            stopReason = "minimum saving reached";
+            break;
+        }
+
+        // Stop if another round would likely overrun the deadline
+        double now = getTimeMs();
+        roundMs = MAX(roundMs, now - roundStart);
+        if (settings->deadlineMs && attempt && now - settings->startTime + roundMs > settings->deadlineMs) {
+            stopReason = "deadline";
+            cutShort = 1;
+            break;
+        }
+    }
+
+    free(sample);
+    free(encoded);
+    encoded = NULL;
+
+    if (limit && !candidatePass) {
+        iqa_ssim_state_free(ssimState);
+        free(candidate);
+        return SEARCH_NO_FIT;
+    }
+
+    // Only encode again if the winner was a draft, or its bytes were not
+    // kept
+    quality = candidateQuality;
+    if (candidate == NULL || (codec->drafts && !candidateFinal)) {
+        int encodeStatus = codec->encode(codec->opaque, quality, 1, limit, &encoded, &encodedSize);
+        encodes++;
+
+        if (encodeStatus < 0)
+            return searchFailed(result, "could not encode image", ssimState, NULL, encoded, candidate);
+
+        if (encodeStatus && (candidate == NULL || encodedSize < candidateSize)) {
+            report(settings, "Final optimized encode at q=%i: %lu bytes\n", quality, encodedSize);
+            free(candidate);
+        } else if (candidate != NULL) {
+            // Optimizing did not help, keep the encode that was measured
+            report(settings, "Final optimized encode at q=%i was not smaller, keeping the search encode\n", quality);
+            free(encoded);
+            encoded = candidate;
+            encodedSize = candidateSize;
+        } else {
+            iqa_ssim_state_free(ssimState);
+            return SEARCH_NO_FIT;
+        }
+    } else {
+        encoded = candidate;
+        encodedSize = candidateSize;
+    }
+
+    // A pass that was only estimated is measured on the whole image
+    // before it is settled on. If it misses after all, qualities above it
+    // are tried in growing steps, up to the lowest one measured to pass,
+    // until one passes and the gap below it is bisected. The lowest that
+    // passes is kept, or the closest miss.
+    if (candidatePass && candidateEstimated) {
+        float metric;
+
+        if (!measureEncode(settings, codec, ref, ssimState, encoded, encodedSize, &metric))
+            return searchFailed(result, "unable to decode the image that was just encoded", ssimState, NULL, encoded, NULL);
+
+        report(settings, "Measured %s at q=%i: %f (target: %f diff: %f) size: %lu\n", methodName[method], quality, metric, target, fabs(target - metric), encodedSize);
+        candidateMetric = metric;
+
+        int passed = meetsTarget(method, metric, target);
+        int low = quality + 1;
+        int high = passed ? quality : measuredPass ? measuredPass : settings->qMax;
+        float closest = fabs(target - metric);
+        int step = 1;
+
+        while (low <= high) {
+            int probe = passed ? (low + high) / 2 : MIN(low + step - 1, high);
+            unsigned char *data = NULL;
+            unsigned long size = 0;
+
+            encodes++;
+            if (codec->encode(codec->opaque, probe, 1, 0, &data, &size) <= 0)
+                return searchFailed(result, "could not encode image", ssimState, NULL, encoded, data);
+
+            if (!measureEncode(settings, codec, ref, ssimState, data, size, &metric))
+                return searchFailed(result, "unable to decode the image that was just encoded", ssimState, NULL, encoded, data);
+
+            report(settings, "Measured %s at q=%i (%i - %i): %f (target: %f diff: %f) size: %lu\n", methodName[method], probe, low, high, metric, target, fabs(target - metric), size);
+
+            // Each pass is lower than the one before, and misses only
+            // count until something passes
+            int pass = meetsTarget(method, metric, target);
+            if (pass || (!passed && fabs(target - metric) < closest)) {
+                free(encoded);
+                encoded = data;
+                encodedSize = size;
+                quality = probe;
+                candidateMetric = metric;
+                closest = fabs(target - metric);
+            } else {
+                free(data);
+            }
+
+            if (pass) {
+                passed = 1;
+                high = probe - 1;
+            } else {
+                low = probe + 1;
+                step *= 2;
+            }
+        }
+    }
+
+    iqa_ssim_state_free(ssimState);
+
+    report(settings, "Search stopped (%s) after %i encodes in %.0f ms, keeping q=%i\n",
+        stopReason, encodes, getTimeMs() - settings->startTime, quality);
+
+    // What a search cut short settles on depends on the machine's speed, so
+    // it is neither replayed nor learned from
+    if (settings->cache != NULL && !cachedQuality && !cutShort) {
+        cacheStore(settings->cache, settings->cacheKey, quality, encodedSize);
+        cacheUpdatePrior(settings->cache, settings->priorKey, quality, encodes, seeded);
+
+        // Report how much the prior saves across the batch so far
+        if (cacheGetPrior(settings->cache, settings->priorKey, &prior)) {
+            float cold = prior.images[0] ? (float) prior.encodes[0] / prior.images[0] : 0;
+            float warm = prior.images[1] ? (float) prior.encodes[1] / prior.images[1] : 0;
+
+            report(settings, "Average encodes per image: %.1f without prior (%u images), %.1f with prior (%u images)\n",
+                cold, prior.images[0], warm, prior.images[1]);
+        }
+    }
+
+    result->data = encoded;
+    result->size = encodedSize;
+    result->quality = quality;
+    result->metric = candidateMetric;
+    result->encodes = encodes;
+    result->stopReason = stopReason;
+
+    return SEARCH_DONE;
+}
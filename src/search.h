@@ -0,0 +1,283 @@
+/*
+    Quality search shared by the tools: the search engine, which finds
+    the lowest quality of any codec that meets a metric target, and the
+    helpers it is built from
+*/
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include "cache.h"
+#include "dctssim.h"
+#include "iqa/include/iqa.h"
+#include "sample.h"
+
+// Range of qualities any search may cover
+#define QUALITY_MIN 0
+#define QUALITY_MAX 100
+
+// Largest encode kept as a search candidate. Bigger winners are encoded
+// again once the search is over instead of holding on to them.
+#define CANDIDATE_MAX_SIZE (32 * 1024 * 1024)
+
+// Standard errors a sampled SSIM estimate must be away from the target
+// before the search trusts it instead of scoring the whole image.
+#define METRIC_CONFIDENCE 3.0f
+
+// Paired evaluations needed before a surrogate metric is trusted
+#define SURROGATE_PAIRS 2
+
+// Predictions closer to the target than this, relative on the fitted
+// scale, are too close to call and the metric is measured instead
+#define SURROGATE_MARGIN 0.05
+
+/*
+    Interval of qualities still to be searched. A search may be seeded
+    from a quality prior: the first guess is the prior's mean and the
+    second probes the edge of the interval the prior expects, so that
+    bisection continues within a narrow interval whose ends have both
+    been verified.
+*/
+struct searchBracket {
+    int min;
+    int max;
+    // Quality to try next instead of the middle of the interval, or 0
+    int next;
+    // Distance from the seed to the edge probed after it
+    int seedWidth;
+    // Lowest quality found acceptable and highest found too distorted,
+    // with their encoded sizes, or 0 if not seen yet
+    int passQuality;
+    unsigned long passSize;
+    int failQuality;
+    unsigned long failSize;
+    // Stop once searching further could save less than this many bytes
+    // or this percentage of the size at the pass quality
+    unsigned long minSaving;
+    float minSavingPercent;
+};
+
+/* Start a search over qualities min to max inclusive. */
+void bracketInit(struct searchBracket *bracket, int min, int max);
+
+/*
+    Seed the search from a prior if it describes enough images.
+    Returns 1 if the search was seeded, otherwise 0.
+*/
+int bracketSeed(struct searchBracket *bracket, const struct qualityPrior *prior);
+
+/* Get the next quality to try. */
+int bracketNext(struct searchBracket *bracket);
+
+/*
+    Parse a minimum saving given either in bytes or as a percentage,
+    e.g. "2048" or "1%". Returns 0 if the value is invalid.
+*/
+int parseMinSaving(const char *arg, unsigned long *bytes, float *percent);
+
+/*
+    Per-image mapping from a cheap surrogate metric (PSNR) to the chosen
+    one, fitted by least squares on paired evaluations as the search
+    goes. The chosen metric is put on a scale where it is close to
+    linear in PSNR first: similarities that approach 1 use log(1 - m),
+    errors that approach 0 use log(m), and anything else is used as is.
+*/
+enum surrogateScale {
+    SURROGATE_LINEAR,
+    SURROGATE_SIMILARITY,
+    SURROGATE_ERROR
+};
+
+struct surrogateFit {
+    enum surrogateScale scale;
+    int count;
+    double sumX;
+    double sumY;
+    double sumXX;
+    double sumXY;
+    // Range of surrogate values paired so far
+    float minX;
+    float maxX;
+};
+
+/* Start an empty mapping onto a metric of the given scale. */
+void surrogateInit(struct surrogateFit *fit, enum surrogateScale scale);
+
+/*
+    Add a pair of surrogate and metric values measured on the same
+    encode. Pairs that cannot be put on the scale are ignored.
+*/
+void surrogateAdd(struct surrogateFit *fit, float surrogate, float metric);
+
+/*
+    Predict the metric from a surrogate value. Returns 0 if the mapping
+    does not have SURROGATE_PAIRS distinct pairs yet, if the value is
+    outside the range of the pairs, since the fit is not trusted to
+    extrapolate, or if the prediction is within SURROGATE_MARGIN of
+    target and so cannot tell which side of it the metric is on.
+*/
+int surrogatePredict(const struct surrogateFit *fit, float surrogate, float target, float *metric);
+
+/*
+    Update the interval after trying a quality whose encode took size
+    bytes. Set increase if the result was too distorted and a higher
+    quality is needed. Returns 1 if the rest of the interval cannot
+    save the minimum and the search should settle on the pass quality.
+*/
+int bracketUpdate(struct searchBracket *bracket, int quality, int increase, unsigned long size);
+
+// Comparison method
+enum METHOD {
+    UNKNOWN,
+    SSIM,
+    MS_SSIM,
+    SMALLFRY,
+    MPE,
+    SSIM_DCT
+};
+
+// Name of each method as given on the command line
+extern const char methodName[6][9];
+
+// Target quality presets
+enum QUALITY_PRESET {
+    LOW,
+    MEDIUM,
+    HIGH,
+    VERYHIGH
+};
+
+/*
+    Target of a preset from a codec's table, which has a row of the four
+    preset targets for each method from SSIM on.
+*/
+float presetTarget(const float presets[][4], enum METHOD method, enum QUALITY_PRESET preset);
+
+/*
+    How the search drives an output format. Encoded data is allocated
+    with malloc() and becomes the search's to free.
+*/
+struct searchCodec {
+    // Passed to each call
+    void *opaque;
+    // Side of the blocks the codec works in, which incremental SSIM
+    // rescores as a unit
+    int blockSize;
+    // Whether encodes before the last step of the search are drafts,
+    // made faster than the final encode, so a winning draft needs one
+    // more encode once the search is over. Searches on size never use
+    // drafts.
+    int drafts;
+
+    /*
+        Encode at a quality, with the final settings if final is set.
+        If limit is not 0 the encode is abandoned once it grows past
+        limit bytes. Returns 1 on success, 0 if over the limit or -1 if
+        the encode failed.
+    */
+    int (*encode)(void *opaque, int quality, int final, unsigned long limit, unsigned char **data, unsigned long *size);
+
+    /*
+        Decode an encode into a grayscale image the size of the
+        original. Returns the size of the image, or 0 on failure.
+    */
+    long (*decodeLuma)(void *opaque, const unsigned char *data, unsigned long size, unsigned char **gray);
+
+    /*
+        Estimate the ssim-dct metric of a draft without decoding it, or
+        NULL to decode and measure it.
+    */
+    float (*estimateDct)(void *opaque, const struct dctReference *dct, const unsigned char *data, unsigned long size);
+};
+
+/* Settings of a search, shared by all codecs. */
+struct searchSettings {
+    enum METHOD method;
+    float target;
+    // Qualities to search, and the number of steps
+    int qMin;
+    int qMax;
+    int attempts;
+    // Byte budget of the output to search on instead of the metric, or 0
+    unsigned long targetSize;
+    // Stop once the remaining qualities cannot save this much
+    unsigned long minSaving;
+    float minSavingPercent;
+    // Give up once an encode too distorted to use is already this large,
+    // as every quality that would do is larger still, or 0
+    unsigned long maxSize;
+    // When work on the image started, from getTimeMs(), and the time
+    // allowed for it in milliseconds, or 0 for no limit
+    double startTime;
+    long deadlineMs;
+    // Percentage of the image to estimate wide search steps from, or 0
+    float samplePercent;
+    // Whether to decide search steps on PSNR mapped to the chosen metric
+    int useSurrogate;
+    // Cache to look the result up in and record it to, or NULL, with the
+    // keys of the image and of the prior for similar images
+    struct cache *cache;
+    uint64_t cacheKey;
+    uint64_t priorKey;
+    // Called with each progress message, or NULL to drop them
+    void (*log)(void *opaque, const char *message);
+    void *logOpaque;
+};
+
+/*
+    What every search of an image measures against: the grayscale
+    original and anything precomputed from it for the chosen method.
+*/
+struct searchReference {
+    const unsigned char *gray;
+    int width;
+    int height;
+    // Tiles scored on wide search steps, if sampling
+    struct samplePlan plan;
+    struct iqa_ssim_args sampleArgs;
+    // Transformed original, for ssim-dct
+    struct dctReference dct;
+};
+
+/*
+    Prepare the reference for searches of a grayscale image, which must
+    outlive it. gray may be NULL when searching on size alone. Returns 1
+    on success or 0 if out of memory.
+*/
+int searchReferenceInit(struct searchReference *ref, const struct searchSettings *settings, const unsigned char *gray, int width, int height);
+
+/* Free what was precomputed for a reference. */
+void searchReferenceFree(struct searchReference *ref);
+
+enum searchStatus {
+    SEARCH_ERROR,
+    SEARCH_DONE,
+    // Every quality meeting the target would be over settings->maxSize
+    SEARCH_TOO_LARGE,
+    // No quality fits in settings->targetSize
+    SEARCH_NO_FIT
+};
+
+struct searchResult {
+    // The chosen encode, with the final settings, to free()
+    unsigned char *data;
+    unsigned long size;
+    int quality;
+    // Metric measured at the chosen quality, unless searching on size or
+    // reusing a cached quality
+    float metric;
+    int encodes;
+    // Why the search stopped, e.g. "converged" or "deadline"
+    const char *stopReason;
+    // What went wrong on SEARCH_ERROR
+    const char *error;
+};
+
+/*
+    Search the qualities of a codec for the smallest encode that meets
+    the target, bisecting on the metric, or for the largest that fits in
+    the byte budget. The qualities must lie within QUALITY_MIN to
+    QUALITY_MAX. On SEARCH_DONE the result holds the encode.
+*/
+enum searchStatus searchQuality(const struct searchSettings *settings, const struct searchCodec *codec, const struct searchReference *ref, struct searchResult *result);
+
+#endif
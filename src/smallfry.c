@@ -18,100 +18,112 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include "kernels.h"
 #include "smallfry.h"
 
 #define MAX(a, b) (a > b ? a : b)
 #define MIN(a, b) (a < b ? a : b)
 
-static double psnr_factor(uint8_t *orig, uint8_t *cmp, int orig_stride,
-                          int cmp_stride, int width, int height, uint8_t max)
-{
-    uint8_t *old, *new;
-    double ret;
-    int sum;
-    int i, j;
-
-    sum = 0;
-    old = orig;
-    new = cmp;
+/*
+ * The image is scored in horizontal stripes of whole 8 row blocks, which
+ * may run in parallel. Partial results are combined in stripe order, so
+ * the score does not depend on the number of threads.
+ */
+#define SMALLFRY_STRIPES 64
 
-    for (i = 0; i < height; i++) {
-        for (j = 0; j < width; j++)
-            sum += (old[j] - new[j]) * (old[j] - new[j]);
+struct smallfry_stats {
+    uint8_t max;
+    uint64_t sse;
+    double aae;
+    int64_t cnt;
+};
 
-        old += orig_stride;
-        new += cmp_stride;
-    }
+/*
+ * Blockiness across a block edge between differences b and c, with a and
+ * d the differences either side. The step is compared to the activity
+ * around it, 2 * step / (around + 0.0001), in integers where possible.
+ */
+static double edge_term(int a, int b, int c, int d)
+{
+    int step = abs(b - c);
+    int around = abs(a - b) + abs(c - d);
 
-    ret  = (double) sum / (double) (width * height);
-    ret  = 10.0 * log10(65025.0 / ret);
+    // Ratio of 2 or less
+    if (step <= around)
+        return 0.0;
 
-    if (max > 128)
-        ret /= 50.0;
-    else
-        ret /= (0.0016 * (double) (max * max)) - (0.38 * (double) max + 72.5);
+    // Ratio over 5
+    if (2 * step > 5 * around)
+        return 1.0;
 
-    return MAX(MIN(ret, 1.0), 0.0);
+    return edgeRatio(step, around);
 }
 
-#define DVAL(i) (abs(old[i] - new[i]))
-#define HDVAL(i,j) (abs(old[i + j * orig_stride] - new[i + j * cmp_stride]))
-static double aae_factor(uint8_t *orig, uint8_t *cmp, int orig_stride,
-                         int cmp_stride, int width, int height, uint8_t max)
+/*
+ * Score rows first to last, which start block rows. Samples past the
+ * right and bottom edges repeat the last column and row.
+ */
+static void stripe_stats(const struct pixelKernels *kernels,
+                         const uint8_t *orig, const uint8_t *cmp, int width,
+                         int height, int first, int last,
+                         struct smallfry_stats *stats)
 {
-    uint8_t *old, *new;
-    double ret;
-    double sum;
-    double cfmax, cf;
     int i, j;
-    int cnt;
 
-    sum = 0.0;
-    cnt = 0;
-    old = orig;
-    new = cmp;
+    stats->max = 0;
+    stats->sse = 0;
+    stats->aae = 0.0;
+    stats->cnt = 0;
 
-    for (i = 0; i < height; i++) {
-        for (j = 7; j < width - 1; j += 8) {
-            double calc;
+    for (i = first; i < last; i++) {
+        const uint8_t *old = orig + (size_t) i * width;
+        const uint8_t *new = cmp + (size_t) i * width;
 
-            cnt++;
+        kernels->errorStats(old, new, width, &stats->max, &stats->sse);
 
-            calc  = abs(DVAL(j) - DVAL(j + 1));
-            calc /= (abs(DVAL(j - 1) - DVAL(j)) + abs(DVAL(j + 1) - DVAL(j + 2)) + 0.0001) / 2.0;
+        // Vertical block edges in this row
+        for (j = 7; j < width - 1; j += 8) {
+            int k = MIN(j + 2, width - 1);
 
-            if (calc > 5.0)
-                sum += 1.0;
-            else if (calc > 2.0)
-                sum += (calc - 2.0) / (5.0 - 2.0);
+            stats->aae += edge_term(abs(old[j - 1] - new[j - 1]),
+                                    abs(old[j] - new[j]),
+                                    abs(old[j + 1] - new[j + 1]),
+                                    abs(old[k] - new[k]));
+            stats->cnt++;
         }
 
-        old += orig_stride;
-        new += cmp_stride;
+        // Horizontal block edge below this row
+        if (i % 8 == 7 && i < height - 1) {
+            const size_t below = (size_t) MIN(i + 2, height - 1) * width;
+            const uint8_t *const origRows[4] = { old - width, old, old + width, orig + below };
+            const uint8_t *const cmpRows[4] = { new - width, new, new + width, cmp + below };
+
+            stats->aae += kernels->edgeRow(origRows, cmpRows, width);
+            stats->cnt += width;
+        }
     }
+}
 
-    old = orig + 7 * orig_stride;
-    new = cmp  + 7 * cmp_stride;
+static double psnr_factor(uint64_t sse, int width, int height, uint8_t max)
+{
+    double ret;
 
-    for (i = 7; i < height - 1; i += 8) {
-        for (j = 0; j < width; j++) {
-            double calc;
+    ret  = (double) sse / ((double) width * height);
+    ret  = 10.0 * log10(65025.0 / ret);
 
-            cnt++;
+    if (max > 128)
+        ret /= 50.0;
+    else
+        ret /= (0.0016 * (double) (max * max)) - (0.38 * (double) max + 72.5);
 
-            calc  = abs(DVAL(j) - HDVAL(j, 1));
-            calc /= (abs(HDVAL(j, -1) - DVAL(j)) + abs(HDVAL(j, 1) - HDVAL(j, 2)) + 0.0001) / 2.0;
+    return MAX(MIN(ret, 1.0), 0.0);
+}
 
-            if (calc > 5.0)
-                sum += 1.0;
-            else if (calc > 2.0)
-                sum += (calc - 2.0) / (5.0 - 2.0);
-        }
+static double aae_factor(double sum, int64_t cnt, uint8_t max)
+{
+    double ret;
+    double cfmax, cf;
 
-        old += 8 * orig_stride;
-        new += 8 * cmp_stride;
-    }
-    
     ret = 1 - (sum / (double) cnt);
 
     if (max > 128)
@@ -124,31 +136,41 @@ static double aae_factor(uint8_t *orig, uint8_t *cmp, int orig_stride,
     return ret * cf;
 }
 
-static uint8_t maxluma(uint8_t *buf, int stride, int width, int height)
+double smallfry_metric(uint8_t *inbuf, uint8_t *outbuf, int width, int height)
 {
-    uint8_t *in = buf;
+    struct smallfry_stats stats[SMALLFRY_STRIPES];
+    int blocks = (height + 7) / 8;
+    int stripes = MIN(blocks, SMALLFRY_STRIPES);
+    double p, a, b;
+    uint64_t sse = 0;
+    double aae = 0.0;
+    int64_t cnt = 0;
     uint8_t max = 0;
-    int i, j;
+    int s;
 
-    for (i = 0; i < height; i++) {
-        for (j = 0; j < width; j++)
-            max = MAX(in[j], max);
+    // Looked up before any threads start, as the first call selects them
+    const struct pixelKernels *kernels = pixelKernels();
 
-        in += stride;
-    }
-
-    return max;
-}
+    // Max luma, squared error and blockiness in one pass
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for (s = 0; s < stripes; s++) {
+        int first = (int) ((int64_t) s * blocks / stripes) * 8;
+        int last = (int) ((int64_t) (s + 1) * blocks / stripes) * 8;
 
-double smallfry_metric(uint8_t *inbuf, uint8_t *outbuf, int width, int height)
-{
-    double p, a, b;
-    uint8_t max;
+        stripe_stats(kernels, inbuf, outbuf, width, height, first, MIN(last, height), &stats[s]);
+    }
 
-    max = maxluma(inbuf, width, width, height);
+    for (s = 0; s < stripes; s++) {
+        max = MAX(stats[s].max, max);
+        sse += stats[s].sse;
+        aae += stats[s].aae;
+        cnt += stats[s].cnt;
+    }
 
-    p = psnr_factor(inbuf, outbuf, width, width, width, height, max);
-    a = aae_factor(inbuf, outbuf, width, width, width, height, max);
+    p = psnr_factor(sse, width, height, max);
+    a = aae_factor(aae, cnt, max);
 
     b = p * 37.1891885161239 + a * 78.5328607296973;
 
@@ -1,5 +1,12 @@
+#ifndef _WIN32
+    // clock_gettime() is hidden by -std=c99
+    #define _POSIX_C_SOURCE 200809L
+#endif
+
 #include "util.h"
 
+#include <errno.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,6 +15,9 @@
 #ifdef _WIN32
     #include <io.h>
     #include <fcntl.h>
+    #include <sys/timeb.h>
+#else
+    #include <time.h>
 #endif
 
 #define INPUT_BUFFER_SIZE 102400
@@ -30,6 +40,35 @@ void error(const char *format, ...) {
     va_end(arglist);
 }
 
+int parseLong(const char *arg, long min, long max, long *value) {
+    char *end;
+
+    errno = 0;
+    long parsed = strtol(arg, &end, 10);
+
+    if (end == arg || *end != '\0' || errno == ERANGE || parsed < min || parsed > max)
+        return 0;
+
+    *value = parsed;
+
+    return 1;
+}
+
+int parseFloat(const char *arg, float min, float max, float *value) {
+    char *end;
+
+    errno = 0;
+    double parsed = strtod(arg, &end);
+
+    // Written so NaN fails the range check
+    if (end == arg || *end != '\0' || errno == ERANGE || !(parsed >= min && parsed <= max))
+        return 0;
+
+    *value = (float) parsed;
+
+    return 1;
+}
+
 long readFile(char *name, void **buffer) {
     FILE *file;
     size_t fileLen = 0;
@@ -80,13 +119,35 @@ int checkJpegMagic(const unsigned char *buf, unsigned long size) {
     return (size >= 2 && buf[0] == 0xff && buf[1] == 0xd8);
 }
 
+static void exitJpeg(j_common_ptr cinfo) {
+    (*cinfo->err->output_message)(cinfo);
+    longjmp(((struct jpegError *) cinfo->err)->failed, 1);
+}
+
+struct jpeg_error_mgr *jpegErrorInit(struct jpegError *jerr) {
+    jpeg_std_error(&jerr->pub);
+    jerr->pub.error_exit = exitJpeg;
+
+    return &jerr->pub;
+}
+
 unsigned long decodeJpeg(unsigned char *buf, unsigned long bufSize, unsigned char **image, int *width, int *height, int pixelFormat) {
     struct jpeg_decompress_struct cinfo;
-    struct jpeg_error_mgr jerr;
+    struct jpegError jerr;
     int row_stride;
     JSAMPARRAY buffer;
 
-    cinfo.err = jpeg_std_error(&jerr);
+    // A corrupt image fails the decode instead of exiting the process
+    cinfo.err = jpegErrorInit(&jerr);
+
+    *image = NULL;
+
+    if (setjmp(jerr.failed)) {
+        jpeg_destroy_decompress(&cinfo);
+        free(*image);
+        *image = NULL;
+        return 0;
+    }
 
     jpeg_create_decompress(&cinfo);
 
@@ -110,7 +171,11 @@ unsigned long decodeJpeg(unsigned char *buf, unsigned long bufSize, unsigned cha
         ((j_common_ptr) &cinfo, JPOOL_IMAGE, row_stride, 1);
 
     // Allocate image pixel buffer
-    *image = malloc(row_stride * (*height));
+    *image = malloc((size_t) row_stride * (*height));
+    if (*image == NULL) {
+        jpeg_destroy_decompress(&cinfo);
+        return 0;
+    }
 
     // Read image row by row
     int row = 0;
@@ -126,19 +191,79 @@ unsigned long decodeJpeg(unsigned char *buf, unsigned long bufSize, unsigned cha
     return row_stride * (*height);
 }
 
+/*
+    Fixed size destination for encodes with a byte budget. Running out
+    of space jumps straight back to encodeJpegLimit().
+*/
+struct budgetDestination {
+    struct jpeg_destination_mgr pub;
+    jmp_buf overflow;
+};
+
+static void initBudgetDestination(j_compress_ptr cinfo) {
+    (void) cinfo;
+}
+
+static boolean emptyBudgetDestination(j_compress_ptr cinfo) {
+    longjmp(((struct budgetDestination *) cinfo->dest)->overflow, 1);
+}
+
+static void termBudgetDestination(j_compress_ptr cinfo) {
+    (void) cinfo;
+}
+
 unsigned long encodeJpeg(unsigned char **jpeg, unsigned char *buf, int width, int height, int pixelFormat, int quality, int progressive, int optimize, int subsample) {
+    return encodeJpegLimit(jpeg, buf, width, height, pixelFormat, quality, progressive, optimize, subsample, 0);
+}
+
+unsigned long encodeJpegLimit(unsigned char **jpeg, unsigned char *buf, int width, int height, int pixelFormat, int quality, int progressive, int optimize, int subsample, unsigned long maxSize) {
     long unsigned int jpegSize = 0;
     struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
+    struct jpegError jerr;
+    struct budgetDestination dest;
     JSAMPROW row_pointer[1];
     int row_stride = width * (pixelFormat == JCS_RGB ? 3 : 1);
 
-    cinfo.err = jpeg_std_error(&jerr);
+    // An image libjpeg cannot encode, e.g. one too wide for a JPEG,
+    // fails the encode instead of exiting the process
+    cinfo.err = jpegErrorInit(&jerr);
+
+    *jpeg = NULL;
+
+    if (setjmp(jerr.failed)) {
+        jpeg_destroy_compress(&cinfo);
+        free(*jpeg);
+        *jpeg = NULL;
+        return 0;
+    }
 
     jpeg_create_compress(&cinfo);
 
     // Set destination
-    jpeg_mem_dest(&cinfo, jpeg, &jpegSize);
+    if (maxSize) {
+        *jpeg = malloc(maxSize);
+        if (*jpeg == NULL) {
+            jpeg_destroy_compress(&cinfo);
+            return 0;
+        }
+
+        dest.pub.next_output_byte = *jpeg;
+        dest.pub.free_in_buffer = maxSize;
+        dest.pub.init_destination = initBudgetDestination;
+        dest.pub.empty_output_buffer = emptyBudgetDestination;
+        dest.pub.term_destination = termBudgetDestination;
+        cinfo.dest = &dest.pub;
+
+        // Over budget, give up on the rest of the image
+        if (setjmp(dest.overflow)) {
+            jpeg_destroy_compress(&cinfo);
+            free(*jpeg);
+            *jpeg = NULL;
+            return maxSize + 1;
+        }
+    } else {
+        jpeg_mem_dest(&cinfo, jpeg, &jpegSize);
+    }
 
     // Set options
     cinfo.image_width = width;
@@ -200,11 +325,15 @@ unsigned long encodeJpeg(unsigned char **jpeg, unsigned char *buf, int width, in
 
     // Process scanlines one by one
     while (cinfo.next_scanline < cinfo.image_height) {
-        row_pointer[0] = &buf[cinfo.next_scanline * row_stride];
+        row_pointer[0] = &buf[(size_t) cinfo.next_scanline * row_stride];
         (void) jpeg_write_scanlines(&cinfo, row_pointer, 1);
     }
 
     jpeg_finish_compress(&cinfo);
+
+    if (maxSize)
+        jpegSize = maxSize - dest.pub.free_in_buffer;
+
     jpeg_destroy_compress(&cinfo);
 
     return jpegSize;
@@ -370,3 +499,161 @@ int getMetadata(const unsigned char *buf, unsigned int bufSize, unsigned char **
 
     return 0;
 }
+
+// Position of each zigzag-ordered DQT entry in a row-major 8x8 block
+static const int zigzagToNatural[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10,
+    17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34,
+    27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36,
+    29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63
+};
+
+int readJpegHeader(const unsigned char *buf, unsigned long bufSize, struct jpegHeader *header, const char *comment) {
+    unsigned long pos = 2;
+    int haveFrame = 0;
+
+    memset(header, 0, sizeof(*header));
+
+    if (!checkJpegMagic(buf, bufSize))
+        return 0;
+
+    while (pos + 1 < bufSize) {
+        if (buf[pos] != 0xff)
+            return 0;
+
+        // Any number of 0xff fill bytes may precede a marker
+        while (pos + 1 < bufSize && buf[pos + 1] == 0xff)
+            pos++;
+
+        if (pos + 1 >= bufSize)
+            return 0;
+
+        unsigned char marker = buf[pos + 1];
+
+        if (marker == 0xda /* SOS */) {
+            // Entropy coded data follows, we have all we need
+            return haveFrame;
+        } else if (marker == 0xd9 /* EOI */) {
+            return 0;
+        } else if ((marker >= 0xd0 && marker <= 0xd8) /* RST0+x, SOI */ || marker == 0x01 /* TEM */) {
+            pos += 2;
+            continue;
+        }
+
+        if (pos + 3 >= bufSize)
+            return 0;
+
+        unsigned int size = (buf[pos + 2] << 8) + buf[pos + 3];
+        const unsigned char *data = buf + pos + 4;
+        unsigned int dataSize = size - 2;
+
+        if (size < 2 || pos + 2 + size > bufSize)
+            return 0;
+
+        if (marker == 0xdb /* DQT */) {
+            unsigned int offset = 0;
+
+            // A single DQT marker may define several tables
+            while (offset < dataSize) {
+                int precision = data[offset] >> 4;
+                int slot = data[offset] & 0x0f;
+                unsigned int tableSize = precision ? 128 : 64;
+
+                if (slot > 3 || offset + 1 + tableSize > dataSize)
+                    return 0;
+
+                for (int i = 0; i < 64; i++) {
+                    const unsigned char *value = data + offset + 1 + (precision ? i * 2 : i);
+                    header->quant[slot][zigzagToNatural[i]] = precision ? (value[0] << 8) + value[1] : value[0];
+                }
+
+                header->quantMask |= 1 << slot;
+                offset += 1 + tableSize;
+            }
+        } else if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 /* DHT */ && marker != 0xc8 /* JPG */ && marker != 0xcc /* DAC */) {
+            // Start of frame
+            if (dataSize < 6)
+                return 0;
+
+            header->height = (data[1] << 8) + data[2];
+            header->width = (data[3] << 8) + data[4];
+            header->components = data[5];
+            header->progressive = (marker == 0xc2 || marker == 0xc6 || marker == 0xca || marker == 0xce);
+
+            if (dataSize < 6 + 3 * (unsigned int) header->components)
+                return 0;
+
+            for (int i = 0; i < header->components && i < 4; i++) {
+                header->componentQuant[i] = data[6 + i * 3 + 2] & 0x03;
+            }
+
+            haveFrame = header->width > 0 && header->height > 0 && header->components > 0;
+        } else if (marker == 0xfe /* COM */ && comment != NULL) {
+            size_t commentLen = strlen(comment);
+
+            if (dataSize >= commentLen && !strncmp(comment, (const char *) data, commentLen)) {
+                header->hasComment = 1;
+            }
+        }
+
+        pos += 2 + size;
+    }
+
+    return 0;
+}
+
+// Standard IJG luma quantization table (JPEG spec, Annex K), natural order
+static const unsigned short stdLumaQuant[64] = {
+    16,  11,  10,  16,  24,  40,  51,  61,
+    12,  12,  14,  19,  26,  58,  60,  55,
+    14,  13,  16,  24,  40,  57,  69,  56,
+    14,  17,  22,  29,  51,  87,  80,  62,
+    18,  22,  37,  56,  68, 109, 103,  77,
+    24,  35,  55,  64,  81, 104, 113,  92,
+    49,  64,  78,  87, 103, 121, 120, 101,
+    72,  92,  95,  98, 112, 100, 103,  99
+};
+
+int estimateJpegQuality(const struct jpegHeader *header) {
+    int slot = header->componentQuant[0];
+    unsigned long sum = 0, stdSum = 0;
+    double scale;
+    int quality;
+
+    if (!(header->quantMask & (1 << slot)))
+        return 0;
+
+    for (int i = 0; i < 64; i++) {
+        sum += header->quant[slot][i];
+        stdSum += stdLumaQuant[i];
+    }
+
+    // Invert the scaling done by jpeg_quality_scaling()
+    scale = sum * 100.0 / stdSum;
+    if (scale <= 100.0)
+        quality = (int) ((200.0 - scale) / 2.0 + 0.5);
+    else
+        quality = (int) (5000.0 / scale + 0.5);
+
+    return MAX(1, MIN(quality, 100));
+}
+
+double getTimeMs(void) {
+#ifdef _WIN32
+    struct _timeb now;
+
+    _ftime(&now);
+
+    return now.time * 1000.0 + now.millitm;
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+#endif
+}
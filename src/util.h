@@ -4,6 +4,7 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <setjmp.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <jpeglib.h>
@@ -28,6 +29,25 @@ enum SUBSAMPLING_METHOD {
     SUBSAMPLE_444
 };
 
+/*
+    Summary of a JPEG file gathered from its marker segments alone,
+    without decoding any image data.
+*/
+struct jpegHeader {
+    int width;
+    int height;
+    int components;
+    int progressive;
+    // Bit mask of the quantization table slots defined by DQT markers
+    int quantMask;
+    // Quantization tables in natural (row-major) order
+    unsigned short quant[4][64];
+    // Quantization table slot used by each of the first four components
+    int componentQuant[4];
+    // Whether the comment passed to readJpegHeader() is present
+    int hasComment;
+};
+
 enum filetype {
     FILETYPE_UNKNOWN,
     FILETYPE_AUTO,
@@ -41,6 +61,18 @@ void version(void);
 /* Print an error message. */
 void error(const char *format, ...);
 
+/*
+    Parse a whole decimal number from min to max. Returns 0 if arg is
+    anything else.
+*/
+int parseLong(const char *arg, long min, long max, long *value);
+
+/*
+    Parse a decimal number from min to max. Returns 0 if arg is anything
+    else, including infinity and NaN.
+*/
+int parseFloat(const char *arg, float min, float max, float *value);
+
 /*
     Read a file into a buffer and return the length.
 */
@@ -48,10 +80,25 @@ long readFile(char *name, void **buffer);
 
 /*
     Decode a buffer into a JPEG image with the given pixel format.
-    Returns the size of the image pixel array.
+    Returns the size of the image pixel array, or 0 if the buffer is
+    not a valid JPEG.
     See libjpeg.txt for a (very long) explanation.
 */
 int checkJpegMagic(const unsigned char *buf, unsigned long size);
+
+/*
+    libjpeg error handler which prints the message and jumps back to
+    failed instead of exiting the process, so a library or a daemon
+    survives a bad image. Set failed with setjmp() before any other
+    libjpeg call, and destroy the object when it is taken.
+*/
+struct jpegError {
+    struct jpeg_error_mgr pub;
+    jmp_buf failed;
+};
+
+struct jpeg_error_mgr *jpegErrorInit(struct jpegError *jerr);
+
 unsigned long decodeJpeg(unsigned char *buf, unsigned long bufSize, unsigned char **image, int *width, int *height, int pixelFormat);
 
 /*
@@ -62,10 +109,19 @@ int checkPpmMagic(const unsigned char *buf, unsigned long size);
 unsigned long decodePpm(unsigned char *buf, unsigned long bufSize, unsigned char **image, int *width, int *height);
 
 /*
-    Encode a buffer of image pixels into a JPEG.
+    Encode a buffer of image pixels into a JPEG. Returns its size, or 0
+    with *jpeg set to NULL if libjpeg fails, e.g. out of memory or on an
+    image too large for a JPEG.
 */
 unsigned long encodeJpeg(unsigned char **jpeg, unsigned char *buf, int width, int height, int pixelFormat, int quality, int progressive, int optimize, int subsample);
 
+/*
+    Encode like encodeJpeg(), but give up as soon as the output grows
+    beyond maxSize bytes. Returns maxSize + 1 and sets *jpeg to NULL in
+    that case. A maxSize of 0 means no limit.
+*/
+unsigned long encodeJpegLimit(unsigned char **jpeg, unsigned char *buf, int width, int height, int pixelFormat, int quality, int progressive, int optimize, int subsample, unsigned long maxSize);
+
 /* Automatically detect the file type of a given file. */
 enum filetype detectFiletype(const char *filename);
 enum filetype detectFiletypeFromBuffer(unsigned char *buf, long bufSize);
@@ -86,4 +142,31 @@ unsigned long decodeFileFromBuffer(unsigned char *buf, long bufSize, unsigned ch
 */
 int getMetadata(const unsigned char *buf, unsigned int bufSize, unsigned char **meta, unsigned int *metaSize, const char *comment);
 
+/*
+    Walk the JPEG markers up to the first SOS and fill in the image
+    dimensions, component count, scan type and quantization tables.
+    Nothing is decoded, so this is cheap enough to triage a file before
+    doing any pixel work.
+
+    If comment is not NULL, then header->hasComment is set when a COM
+    marker starting with the comment is encountered.
+
+    Returns 1 on success or 0 if the markers are truncated or malformed.
+*/
+int readJpegHeader(const unsigned char *buf, unsigned long bufSize, struct jpegHeader *header, const char *comment);
+
+/*
+    Estimate the quality a JPEG was saved at by comparing its luma
+    quantization table to the standard IJG table as scaled by
+    jpeg_set_quality(). Returns a quality between 1 and 100, or 0 if
+    the header has no usable luma table.
+*/
+int estimateJpegQuality(const struct jpegHeader *header);
+
+/*
+    Get a monotonic timestamp in milliseconds, for measuring how long
+    something took.
+*/
+double getTimeMs(void);
+
 #endif
@@ -0,0 +1,42 @@
+#!/bin/bash
+
+# Training run for `make pgo`: compresses the bundled corpus in test/pgo
+# with every method and the common options, so the profile covers the
+# code real batches spend their time in. Also useful as a benchmark:
+#
+#     time ./test/pgo.sh .
+
+BIN=${1:-.}
+CORPUS=$(dirname "$0")/pgo
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+# Some images cannot be made smaller at some settings, which the tools
+# report as an error, so exit codes are ignored
+for file in "$CORPUS"/*.jpg; do
+    name=`basename "$file"`
+
+    for method in ssim ms-ssim smallfry mpe ssim-dct; do
+        "$BIN/jpeg-recompress" -Q -m $method "$file" "$OUT/$method-$name"
+    done
+
+    "$BIN/jpeg-recompress" -Q -a -q high "$file" "$OUT/accurate-$name"
+    "$BIN/jpeg-recompress" -Q -e 10 -S disable "$file" "$OUT/sample-$name"
+    "$BIN/jpeg-recompress" -Q -m ms-ssim -u "$file" "$OUT/surrogate-$name"
+    "$BIN/jpeg-recompress" -Q -d 0.5 -z 1.2 "$file" "$OUT/defish-$name"
+
+    # Only built by `make pgo` when libwebp is there
+    if [ -x "$BIN/archive2webp" ]; then
+        for method in ssim ms-ssim smallfry mpe; do
+            "$BIN/archive2webp" -Q -m $method "$file" "$OUT/$method-$name.webp"
+        done
+
+        "$BIN/archive2webp" -Q -e 10 "$file" "$OUT/sample-$name.webp"
+        "$BIN/archive2webp" -Q -m ms-ssim -u "$file" "$OUT/surrogate-$name.webp"
+        "$BIN/archive2webp" -Q -d 0.5 -z 1.2 "$file" "$OUT/defish-$name.webp"
+        "$BIN/archive2webp" -Q -j "$OUT/both-$name" "$file" "$OUT/both-$name.webp"
+        "$BIN/archive2webp" -Q -w 320,640 "$file" "$OUT/widths-$name.webp"
+    fi
+done
+
+exit 0
@@ -1,9 +1,201 @@
+#ifndef _WIN32
+    // fork(), kill() and friends are hidden by -std=c99
+    #define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+    #include <signal.h>
+    #include <sys/wait.h>
+    #include <time.h>
+    #include <unistd.h>
+#endif
+
+#include "../src/cache.h"
+#include "../src/daemon.h"
+#include "../src/dctssim.h"
 #include "../src/edit.h"
 #include "../src/hash.h"
+#include "../src/sample.h"
+#include "../src/search.h"
+#include "../src/smallfry.h"
 #include "../src/util.h"
 
 #include "../src/test/describe.h"
 
+// Blockiness of one block edge, as the scalar SmallFry scores it
+static double smallfryEdge(int a, int b, int c, int d) {
+    double calc = abs(b - c) / ((abs(a - b) + abs(c - d) + 0.0001) / 2.0);
+
+    if (calc > 5.0)
+        return 1.0;
+    if (calc > 2.0)
+        return (calc - 2.0) / (5.0 - 2.0);
+    return 0.0;
+}
+
+// Codec for driving the search without an encoder: each pixel of a
+// decode is off from the original by 100 - quality
+struct fakeCodec {
+    const unsigned char *gray;
+    int width;
+    int height;
+};
+
+static int fakeEncode(void *opaque, int quality, int final, unsigned long limit, unsigned char **data, unsigned long *size) {
+    (void) opaque;
+    (void) final;
+    (void) limit;
+
+    // Larger at higher qualities, as encodes are
+    *data = calloc(quality + 1, 1);
+    if (*data == NULL)
+        return -1;
+
+    **data = quality;
+    *size = quality + 1;
+
+    return 1;
+}
+
+static long fakeDecodeLuma(void *opaque, const unsigned char *data, unsigned long size, unsigned char **gray) {
+    const struct fakeCodec *codec = opaque;
+    const long length = (long) codec->width * codec->height;
+
+    (void) size;
+
+    *gray = malloc(length);
+    if (*gray == NULL)
+        return 0;
+
+    for (long i = 0; i < length; i++)
+        (*gray)[i] = codec->gray[i] + 100 - data[0];
+
+    return length;
+}
+
+// Defish as it was done before the map, one pixel at a time
+static void defishReference(const unsigned char *input, unsigned char *output, int width, int height, float strength, float zoom) {
+    const int cx = width / 2;
+    const int cy = height / 2;
+    const float len = sqrt(width * width + height * height);
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            float dx = (cx - x) * zoom;
+            float dy = (cy - y) * zoom;
+            float r = sqrt(dx * dx + dy * dy) / len * strength;
+            float theta = r != 0.0 ? atan(r) / r : 1.0;
+
+            dx = clamp(0.0, (float) width / 2.0 - theta * dx, width);
+            dy = clamp(0.0, (float) height / 2.0 - theta * dy, height);
+
+            for (int z = 0; z < 3; z++)
+                output[(y * width + x) * 3 + z] = interpolate(input, width, 3, dx, dy, z);
+        }
+    }
+}
+
+// Gathers the strips of a defished image, stopping after stopAfter
+// strips unless it is 0
+struct stripCollector {
+    unsigned char *rgb;
+    int width;
+    int strips;
+    int nextTop;
+    int inOrder;
+    int stopAfter;
+};
+
+static int collectStrip(void *opaque, const unsigned char *rgb, int top, int rows) {
+    struct stripCollector *collector = opaque;
+
+    if (top != collector->nextTop || rows > DEFISH_STRIP_ROWS)
+        collector->inOrder = 0;
+
+    memcpy(collector->rgb + (size_t) top * collector->width * 3, rgb, (size_t) rows * collector->width * 3);
+    collector->nextTop = top + rows;
+    collector->strips++;
+
+    return collector->strips != collector->stopAfter;
+}
+
+#ifndef _WIN32
+// Answers a request to the daemon with its arguments on a line, then the
+// size of its input on another, followed by the input
+static void echoRequest(void *opaque, int argc, char **argv, const unsigned char *input, size_t inputSize, int fd) {
+    char line[256] = "args";
+
+    (void) opaque;
+
+    for (int i = 0; i < argc; i++)
+        snprintf(line + strlen(line), sizeof(line) - strlen(line), " %s", argv[i]);
+
+    if (daemonWriteLine(fd, "%s", line) && daemonWriteLine(fd, "input %lu", (unsigned long) inputSize))
+        daemonWriteData(fd, input, inputSize);
+}
+
+// Send a request to the daemon, waiting up to two seconds for it to
+// start listening. Returns the connection or -1.
+static int requestWhenUp(const char *path, int argc, char **argv, const unsigned char *input, size_t inputSize) {
+    struct timespec pause = { 0, 10000000 };
+    char message[256];
+
+    for (int tries = 0; tries < 200; tries++) {
+        int fd = daemonRequest(path, argc, argv, input, inputSize, message, sizeof(message));
+        if (fd >= 0)
+            return fd;
+
+        nanosleep(&pause, NULL);
+    }
+
+    return -1;
+}
+#endif
+
+// The scalar SmallFry metric with 64-bit sums, for sizes that are
+// multiples of 8, where no edge reads past the image
+static double smallfryReference(const unsigned char *orig, const unsigned char *cmp, int width, int height, uint64_t *sse) {
+    double aae = 0;
+    int64_t cnt = 0;
+    int max = 0;
+
+    #define D(x, y) abs(orig[(y) * width + (x)] - cmp[(y) * width + (x)])
+    *sse = 0;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            *sse += D(x, y) * D(x, y);
+            max = orig[y * width + x] > max ? orig[y * width + x] : max;
+        }
+
+        for (int x = 7; x < width - 1; x += 8, cnt++)
+            aae += smallfryEdge(D(x - 1, y), D(x, y), D(x + 1, y), D(x + 2, y));
+    }
+
+    for (int y = 7; y < height - 1; y += 8) {
+        for (int x = 0; x < width; x++, cnt++)
+            aae += smallfryEdge(D(x, y - 1), D(x, y), D(x, y + 1), D(x, y + 2));
+    }
+    #undef D
+
+    double p = 10.0 * log10(65025.0 / ((double) *sse / ((double) width * height)));
+    p /= max > 128 ? 50.0 : 0.0016 * max * max - (0.38 * max + 72.5);
+    p = p > 1.0 ? 1.0 : p < 0.0 ? 0.0 : p;
+
+    double cfmax = max > 128 ? 0.65 : 0.65 + 0.35 * ((128.0 - max) / 128.0);
+    double cf = 0.25 + 1000.0 * cnt / aae;
+    cf = cf > 1 ? 1 : cf;
+    cf = cf > cfmax ? cf : cfmax;
+    double a = (1 - aae / cnt) * cf;
+
+    return p * 37.1891885161239 + a * 78.5328607296973;
+}
+
 describe ("Unit Tests", {
     it ("Should clamp values", {
         assert_equal_float(0.0, clamp(0.0, -10.0, 100.0));
@@ -59,6 +251,37 @@ describe ("Unit Tests", {
         free(image);
     });
 
+    it ("Should downscale an image", {
+        unsigned char image[30];
+        unsigned char scaled[4];
+
+        /*
+        [  0  1  2  3  4
+           5  6  7  8  9
+          ...
+          25 26 27 28 29 ]
+        */
+
+        for (int x = 0; x < 30; x++) {
+            image[x] = (unsigned char) x;
+        }
+
+        /*
+        Each output pixel averages 2.5 x 3 input pixels
+        [  5.8  8.2
+          20.8 23.2 ]
+        */
+        assert_equal(1, downscale(image, 5, 6, 1, scaled, 2, 2));
+
+        assert_equal(6, scaled[0]);
+        assert_equal(8, scaled[1]);
+        assert_equal(21, scaled[2]);
+        assert_equal(23, scaled[3]);
+
+        // Growing is not a downscale
+        assert_equal(0, downscale(image, 5, 6, 1, scaled, 6, 2));
+    });
+
     it ("Should generate an image hash", {
         unsigned char *image;
         unsigned char *hash;
@@ -93,6 +316,144 @@ describe ("Unit Tests", {
         assert_equal(2, dist);
     });
 
+    it ("Should measure the mean pixel error within the stride", {
+        int width = 37;
+        int height = 9;
+        int stride = width * 3 + 5;
+        unsigned char *original = malloc(stride * height);
+        unsigned char *compressed = malloc(stride * height);
+        int64_t total = 0;
+
+        // Odd sized rows cover the tail of the vector kernels, and the
+        // padding differs wildly but must not count
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < stride; x++) {
+                int i = y * stride + x;
+                int diff = x < width * 3 ? (i % 7) - 3 : 100;
+
+                original[i] = 100 + i % 50;
+                compressed[i] = original[i] + diff;
+                total += x < width * 3 ? abs(diff) : 0;
+            }
+        }
+
+        float expected = (float) ((double) total / (width * 3 * height));
+        assert_equal_float(expected, meanPixelError(original, compressed, width, height, 3, stride));
+
+        free(original);
+        free(compressed);
+    });
+
+    it ("Should defish the same whole or in strips", {
+        int width = 45;
+        int height = 37;
+        size_t size = (size_t) width * height * 3;
+        unsigned char *input = malloc(size);
+        unsigned char *whole = malloc(size);
+        unsigned char *expected = malloc(size);
+        unsigned char *streamed = malloc(size);
+        unsigned char *gray = malloc(width * height);
+        unsigned char *wholeGray = NULL;
+        struct defishMap map;
+        struct stripCollector collector;
+        int worst = 0;
+
+        for (size_t i = 0; i < size; i++)
+            input[i] = (i * 37 + (i / 135) * 11) % 256;
+
+        // Within rounding of the weights of the per pixel original
+        memset(&map, 0, sizeof(map));
+        assert_equal(1, defishMapPrepare(&map, width, height, 2.6, 1.2));
+        defishMapApply(&map, input, whole, 3);
+        defishReference(input, expected, width, height, 2.6, 1.2);
+        for (size_t i = 0; i < size; i++)
+            worst = MAX(worst, abs(whole[i] - expected[i]));
+        assert_equal(1, (worst <= 1));
+
+        // The same map is kept for the same settings
+        float *theta = map.theta;
+        assert_equal(1, defishMapPrepare(&map, width, height, 2.6, 1.2));
+        assert_equal(1, (map.theta == theta));
+
+        // Strips in order, 16 + 16 + 5 rows, that add up to the whole
+        memset(&collector, 0, sizeof(collector));
+        collector.rgb = streamed;
+        collector.width = width;
+        collector.inOrder = 1;
+        assert_equal(1, defishStream(&map, input, gray, collectStrip, &collector));
+        assert_equal(3, collector.strips);
+        assert_equal(1, collector.inOrder);
+        assert_equal(height, collector.nextTop);
+        assert_equal(0, memcmp(whole, streamed, size));
+
+        assert_equal(width * height, (int) grayscale(whole, &wholeGray, width, height));
+        assert_equal(0, memcmp(wholeGray, gray, width * height));
+
+        // The sink can stop the stream
+        memset(&collector, 0, sizeof(collector));
+        collector.rgb = streamed;
+        collector.width = width;
+        collector.stopAfter = 2;
+        assert_equal(0, defishStream(&map, input, NULL, collectStrip, &collector));
+        assert_equal(2, collector.strips);
+
+        defishMapFree(&map);
+        free(input);
+        free(whole);
+        free(expected);
+        free(streamed);
+        free(gray);
+        free(wholeGray);
+    });
+
+#ifndef _WIN32
+    it ("Should answer a request over the daemon's socket", {
+        const char *path = "test/test.sock";
+        unsigned char input[5] = "abcd";
+        unsigned char echoed[5];
+        char *args[3];
+        char line[256];
+        char message[256];
+        struct daemonSettings settings;
+        int status = -1;
+
+        progname = "test";
+        args[0] = "test";
+        args[1] = "-m";
+        args[2] = "mpe";
+
+        memset(&settings, 0, sizeof(settings));
+        settings.socketPath = path;
+        settings.workers = 1;
+        settings.queueLength = 4;
+
+        pid_t pid = fork();
+        if (pid == 0)
+            _exit(daemonServe(&settings, echoRequest, NULL) ? 0 : 1);
+
+        // The program name comes from the daemon, the rest from the client
+        int fd = requestWhenUp(path, 3, args, input, sizeof(input));
+        assert_equal(1, (fd >= 0));
+        assert_equal(1, daemonReadLine(fd, line, sizeof(line)));
+        assert_equal(0, strcmp("args test -m mpe", line));
+        assert_equal(1, daemonReadLine(fd, line, sizeof(line)));
+        assert_equal(0, strcmp("input 5", line));
+        assert_equal(1, daemonReadData(fd, echoed, sizeof(echoed)));
+        assert_equal(0, memcmp(input, echoed, sizeof(input)));
+        assert_equal(0, daemonReadLine(fd, line, sizeof(line)));
+        close(fd);
+
+        // Too large a request is turned down before it is sent
+        assert_equal(-1, daemonRequest(path, 3, args, input, DAEMON_MAX_INPUT + 1UL, message, sizeof(message)));
+
+        // A clean stop removes the socket
+        kill(pid, SIGTERM);
+        waitpid(pid, &status, 0);
+        assert_equal(1, (WIFEXITED(status) && WEXITSTATUS(status) == 0));
+        assert_equal(-1, access(path, F_OK));
+    });
+#endif
+
     it ("Should decode a PPM", {
         char *image = "P6\n2 2\n255\n\x1\x2\x3\x4\x5\x6\x7\x8\x9\xa\xb\xc";
         unsigned char *imageData;
@@ -107,5 +468,406 @@ describe ("Unit Tests", {
         assert_equal('\xc', imageData[11]);
 
         free(imageData);
-    })
+    });
+
+    it ("Should read a JPEG header", {
+        // SOI, COM "hi", DQT table 0 (all ones but the first entry), SOF2 for
+        // a 3x2 single component image using table 0, SOS
+        char *jpeg = "\xff\xd8"
+                     "\xff\xfe\x00\x04hi"
+                     "\xff\xdb\x00\x43\x00\x02"
+                     "\x01\x01\x01\x01\x01\x01\x01\x01\x01\x01\x01\x01\x01\x01\x01\x01"
+                     "\x01\x01\x01\x01\x01\x01\x01\x01\x01\x01\x01\x01\x01\x01\x01\x01"
+                     "\x01\x01\x01\x01\x01\x01\x01\x01\x01\x01\x01\x01\x01\x01\x01\x01"
+                     "\x01\x01\x01\x01\x01\x01\x01\x01\x01\x01\x01\x01\x01\x01\x01"
+                     "\xff\xc2\x00\x0b\x08\x00\x02\x00\x03\x01\x01\x11\x00"
+                     "\xff\xda";
+        unsigned long jpegSize = 2 + 6 + 69 + 13 + 2;
+        struct jpegHeader header;
+
+        assert_equal(1, readJpegHeader((unsigned char *) jpeg, jpegSize, &header, "hi"));
+        assert_equal(3, header.width);
+        assert_equal(2, header.height);
+        assert_equal(1, header.components);
+        assert_equal(1, header.progressive);
+        assert_equal(1, header.hasComment);
+        assert_equal(1, header.quantMask);
+        assert_equal(2, header.quant[0][0]);
+        assert_equal(1, header.quant[0][63]);
+
+        assert_equal(0, readJpegHeader((unsigned char *) jpeg, jpegSize - 2, &header, NULL));
+    });
+
+    it ("Should estimate JPEG quality", {
+        struct jpegHeader header;
+
+        memset(&header, 0, sizeof(header));
+        assert_equal(0, estimateJpegQuality(&header));
+
+        // All ones is what jpeg_set_quality() writes for the highest qualities
+        header.quantMask = 1;
+        for (int x = 0; x < 64; x++) {
+            header.quant[0][x] = 1;
+        }
+        assert_equal(99, estimateJpegQuality(&header));
+
+        // Baseline tables saturate at 255 around quality 11
+        for (int x = 0; x < 64; x++) {
+            header.quant[0][x] = 255;
+        }
+        assert_equal(11, estimateJpegQuality(&header));
+    });
+
+    it ("Should keep search results and priors in the cache", {
+        const char *path = "test/test.cache";
+        struct qualityPrior prior;
+        int quality = 0;
+        unsigned long size = 0;
+
+        remove(path);
+        struct cache *cache = cacheOpen(path);
+        assert_equal(1, (cache != NULL));
+
+        assert_equal(0, cacheLookup(cache, 42, &quality, &size));
+        assert_equal(1, cacheStore(cache, 42, 80, 12345));
+        assert_equal(1, cacheLookup(cache, 42, &quality, &size));
+        assert_equal(80, quality);
+        assert_equal(12345, (int) size);
+
+        // A new result replaces the old one
+        assert_equal(1, cacheStore(cache, 42, 70, 9000));
+        assert_equal(1, cacheLookup(cache, 42, &quality, &size));
+        assert_equal(70, quality);
+
+        // Qualities 70 and then 90 average to 80, 10 either way
+        assert_equal(0, cacheGetPrior(cache, 7, &prior));
+        assert_equal(0, (int) prior.count);
+        assert_equal(1, cacheUpdatePrior(cache, 7, 70, 8, 0));
+        assert_equal(1, cacheUpdatePrior(cache, 7, 90, 3, 1));
+        assert_equal(1, cacheGetPrior(cache, 7, &prior));
+        assert_equal(2, (int) prior.count);
+        assert_equal_float(80.0, prior.mean);
+        assert_equal_float(10.0, prior.deviation);
+        assert_equal(1, (int) prior.images[0]);
+        assert_equal(1, (int) prior.images[1]);
+        assert_equal(8, (int) prior.encodes[0]);
+        assert_equal(3, (int) prior.encodes[1]);
+
+        // Both outlive the process that stored them
+        cacheClose(cache);
+        cache = cacheOpen(path);
+        assert_equal(1, cacheLookup(cache, 42, &quality, &size));
+        assert_equal(70, quality);
+        assert_equal(9000, (int) size);
+        assert_equal(1, cacheGetPrior(cache, 7, &prior));
+        assert_equal(2, (int) prior.count);
+
+        cacheClose(cache);
+        remove(path);
+    });
+
+    it ("Should seed the search from a prior", {
+        struct searchBracket bracket;
+        struct qualityPrior prior;
+
+        memset(&prior, 0, sizeof(prior));
+        prior.mean = 72.4;
+        prior.deviation = 2.2;
+
+        // Too few images to go by
+        prior.count = 2;
+        bracketInit(&bracket, 1, 99);
+        assert_equal(0, bracketSeed(&bracket, &prior));
+        assert_equal(0, bracketSeed(&bracket, NULL));
+        assert_equal(50, bracketNext(&bracket));
+
+        // The mean first, then the edge 2 deviations away on the side
+        // that is left, then bisection between the two
+        prior.count = 3;
+        bracketInit(&bracket, 1, 99);
+        assert_equal(1, bracketSeed(&bracket, &prior));
+        assert_equal(72, bracketNext(&bracket));
+        assert_equal(0, bracketUpdate(&bracket, 72, 1, 30000));
+        assert_equal(78, bracketNext(&bracket));
+        assert_equal(0, bracketUpdate(&bracket, 78, 0, 40000));
+        assert_equal(75, bracketNext(&bracket));
+
+        // A mean outside the range starts at its end
+        prior.mean = 120;
+        bracketInit(&bracket, 1, 90);
+        assert_equal(1, bracketSeed(&bracket, &prior));
+        assert_equal(90, bracketNext(&bracket));
+    });
+
+    it ("Should parse a minimum saving", {
+        unsigned long bytes = 1;
+        float percent = 1;
+
+        assert_equal(1, parseMinSaving("2048", &bytes, &percent));
+        assert_equal(2048, (int) bytes);
+        assert_equal_float(0.0, percent);
+
+        assert_equal(1, parseMinSaving("1.5%", &bytes, &percent));
+        assert_equal(0, (int) bytes);
+        assert_equal_float(1.5, percent);
+
+        assert_equal(0, parseMinSaving("", &bytes, &percent));
+        assert_equal(0, parseMinSaving("%", &bytes, &percent));
+        assert_equal(0, parseMinSaving("abc", &bytes, &percent));
+        assert_equal(0, parseMinSaving("10k", &bytes, &percent));
+        assert_equal(0, parseMinSaving("5%%", &bytes, &percent));
+        assert_equal(0, parseMinSaving("-5", &bytes, &percent));
+    });
+
+    it ("Should parse a number within its range", {
+        float value = 1;
+
+        assert_equal(1, parseFloat("0.9999", 0, 1, &value));
+        assert_equal_float(0.9999f, value);
+
+        assert_equal(1, parseFloat("100", 0, 100, &value));
+        assert_equal_float(100.0, value);
+
+        assert_equal(0, parseFloat("", 0, 100, &value));
+        assert_equal(0, parseFloat("1x", 0, 100, &value));
+        assert_equal(0, parseFloat("101", 0, 100, &value));
+        assert_equal(0, parseFloat("-1", 0, 100, &value));
+        assert_equal(0, parseFloat("nan", 0, 100, &value));
+        assert_equal(0, parseFloat("inf", 0, 100, &value));
+        assert_equal(0, parseFloat("1e999", 0, 100, &value));
+        assert_equal_float(100.0, value);
+    });
+
+    it ("Should stop the search once it cannot save enough", {
+        struct searchBracket bracket;
+
+        // Without a minimum saving only the interval narrows
+        bracketInit(&bracket, 1, 99);
+        assert_equal(0, bracketUpdate(&bracket, 50, 0, 20000));
+        assert_equal(49, bracket.max);
+        assert_equal(0, bracketUpdate(&bracket, 25, 1, 19900));
+        assert_equal(26, bracket.min);
+        assert_equal(50, bracket.passQuality);
+        assert_equal(25, bracket.failQuality);
+
+        // 20000 at the pass and 19500 at the fail leave at most 500 bytes
+        bracketInit(&bracket, 1, 99);
+        bracket.minSaving = 1000;
+        assert_equal(0, bracketUpdate(&bracket, 50, 0, 20000));
+        assert_equal(1, bracketUpdate(&bracket, 25, 1, 19500));
+        assert_equal(50, bracket.min);
+        assert_equal(50, bracket.max);
+
+        bracketInit(&bracket, 1, 99);
+        bracket.minSaving = 400;
+        assert_equal(0, bracketUpdate(&bracket, 50, 0, 20000));
+        assert_equal(0, bracketUpdate(&bracket, 25, 1, 19500));
+
+        // 500 bytes is 2.5% of the pass size
+        bracketInit(&bracket, 1, 99);
+        bracket.minSavingPercent = 5;
+        assert_equal(0, bracketUpdate(&bracket, 50, 0, 20000));
+        assert_equal(1, bracketUpdate(&bracket, 25, 1, 19500));
+
+        bracketInit(&bracket, 1, 99);
+        bracket.minSavingPercent = 2;
+        assert_equal(0, bracketUpdate(&bracket, 50, 0, 20000));
+        assert_equal(0, bracketUpdate(&bracket, 25, 1, 19500));
+    });
+
+    it ("Should stop the search at the deadline", {
+        int width = 64;
+        int height = 64;
+        unsigned char *gray = malloc(width * height);
+        struct fakeCodec fake;
+        struct searchCodec codec;
+        struct searchSettings settings;
+        struct searchReference ref;
+        struct searchResult result;
+
+        memset(gray, 100, width * height);
+        fake.gray = gray;
+        fake.width = width;
+        fake.height = height;
+
+        memset(&codec, 0, sizeof(codec));
+        codec.opaque = &fake;
+        codec.blockSize = 8;
+        codec.encode = fakeEncode;
+        codec.decodeLuma = fakeDecodeLuma;
+
+        memset(&settings, 0, sizeof(settings));
+        settings.method = MPE;
+        settings.target = 10.5;
+        settings.qMin = 1;
+        settings.qMax = 99;
+        settings.attempts = 8;
+        settings.startTime = getTimeMs();
+
+        // With time to spare, the lowest quality within 10 levels of 100
+        assert_equal(1, searchReferenceInit(&ref, &settings, gray, width, height));
+        assert_equal(SEARCH_DONE, searchQuality(&settings, &codec, &ref, &result));
+        assert_equal(90, result.quality);
+        assert_equal(1, (strcmp("deadline", result.stopReason) != 0));
+        free(result.data);
+
+        // Already out of time, it keeps what the first step made
+        settings.startTime = getTimeMs() - 5000;
+        settings.deadlineMs = 1000;
+        assert_equal(SEARCH_DONE, searchQuality(&settings, &codec, &ref, &result));
+        assert_equal(1, (strcmp("deadline", result.stopReason) == 0));
+        assert_equal(1, result.encodes);
+        assert_equal(50, result.quality);
+        free(result.data);
+
+        searchReferenceFree(&ref);
+        free(gray);
+    });
+
+    it ("Should estimate SSIM from JPEG coefficients", {
+        int width = 100;
+        int height = 76;
+        unsigned char *gray = malloc(width * height);
+        unsigned char *jpeg = NULL;
+        unsigned char *decoded = NULL;
+        int decodedWidth;
+        int decodedHeight;
+        struct dctReference ref;
+        struct dctReference other;
+
+        // A gradient with texture, over partial blocks at the edges
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++)
+                gray[y * width + x] = x + y + ((x * 7 + y * 13) % 11) * 4;
+        }
+
+        assert_equal(1, dctReferenceInit(&ref, gray, width, height));
+        assert_equal(1, (fabs(dctSsimPixels(&ref, gray) - 1) < 1e-4));
+
+        // The estimate follows the metric measured on the decode
+        unsigned long size = encodeJpeg(&jpeg, gray, width, height, JCS_GRAYSCALE, 85, 0, 1, SUBSAMPLE_DEFAULT);
+        assert_equal(1, (size > 0));
+        decodeJpeg(jpeg, size, &decoded, &decodedWidth, &decodedHeight, JCS_GRAYSCALE);
+        assert_equal(width, decodedWidth);
+
+        float estimate = dctSsimJpeg(&ref, jpeg, size);
+        float measured = dctSsimPixels(&ref, decoded);
+        assert_equal(1, (measured < 0.999));
+        assert_equal(1, (fabs(estimate - measured) < 0.01));
+
+        // Nothing for a broken JPEG or one of another size
+        assert_equal_float(-1.0, dctSsimJpeg(&ref, jpeg, 20));
+        assert_equal(1, dctReferenceInit(&other, gray, width - 8, height));
+        assert_equal_float(-1.0, dctSsimJpeg(&other, jpeg, size));
+
+        dctReferenceFree(&other);
+        dctReferenceFree(&ref);
+        free(decoded);
+        free(jpeg);
+        free(gray);
+    });
+
+    it ("Should score SmallFry without overflowing on large images", {
+        int width = 1536;
+        int height = 1024;
+        unsigned char *orig = malloc((size_t) width * height);
+        unsigned char *cmp = malloc((size_t) width * height);
+        uint32_t seed = 1;
+        uint64_t sse;
+
+        // Noise against its negative, with a few flat blocks so some
+        // edges fall between the blockiness ratios
+        for (int i = 0; i < width * height; i++) {
+            seed = seed * 1103515245 + 12345;
+            orig[i] = seed >> 24;
+            cmp[i] = (i / width) % 64 < 8 ? orig[i] : 255 - orig[i];
+        }
+
+        double expected = smallfryReference(orig, cmp, width, height, &sse);
+        double metric = smallfry_metric(orig, cmp, width, height);
+
+        // The squared error is past what the old 32-bit sum could hold
+        assert_equal(1, (sse > UINT32_MAX));
+        assert_equal(1, (fabs(metric - expected) < 1e-6 * fabs(expected)));
+
+        free(orig);
+        free(cmp);
+    });
+
+    it ("Should predict the metric from the surrogate", {
+        struct surrogateFit fit;
+        float metric = 0;
+
+        // metric = 2 * psnr + 20, which needs two distinct pairs
+        surrogateInit(&fit, SURROGATE_LINEAR);
+        surrogateAdd(&fit, 30, 80);
+        assert_equal(0, surrogatePredict(&fit, 35, 50, &metric));
+        surrogateAdd(&fit, 40, 100);
+        assert_equal(1, surrogatePredict(&fit, 35, 50, &metric));
+        assert_equal(1, (metric > 89.99 && metric < 90.01));
+
+        // Nothing outside the pairs, or too close to the target to call
+        assert_equal(0, surrogatePredict(&fit, 45, 50, &metric));
+        assert_equal(0, surrogatePredict(&fit, 25, 50, &metric));
+        assert_equal(0, surrogatePredict(&fit, 35, 88, &metric));
+
+        // Pairs at one surrogate value give no slope
+        surrogateInit(&fit, SURROGATE_LINEAR);
+        surrogateAdd(&fit, 30, 80);
+        surrogateAdd(&fit, 30, 90);
+        assert_equal(0, surrogatePredict(&fit, 30, 50, &metric));
+
+        // Similarities are fitted on log(1 - m), here -3 at 30 and -5 at
+        // 40, and a similarity of 1 cannot be
+        surrogateInit(&fit, SURROGATE_SIMILARITY);
+        surrogateAdd(&fit, 30, 0.950213);
+        surrogateAdd(&fit, 50, 1);
+        surrogateAdd(&fit, 40, 0.993262);
+        assert_equal(2, fit.count);
+        assert_equal(1, surrogatePredict(&fit, 35, 0.9, &metric));
+        assert_equal(1, (metric > 0.9816 && metric < 0.9818));
+    });
+
+    it ("Should sample tiles across the range of detail", {
+        int width = 256;
+        int height = 256;
+        unsigned char *gray = malloc(width * height);
+        struct samplePlan plan;
+
+        // 8 x 8 tiles, each a checkerboard whose contrast grows with its index
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                int tile = (y / 32) * 8 + x / 32;
+                gray[y * width + x] = (x + y) % 2 ? 128 + tile : 128 - tile;
+            }
+        }
+
+        // A quarter of 64 tiles is 16, in a 4 x 4 grid, one from the middle
+        // of each stratum of 4
+        assert_equal(1, samplePlanInit(&plan, gray, width, height, 32, 25));
+        assert_equal(16, plan.count);
+        assert_equal(4, plan.columns);
+        assert_equal(128, plan.width);
+        assert_equal(128, plan.height);
+
+        for (int i = 0; i < plan.count; i++) {
+            int tile = 4 * i + 2;
+            assert_equal((tile % 8) * 32, plan.x[i]);
+            assert_equal((tile / 8) * 32, plan.y[i]);
+        }
+
+        // The tile in the second column of the sample is tile 6
+        assert_equal(128 - 6, plan.reference[32]);
+        assert_equal(128 + 6, plan.reference[33]);
+
+        samplePlanFree(&plan);
+
+        // Too few tiles to be worth it, or all of them
+        assert_equal(0, samplePlanInit(&plan, gray, width, height, 32, 5));
+        assert_equal(0, plan.count);
+        assert_equal(0, samplePlanInit(&plan, gray, width, height, 32, 100));
+        assert_equal(0, samplePlanInit(&plan, gray, 100, 100, 32, 50));
+
+        free(gray);
+    });
 });